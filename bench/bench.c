@@ -0,0 +1,702 @@
+#include <pmu-events/_impl/pmu-events.h>
+#include <pmu-events/event-parser.h>
+#include <pmu-events/event-set.h>
+#include <pmu-events/pmu-events.h>
+#include <pmu-events/self-monitor.h>
+#include <pmu-events/sysfs.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Times the hot paths of discovering PMUs, looking up events and generating
+ * perf_event_attrs, for the tables of every model in pmu_events_map.
+ *
+ * Every measurement also counts the allocations and the I/O calls (open(), read(),
+ * opendir(), ...) done in it. The linker redirects these functions to the __wrap_
+ * functions below, see CMakeLists.txt.
+ */
+
+#define DEFAULT_REPEATS 20
+
+static size_t num_allocs;
+static size_t num_io_calls;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t num, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+char* __real_strdup(const char* str);
+char* __real_strndup(const char* str, size_t len);
+int __real_open(const char* path, int flags, ...);
+int __real_openat(int dir_fd, const char* path, int flags, ...);
+ssize_t __real_read(int fd, void* buf, size_t count);
+int __real_close(int fd);
+DIR* __real_opendir(const char* path);
+DIR* __real_fdopendir(int fd);
+int __real_closedir(DIR* dir);
+FILE* __real_fopen(const char* path, const char* mode);
+int __real_fclose(FILE* file);
+int __real_access(const char* path, int mode);
+
+void* __wrap_malloc(size_t size)
+{
+    num_allocs++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t num, size_t size)
+{
+    num_allocs++;
+    return __real_calloc(num, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+    num_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+char* __wrap_strdup(const char* str)
+{
+    num_allocs++;
+    return __real_strdup(str);
+}
+
+char* __wrap_strndup(const char* str, size_t len)
+{
+    num_allocs++;
+    return __real_strndup(str, len);
+}
+
+int __wrap_open(const char* path, int flags, ...)
+{
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = (flags & O_CREAT) ? va_arg(args, mode_t) : 0;
+    va_end(args);
+
+    num_io_calls++;
+    return __real_open(path, flags, mode);
+}
+
+int __wrap_openat(int dir_fd, const char* path, int flags, ...)
+{
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = (flags & O_CREAT) ? va_arg(args, mode_t) : 0;
+    va_end(args);
+
+    num_io_calls++;
+    return __real_openat(dir_fd, path, flags, mode);
+}
+
+ssize_t __wrap_read(int fd, void* buf, size_t count)
+{
+    num_io_calls++;
+    return __real_read(fd, buf, count);
+}
+
+int __wrap_close(int fd)
+{
+    num_io_calls++;
+    return __real_close(fd);
+}
+
+DIR* __wrap_opendir(const char* path)
+{
+    num_io_calls++;
+    return __real_opendir(path);
+}
+
+DIR* __wrap_fdopendir(int fd)
+{
+    num_io_calls++;
+    return __real_fdopendir(fd);
+}
+
+int __wrap_closedir(DIR* dir)
+{
+    num_io_calls++;
+    return __real_closedir(dir);
+}
+
+FILE* __wrap_fopen(const char* path, const char* mode)
+{
+    num_io_calls++;
+    return __real_fopen(path, mode);
+}
+
+int __wrap_fclose(FILE* file)
+{
+    num_io_calls++;
+    return __real_fclose(file);
+}
+
+int __wrap_access(const char* path, int mode)
+{
+    num_io_calls++;
+    return __real_access(path, mode);
+}
+
+/*
+ * The measurements of one benchmark: the time per call of every sample,
+ * where a sample is a single call or a pass over all events of a table
+ */
+struct bench
+{
+    const char* name;
+    double* samples;
+    size_t num_samples;
+    size_t cap_samples;
+    size_t num_calls;
+    size_t num_failed;
+    size_t num_allocs;
+    size_t num_io_calls;
+};
+
+struct sample
+{
+    struct timespec start;
+    size_t allocs;
+    size_t io_calls;
+};
+
+static void add_sample(struct bench* bench, double sample)
+{
+    if (bench->num_samples == bench->cap_samples)
+    {
+        bench->cap_samples = bench->cap_samples ? bench->cap_samples * 2 : 64;
+        bench->samples = realloc(bench->samples, bench->cap_samples * sizeof(double));
+        if (bench->samples == NULL)
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    bench->samples[bench->num_samples++] = sample;
+}
+
+static void begin_sample(struct sample* sample)
+{
+    sample->allocs = num_allocs;
+    sample->io_calls = num_io_calls;
+    clock_gettime(CLOCK_MONOTONIC, &sample->start);
+}
+
+static void end_sample(struct bench* bench, const struct sample* sample, size_t num_calls)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (num_calls == 0)
+    {
+        return;
+    }
+
+    /* Before add_sample(), whose allocations are not part of the sample */
+    bench->num_allocs += num_allocs - sample->allocs;
+    bench->num_io_calls += num_io_calls - sample->io_calls;
+    bench->num_calls += num_calls;
+
+    double elapsed =
+        (end.tv_sec - sample->start.tv_sec) * 1e9 + (end.tv_nsec - sample->start.tv_nsec);
+    add_sample(bench, elapsed / num_calls);
+}
+
+/* Adds the samples and counts of "bench" to "total" */
+static void merge_bench(struct bench* total, const struct bench* bench)
+{
+    for (size_t i = 0; i < bench->num_samples; i++)
+    {
+        add_sample(total, bench->samples[i]);
+    }
+    total->num_calls += bench->num_calls;
+    total->num_failed += bench->num_failed;
+    total->num_allocs += bench->num_allocs;
+    total->num_io_calls += bench->num_io_calls;
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const struct bench* bench, double p)
+{
+    size_t idx = (size_t)(p / 100 * (bench->num_samples - 1) + 0.5);
+    return bench->samples[idx];
+}
+
+static void print_header(void)
+{
+    printf("%-36s %9s %9s %9s %9s %9s %11s %9s %7s\n", "benchmark", "calls", "p50 ns", "p90 ns",
+           "p99 ns", "max ns", "allocs/call", "io/call", "failed");
+}
+
+static void print_bench(struct bench* bench)
+{
+    if (bench->num_samples == 0)
+    {
+        printf("%-36s %9s\n", bench->name, "skipped");
+        return;
+    }
+
+    qsort(bench->samples, bench->num_samples, sizeof(double), compare_doubles);
+    printf("%-36s %9zu %9.1f %9.1f %9.1f %9.1f %11.2f %9.2f %7zu\n", bench->name, bench->num_calls,
+           percentile(bench, 50), percentile(bench, 90), percentile(bench, 99),
+           bench->samples[bench->num_samples - 1], (double)bench->num_allocs / bench->num_calls,
+           (double)bench->num_io_calls / bench->num_calls, bench->num_failed);
+}
+
+static void reset_bench(struct bench* bench, const char* name)
+{
+    free(bench->samples);
+    memset(bench, 0, sizeof(*bench));
+    bench->name = name;
+}
+
+/*
+ * Finds a cpuid that map_for_cpu() resolves to "map", or returns NULL if there is none,
+ * e.g. for the common and test tables, or for rows shadowed by more specific earlier rows
+ * of the mapfile, such as the AMD catch-all rows
+ */
+static const char* find_cpuid_for_map(const struct pmu_events_map* map, char* buf, size_t size)
+{
+#ifdef __x86_64__
+    /* The x86 cpuids are regular expressions, so try the cpuids of all models */
+    static const struct
+    {
+        const char* vendor;
+        int family;
+    } cpus[] = { { "GenuineIntel", 6 },
+                 { "AuthenticAMD", 23 },
+                 { "AuthenticAMD", 25 },
+                 { "AuthenticAMD", 26 } };
+    static const char* steppings[] = { "", "-0", "-4", "-5", "-F" };
+
+    for (size_t i = 0; i < sizeof(cpus) / sizeof(cpus[0]); i++)
+    {
+        for (int model = 0; model < 256; model++)
+        {
+            for (size_t x = 0; x < sizeof(steppings) / sizeof(steppings[0]); x++)
+            {
+                snprintf(buf, size, "%s-%d-%X%s", cpus[i].vendor, cpus[i].family, model,
+                         steppings[x]);
+                if (strcmp_cpuid_str(map->cpuid, buf) == 0 && map_for_cpuid(buf) == map)
+                {
+                    return buf;
+                }
+            }
+        }
+    }
+#else
+    (void)buf;
+    (void)size;
+    if (strcmp_cpuid_str(map->cpuid, map->cpuid) == 0 && map_for_cpuid(map->cpuid) == map)
+    {
+        return map->cpuid;
+    }
+#endif
+    return NULL;
+}
+
+enum
+{
+    BENCH_MAP_FOR_CPU,
+    BENCH_DECOMPRESS_EVENT,
+    BENCH_GET_EVENT_BY_NAME,
+    BENCH_GEN_ATTR_FOR_EVENT,
+    BENCH_EVENT_ITER_GLOB,
+    NUM_TABLE_BENCHES
+};
+
+static const char* table_bench_names[NUM_TABLE_BENCHES] = {
+    [BENCH_MAP_FOR_CPU] = "map_for_cpu (PERF_CPUID)",
+    [BENCH_DECOMPRESS_EVENT] = "decompress_event",
+    [BENCH_GET_EVENT_BY_NAME] = "get_event_by_name",
+    [BENCH_GEN_ATTR_FOR_EVENT] = "gen_attr_for_event",
+    [BENCH_EVENT_ITER_GLOB] = "event_iter (glob)",
+};
+
+/*
+ * Runs the table benchmarks on the tables of "map", adding the samples to "benches"
+ */
+static void bench_map(const struct pmu_events_map* map, struct pmu_instance* core,
+                      struct bench* benches, int repeats)
+{
+    struct sample sample;
+    char buf[64];
+
+    const char* cpuid = find_cpuid_for_map(map, buf, sizeof(buf));
+    if (cpuid != NULL)
+    {
+        setenv("PERF_CPUID", cpuid, 1);
+        struct perf_cpu cpu = { .cpu = -1 };
+        for (int r = 0; r < repeats; r++)
+        {
+            begin_sample(&sample);
+            const struct pmu_events_map* found = map_for_cpu(cpu);
+            end_sample(&benches[BENCH_MAP_FOR_CPU], &sample, 1);
+            benches[BENCH_MAP_FOR_CPU].num_failed += found != map;
+        }
+        unsetenv("PERF_CPUID");
+    }
+
+    for (uint32_t cur_pmu = 0; cur_pmu < map->event_table.num_pmus; cur_pmu++)
+    {
+        const struct pmu_table_entry* entry = &map->event_table.pmus[cur_pmu];
+        struct pmu_instance instance = *core;
+        instance.entries = entry->entries;
+        instance.num_entries = entry->num_entries;
+
+        struct pmu_event* events = malloc(entry->num_entries * sizeof(struct pmu_event));
+        if (events == NULL)
+        {
+            perror("malloc");
+            exit(1);
+        }
+
+        for (int r = 0; r < repeats; r++)
+        {
+            begin_sample(&sample);
+            for (uint32_t x = 0; x < entry->num_entries; x++)
+            {
+                decompress_event(entry->entries[x].offset, &events[x]);
+            }
+            end_sample(&benches[BENCH_DECOMPRESS_EVENT], &sample, entry->num_entries);
+
+            size_t failed = 0;
+            begin_sample(&sample);
+            for (uint32_t x = 0; x < entry->num_entries; x++)
+            {
+                struct pmu_event ev;
+                failed += get_event_by_name(&instance, events[x].name, &ev) == -1;
+            }
+            end_sample(&benches[BENCH_GET_EVENT_BY_NAME], &sample, entry->num_entries);
+            benches[BENCH_GET_EVENT_BY_NAME].num_failed += failed;
+
+            failed = 0;
+            begin_sample(&sample);
+            for (uint32_t x = 0; x < entry->num_entries; x++)
+            {
+                struct perf_event_attr attr;
+                memset(&attr, 0, sizeof(attr));
+                failed += gen_attr_for_event(&instance, &events[x], &attr) == -1;
+            }
+            end_sample(&benches[BENCH_GEN_ATTR_FOR_EVENT], &sample, entry->num_entries);
+            benches[BENCH_GEN_ATTR_FOR_EVENT].num_failed += failed;
+
+            /* A wildcard over the events sharing the first characters of the middle one */
+            if (entry->num_entries == 0)
+            {
+                continue;
+            }
+            char pattern[8];
+            snprintf(pattern, sizeof(pattern), "%.4s*", events[entry->num_entries / 2].name);
+            struct event_iter iter;
+            begin_sample(&sample);
+            if (init_event_iter(&iter, &instance, pattern, EVENT_MATCH_GLOB) == 0)
+            {
+                struct pmu_event ev;
+                while (next_event(&iter, &ev) == 0)
+                {
+                }
+                free_event_iter(&iter);
+            }
+            else
+            {
+                benches[BENCH_EVENT_ITER_GLOB].num_failed++;
+            }
+            end_sample(&benches[BENCH_EVENT_ITER_GLOB], &sample, 1);
+        }
+
+        free(events);
+    }
+}
+
+/*
+ * Returns the first instance of the core PMU class of "pmus", or NULL if there is none
+ */
+static const struct pmu_instance* find_core_instance(const struct pmus* pmus)
+{
+    for (size_t i = 0; i < pmus->num_classes; i++)
+    {
+        if (strcmp(pmus->classes[i].name, "default_core") == 0 &&
+            pmus->classes[i].num_instances > 0)
+        {
+            return &pmus->classes[i].instances[0];
+        }
+    }
+    return NULL;
+}
+
+static void print_help(void)
+{
+    fprintf(stderr, "./pmu-events-bench [-r REPEATS] [-s SNAPSHOT] [-v]\n");
+    fprintf(stderr, "  -r REPEATS  repeat every measurement REPEATS times (default %d)\n",
+            DEFAULT_REPEATS);
+    fprintf(stderr, "  -s SNAPSHOT replay the sysfs snapshot SNAPSHOT (default %s)\n",
+            PMU_EVENTS_BENCH_SNAPSHOT);
+    fprintf(stderr, "  -v          also print the results of every model\n");
+}
+
+int main(int argc, char* argv[])
+{
+    int repeats = DEFAULT_REPEATS;
+    int verbose = 0;
+    const char* snapshot_path = PMU_EVENTS_BENCH_SNAPSHOT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:s:vh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        case 's':
+            snapshot_path = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            print_help();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (repeats <= 0)
+    {
+        print_help();
+        return 1;
+    }
+
+    struct bench bench = { 0 };
+    struct sample sample;
+    print_header();
+
+    /* Discovery of the PMUs of this system, and the cached map of its CPUs */
+    reset_bench(&bench, "get_pmus");
+    for (int r = 0; r < repeats; r++)
+    {
+        struct pmus pmus;
+        begin_sample(&sample);
+        int ret = get_pmus(&pmus);
+        end_sample(&bench, &sample, 1);
+        if (ret == -1)
+        {
+            bench.num_failed++;
+            continue;
+        }
+        free_pmus(&pmus);
+    }
+    print_bench(&bench);
+
+    reset_bench(&bench, "map_for_cpu (cached)");
+    unsetenv("PERF_CPUID");
+    for (int r = 0; r < repeats; r++)
+    {
+        struct perf_cpu cpu = { .cpu = 0 };
+        begin_sample(&sample);
+        bench.num_failed += map_for_cpu(cpu) == NULL;
+        end_sample(&bench, &sample, 1);
+    }
+    print_bench(&bench);
+
+    /* Reading a group of software events, as in a sampling loop */
+    reset_bench(&bench, "event_reader_read");
+    struct perf_event_attr attrs[2];
+    memset(attrs, 0, sizeof(attrs));
+    attrs[0].type = PERF_TYPE_SOFTWARE;
+    attrs[0].config = PERF_COUNT_SW_CPU_CLOCK;
+    attrs[1].type = PERF_TYPE_SOFTWARE;
+    attrs[1].config = PERF_COUNT_SW_TASK_CLOCK;
+    struct event_set set;
+    struct event_reader reader;
+    init_event_set(&set);
+    if (event_set_add_attrs(&set, attrs, 2, 0, MetricGroupEvents) == 0 &&
+        init_event_reader(&reader, &set) == 0)
+    {
+        event_set_enable(&set);
+        for (int r = 0; r < repeats; r++)
+        {
+            begin_sample(&sample);
+            bench.num_failed += event_reader_read(&reader) == -1;
+            end_sample(&bench, &sample, 1);
+        }
+        free_event_reader(&reader);
+    }
+    else
+    {
+        bench.num_failed++;
+    }
+    free_event_set(&set);
+    print_bench(&bench);
+
+    /*
+     * A measured region of the calling thread: read with rdpmc if the instructions can be
+     * counted on this system, with read() of the task clock otherwise
+     */
+    reset_bench(&bench, "self_monitor begin/end");
+    struct self_monitor monitor;
+    init_self_monitor(&monitor);
+    memset(attrs, 0, sizeof(attrs));
+    attrs[0].type = PERF_TYPE_HARDWARE;
+    attrs[0].config = PERF_COUNT_HW_INSTRUCTIONS;
+    attrs[0].exclude_kernel = 1;
+    attrs[1].type = PERF_TYPE_SOFTWARE;
+    attrs[1].config = PERF_COUNT_SW_TASK_CLOCK;
+    if (self_monitor_add_attr(&monitor, &attrs[0], "instructions") == 0 ||
+        self_monitor_add_attr(&monitor, &attrs[1], "task-clock") == 0)
+    {
+        struct event_delta delta;
+        for (int r = 0; r < repeats; r++)
+        {
+            begin_sample(&sample);
+            bench.num_failed += self_monitor_begin(&monitor) == -1;
+            bench.num_failed += self_monitor_end(&monitor, &delta) == -1;
+            end_sample(&bench, &sample, 1);
+        }
+    }
+    else
+    {
+        bench.num_failed++;
+    }
+    free_self_monitor(&monitor);
+    print_bench(&bench);
+
+    /* Discovery of the PMUs of a recorded system, independent of this one */
+    struct sysfs_snapshot snapshot;
+    if (open_sysfs_snapshot(snapshot_path, &snapshot) == -1)
+    {
+        fprintf(stderr, "Could not read the snapshot %s\n", snapshot_path);
+        return 1;
+    }
+    struct pmu_sysfs sysfs = { .snapshot = &snapshot };
+    reset_bench(&bench, "get_pmus_from (snapshot)");
+    for (int r = 0; r < repeats; r++)
+    {
+        struct pmus pmus;
+        begin_sample(&sample);
+        int ret = get_pmus_from(&sysfs, &pmus);
+        end_sample(&bench, &sample, 1);
+        if (ret == -1)
+        {
+            bench.num_failed++;
+            continue;
+        }
+        free_pmus(&pmus);
+    }
+    print_bench(&bench);
+
+    /*
+     * The tables of every model, with the formats of the core PMU of the snapshot. Events
+     * using other fields, e.g. of uncore PMUs, are counted as failed by gen_attr_for_event.
+     */
+    struct pmus snapshot_pmus;
+    const struct pmu_instance* snapshot_core = NULL;
+    if (get_pmus_from(&sysfs, &snapshot_pmus) == 0)
+    {
+        snapshot_core = find_core_instance(&snapshot_pmus);
+    }
+    if (snapshot_core == NULL)
+    {
+        fprintf(stderr, "The snapshot %s has no core PMU\n", snapshot_path);
+        return 1;
+    }
+    struct pmu_instance core = *snapshot_core;
+
+    /* Event strings naming the first events of the core PMU, as users pass them */
+    char event_strs[64][128];
+    size_t num_event_strs = 0;
+    for (; num_event_strs < 64 && num_event_strs < core.num_entries; num_event_strs++)
+    {
+        snprintf(event_strs[num_event_strs], sizeof(event_strs[0]), "%s/%s/u", core.name,
+                 get_event_name(core.entries[num_event_strs]));
+    }
+    struct parsed_event parsed;
+    reset_bench(&bench, "parse_event");
+    for (int r = 0; r < repeats; r++)
+    {
+        begin_sample(&sample);
+        for (size_t i = 0; i < num_event_strs; i++)
+        {
+            bench.num_failed += parse_event(&snapshot_pmus, event_strs[i], &parsed) == -1;
+        }
+        end_sample(&bench, &sample, num_event_strs);
+    }
+    print_bench(&bench);
+
+    reset_bench(&bench, "event_parser_parse (cached)");
+    struct event_parser parser;
+    init_event_parser(&parser, &snapshot_pmus);
+    for (size_t i = 0; i < num_event_strs; i++)
+    {
+        event_parser_parse(&parser, event_strs[i], &parsed);
+    }
+    for (int r = 0; r < repeats; r++)
+    {
+        begin_sample(&sample);
+        for (size_t i = 0; i < num_event_strs; i++)
+        {
+            bench.num_failed += event_parser_parse(&parser, event_strs[i], &parsed) == -1;
+        }
+        end_sample(&bench, &sample, num_event_strs);
+    }
+    free_event_parser(&parser);
+    print_bench(&bench);
+
+    struct bench totals[NUM_TABLE_BENCHES] = { 0 };
+    for (int i = 0; i < NUM_TABLE_BENCHES; i++)
+    {
+        totals[i].name = table_bench_names[i];
+    }
+
+    for (const struct pmu_events_map* map = pmu_events_map; map->arch; map++)
+    {
+        struct bench benches[NUM_TABLE_BENCHES] = { 0 };
+        for (int i = 0; i < NUM_TABLE_BENCHES; i++)
+        {
+            benches[i].name = table_bench_names[i];
+        }
+
+        bench_map(map, &core, benches, repeats);
+
+        if (verbose)
+        {
+            printf("%s/%s\n", map->arch, map->cpuid);
+        }
+        for (int i = 0; i < NUM_TABLE_BENCHES; i++)
+        {
+            if (verbose)
+            {
+                print_bench(&benches[i]);
+            }
+            merge_bench(&totals[i], &benches[i]);
+            free(benches[i].samples);
+        }
+    }
+
+    if (verbose)
+    {
+        printf("all models\n");
+    }
+    for (int i = 0; i < NUM_TABLE_BENCHES; i++)
+    {
+        print_bench(&totals[i]);
+        free(totals[i].samples);
+    }
+
+    free_pmus(&snapshot_pmus);
+    close_sysfs_snapshot(&snapshot);
+    free(bench.samples);
+    return 0;
+}
@@ -1,4 +1,6 @@
 #include <assert.h>
+#include <pmu-events/event-parser.h>
+#include <pmu-events/event-set.h>
 #include <pmu-events/pmu-events.h>
 
 #include <errno.h>
@@ -7,13 +9,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/syscall.h>
 #include <unistd.h>
 
 void print_pmu_event(struct pmu_event* ev)
 {
     printf("  NAME: %s\n", ev->name);
     printf("    compat: %s\n", ev->compat);
+    printf("    counters: %s\n", ev->counters);
     printf("    event: %s\n", ev->event);
     printf("    desc: %s\n", ev->desc);
     printf("    topic: %s\n", ev->topic);
@@ -37,14 +39,15 @@ void print_pmu_event(struct pmu_event* ev)
 void print_help()
 {
     fprintf(stderr, "./pmu-events-example COMMAND [ARGS]\n");
-    fprintf(stderr, "./pmu-events-example list\n");
-    fprintf(stderr, "./pmu-events-example read EVENT\n");
+    fprintf(stderr, "./pmu-events-example list [PATTERN]\n");
+    fprintf(stderr, "./pmu-events-example read EVENT [EVENT...]\n");
+    fprintf(stderr, "./pmu-events-example parse EVENT_STRING [EVENT_STRING...]\n");
 }
 
 /*
- * Lists all available events for CPU 0
+ * Lists all available events for CPU 0, or only those matching the wildcard "pattern"
  */
-void list_events()
+void list_events(const char* pattern)
 {
 
     struct pmus pmus;
@@ -86,14 +89,18 @@ void list_events()
         }
         printf("EVENTS:\n");
 
-        for (int x = 0; x < pmu_class->instances[0].num_entries; x++)
+        struct event_iter iter;
+        if (init_event_iter(&iter, &pmu_class->instances[0], pattern, EVENT_MATCH_GLOB) == -1)
+        {
+            continue;
+        }
+        struct pmu_event ev;
+        while (next_event(&iter, &ev) == 0)
         {
-            struct pmu_event ev;
-            decompress_event(pmu_class->instances[0].entries[x].offset, &ev);
-
             print_pmu_event(&ev);
             printf("\n\n");
         }
+        free_event_iter(&iter);
     }
 
     free_pmus(&pmus);
@@ -106,26 +113,40 @@ void signal_handler(int signal)
     stop = true;
 }
 
-struct whole_ev
+struct instance_evs
 {
     struct pmu_instance* instance;
-    struct pmu_event ev;
-    struct perf_event_attr attr;
-    int fd;
+    struct pmu_event* evs;
+    int num_evs;
+    /* Index of the first count of the instance in the event set */
+    int first;
+    /* The number of CPUs the events were opened on */
+    size_t num_cpus;
 };
 
 /*
- * Looks up the event "ev" on cpu 0
- * and then reads it using perf every second
+ * Looks up the events "evs" in all PMU instances, opens the events found in an instance
+ * as one perf group on every CPU of the instance and reads them every second
  */
-void read_event(char* ev)
+void read_events(char** evs, int num_evs)
 {
     struct pmus pmus;
 
     get_pmus(&pmus);
 
-    struct whole_ev* evs = NULL;
-    int num_evs = 0;
+    struct cpu_topology topology;
+    if (get_cpu_topology(&topology) == -1)
+    {
+        fprintf(stderr, "Could not read the CPU topology!\n");
+        free_pmus(&pmus);
+        return;
+    }
+
+    struct event_set set;
+    init_event_set(&set);
+
+    struct instance_evs* instances = NULL;
+    int num_instances = 0;
 
     for (size_t cur_class_id = 0; cur_class_id < pmus.num_classes; cur_class_id++)
     {
@@ -135,75 +156,157 @@ void read_event(char* ev)
         {
             struct pmu_instance* cur_instance = &pmu_class->instances[cur_instance_id];
 
-            struct pmu_event pmu_ev;
-            if (get_event_by_name(cur_instance, ev, &pmu_ev) == 0)
+            /* perpkg events are opened once per package, so separately from the others */
+            for (int perpkg = 0; perpkg < 2; perpkg++)
             {
-                num_evs++;
-                evs = realloc(evs, sizeof(struct whole_ev) * num_evs);
-                evs[num_evs - 1].ev = pmu_ev;
-                evs[num_evs - 1].instance = cur_instance;
+                struct instance_evs found = { .instance = cur_instance };
+
+                for (int ev_id = 0; ev_id < num_evs; ev_id++)
+                {
+                    struct pmu_event pmu_ev;
+                    if (get_event_by_name(cur_instance, evs[ev_id], &pmu_ev) == 0 &&
+                        pmu_ev.perpkg == perpkg)
+                    {
+                        found.num_evs++;
+                        found.evs = realloc(found.evs, sizeof(struct pmu_event) * found.num_evs);
+                        found.evs[found.num_evs - 1] = pmu_ev;
+                    }
+                }
+
+                if (found.num_evs == 0)
+                {
+                    continue;
+                }
+
+                found.first = event_set_add_events_topology(&set, cur_instance, found.evs,
+                                                            found.num_evs, MetricGroupEvents,
+                                                            &topology, &found.num_cpus);
+                if (found.first == -1)
+                {
+                    fprintf(stderr, "Could not open the events of %s: %s!\n",
+                            cur_instance->name, strerror(errno));
+                    free(found.evs);
+                    continue;
+                }
+
+                num_instances++;
+                instances = realloc(instances, sizeof(struct instance_evs) * num_instances);
+                instances[num_instances - 1] = found;
             }
         }
     }
 
-    if (num_evs == 0)
+    if (num_instances == 0)
     {
+        free_event_set(&set);
+        free_cpu_topology(&topology);
         free_pmus(&pmus);
-        fprintf(stderr, "No event matches: %s\n!", ev);
+        fprintf(stderr, "No events could be opened!\n");
         return;
     }
 
-    for (int ev_id = 0; ev_id < num_evs; ev_id++)
+    fprintf(stderr, "Reading: \n");
+    for (int instance_id = 0; instance_id < num_instances; instance_id++)
     {
-        evs[ev_id].attr.size = sizeof(struct perf_event_attr);
-        memset(&evs[ev_id].attr.size, 0, sizeof(struct perf_event_attr));
-
-        if (gen_attr_for_event(evs[ev_id].instance, &evs[ev_id].ev, &evs[ev_id].attr) == -1)
+        for (int ev_id = 0; ev_id < instances[instance_id].num_evs; ev_id++)
         {
-            free_pmus(&pmus);
-            fprintf(stderr, "Can not generate perf_event_attr for: %s!\n", evs[ev_id].ev.name);
-            free(evs);
-            return;
+            fprintf(stderr, "\t%s::%s\n", instances[instance_id].instance->name,
+                    instances[instance_id].evs[ev_id].name);
         }
     }
+    fprintf(stderr, "Every second until Ctrl+C\n");
 
-    for (int ev_id = 0; ev_id < num_evs; ev_id++)
+    struct event_reader reader;
+    if (init_event_reader(&reader, &set) == -1)
     {
-        evs[ev_id].fd = syscall(SYS_perf_event_open, &evs[ev_id].attr, -1,
-                                evs[ev_id].instance->cpus.ranges[0].start, -1, 0);
+        fprintf(stderr, "Could not allocate the reader!\n");
+        stop = 1;
+    }
 
-        if (evs[ev_id].fd == -1)
+    signal(SIGTERM, signal_handler);
+    event_set_enable(&set);
+    while (!stop)
+    {
+        sleep(1);
+        if (event_reader_read(&reader) == -1)
         {
-            fprintf(stderr, "Could not open event: %s!\n", strerror(errno));
-            return;
+            fprintf(stderr, "Could not read events: %s!\n", strerror(errno));
+            continue;
+        }
+
+        double sums[topology.num_packages];
+        for (int instance_id = 0; instance_id < num_instances; instance_id++)
+        {
+            struct instance_evs* cur = &instances[instance_id];
+            for (int ev_id = 0; ev_id < cur->num_evs; ev_id++)
+            {
+                /* Package-wide counts were only opened once per package */
+                if (cur->evs[ev_id].perpkg &&
+                    aggregate_event_deltas(&set, reader.deltas, cur->first + ev_id, cur->num_evs,
+                                           cur->num_cpus, &topology, AGGR_PACKAGE, sums) == 0)
+                {
+                    for (int package = 0; package < topology.num_packages; package++)
+                    {
+                        printf("%s::%s (Package: %d): %.0f\n", cur->instance->name,
+                               cur->evs[ev_id].name, package, sums[package]);
+                    }
+                    continue;
+                }
+
+                for (size_t cpu_id = 0; cpu_id < cur->num_cpus; cpu_id++)
+                {
+                    /* The change in the last second, scaled if the group was multiplexed */
+                    size_t count_id = cur->first + cpu_id * cur->num_evs + ev_id;
+                    const struct event_delta* delta = &reader.deltas[count_id];
+                    printf("%s::%s (CPU: %d): %.0f (running %.0f%%)\n", cur->instance->name,
+                           cur->evs[ev_id].name, set.cpus[count_id], delta->value,
+                           delta->ratio * 100);
+                }
+            }
         }
     }
 
-    fprintf(stderr, "Reading: \n");
+    for (int instance_id = 0; instance_id < num_instances; instance_id++)
+    {
+        free(instances[instance_id].evs);
+    }
+    free(instances);
+    free_event_reader(&reader);
+    free_event_set(&set);
+    free_cpu_topology(&topology);
+    free_pmus(&pmus);
+}
 
-    for (int ev_id = 0; ev_id < num_evs; ev_id++)
+/*
+ * Prints the perf_event_attrs of the perf event strings "strs"
+ */
+void parse_events(char** strs, int num_strs)
+{
+    struct pmus pmus;
+    if (get_pmus(&pmus) == -1)
     {
-        fprintf(stderr, "\t%s::%s (CPU: %lu)\n", evs[ev_id].instance->name, evs[ev_id].ev.name,
-                evs[ev_id].instance->cpus.ranges[0].start);
+        fprintf(stderr, "Could not get the PMUs!\n");
+        return;
     }
-    fprintf(stderr, "Every second until Ctrl+C\n");
 
-    signal(SIGTERM, signal_handler);
-    while (!stop)
+    for (int i = 0; i < num_strs; i++)
     {
-        long long count;
-        for (int ev_id = 0; ev_id < num_evs; ev_id++)
+        struct parsed_event ev;
+        if (parse_event(&pmus, strs[i], &ev) == -1)
         {
-            if (read(evs[ev_id].fd, &count, sizeof(count)) != sizeof(count))
-            {
-                fprintf(stderr, "Could not read event %s: %s!\n", ev, strerror(errno));
-            }
-
-            printf("%s::%s: %llu\n", evs[ev_id].instance->name, evs[ev_id].ev.name, count);
+            fprintf(stderr, "Could not parse %s!\n", strs[i]);
+            continue;
         }
-        sleep(1);
-    }
 
+        printf("%s:\n", strs[i]);
+        printf("    pmu: %s\n", ev.pmu_instance != NULL ? ev.pmu_instance->name : "generic");
+        printf("    type: %u, config: 0x%llx, config1: 0x%llx, config2: 0x%llx\n", ev.attr.type,
+               ev.attr.config, ev.attr.config1, ev.attr.config2);
+        printf("    exclude user: %d, kernel: %d, hv: %d, guest: %d, host: %d\n",
+               ev.attr.exclude_user, ev.attr.exclude_kernel, ev.attr.exclude_hv,
+               ev.attr.exclude_guest, ev.attr.exclude_host);
+        printf("    precise_ip: %d\n", ev.attr.precise_ip);
+    }
     free_pmus(&pmus);
 }
 
@@ -218,17 +321,27 @@ int main(int argc, char** argv)
 
     if (strcmp(argv[1], "list") == 0)
     {
-        list_events();
+        list_events(argc > 2 ? argv[2] : "*");
         return 0;
     }
     else if (strcmp(argv[1], "read") == 0)
     {
-        if (argc != 3)
+        if (argc < 3)
+        {
+            fprintf(stderr, "\"read\" command needs at least one event!\n");
+            return -1;
+        }
+        read_events(&argv[2], argc - 2);
+        return 0;
+    }
+    else if (strcmp(argv[1], "parse") == 0)
+    {
+        if (argc < 3)
         {
-            fprintf(stderr, "\"read\" command needs exactly two arguments!\n");
+            fprintf(stderr, "\"parse\" command needs at least one event string!\n");
             return -1;
         }
-        read_event(argv[2]);
+        parse_events(&argv[2], argc - 2);
         return 0;
     }
 
@@ -1,9 +1,14 @@
 #pragma once
 
+#include <pmu-events/metric.h>
 #include <pmu-events/pmu-events.h>
+#include <pmu-events/sysfs.h>
 
+#include <regex.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #include <linux/perf_event.h>
 
@@ -48,22 +53,239 @@ struct config_def
     struct range_list range;
 };
 
+/*
+ * A format definition of a PMU instance, e.g. the content of
+ * [path to pmu_instance]/format/umask, "config:8-15", stored under the name "umask"
+ */
+struct pmu_format
+{
+    char* name;
+    struct config_def def;
+};
+
+/*
+ * A bump allocator over a caller-provided buffer for the _arena variants of the parsers,
+ * which make no heap allocations. Nothing is freed individually, the caller resets or
+ * drops the whole arena.
+ */
+struct parse_arena
+{
+    char* buf;
+    size_t size;
+    size_t used;
+};
+
+/*
+ * The kind of a compact_metric_var referring to another metric of the table,
+ * which is inlined when linking the bytecode
+ */
+#define COMPACT_METRIC_VAR_METRIC -1
+
+/*
+ * A variable of a precompiled metric expression
+ */
+struct compact_metric_var
+{
+    /*
+     * The offset of the variable name in the big string, or for COMPACT_METRIC_VAR_METRIC
+     * the index of the referred metric in metric_bytecode_table.exprs
+     */
+    int offset;
+    /* An enum metric_var_kind or COMPACT_METRIC_VAR_METRIC */
+    int kind;
+};
+
+/*
+ * A metric expression precompiled by jevents.py, not yet linked with the
+ * metrics it refers to
+ */
+struct compact_metric_expr
+{
+    /* Index of the first instruction in metric_bytecode_table.insns */
+    uint32_t insns;
+    uint32_t num_insns;
+    /* Index of the first variable in metric_bytecode_table.vars */
+    uint32_t vars;
+    uint32_t num_vars;
+};
+
+/*
+ * The precompiled expressions of all metrics of a pmu_metrics_table
+ */
+struct metric_bytecode_table
+{
+    const struct pmu_table_entry* pmus;
+    /* One expression per metric, in the order of the metrics in pmus */
+    const struct compact_metric_expr* exprs;
+    const struct metric_insn* insns;
+    const struct compact_metric_var* vars;
+};
+
+/*
+ * Returns the precompiled metrics of "table", or NULL if the library was generated
+ * without jevents.py --metric-bytecode
+ */
+const struct metric_bytecode_table* get_metric_bytecode(const struct pmu_metrics_table* table);
+
+/*
+ * For a pmu_table_entry, get the name of the pmu
+ */
+const char* get_pmu_name(struct pmu_table_entry entry);
+
+/*
+ * For a compact_pmu_event, get the name of the event (or metric) without decompressing it
+ */
+const char* get_event_name(struct compact_pmu_event entry);
+
+/*
+ * The name of the topic id of a compact_pmu_event, "" for events without a topic,
+ * or NULL if there is no such id
+ */
+const char* get_event_topic(uint16_t topic);
+
+/*
+ * The CPU identifier of "cpu", or the content of the PERF_CPUID environment variable if set.
+ *
+ * The caller is responsible for free()-ing the result.
+ */
+char* get_cpuid_allow_env_override(struct perf_cpu cpu);
+
+/*
+ * All CPUs with event tables, terminated by an entry with a NULL arch
+ */
+extern const struct pmu_events_map pmu_events_map[];
+
+/*
+ * Returns 0 if the CPU identifier "id" matches the mapfile CPU identifier "mapcpuid"
+ */
+int strcmp_cpuid_str(const char* mapcpuid, const char* id);
+
+/*
+ * Decompresses the raw deflate stream "src" of "src_len" bytes into "dest",
+ * which has to decompress to exactly "dest_len" bytes
+ *
+ * Returns 0 on success, -1 if the stream is corrupt or has another length
+ */
+int inflate_raw(void* dest, size_t dest_len, const void* src, size_t src_len);
+
+/*
+ * A hash of the generated tables, which changes whenever the offsets of
+ * compact_pmu_events may change
+ */
+extern const uint64_t pmu_events_tables_hash;
+
+/*
+ * The initial value for hash_data()
+ */
+#define HASH_DATA_INIT UINT64_C(0xcbf29ce484222325)
+
+/*
+ * Hashes "len" bytes at "data" into "hash" (FNV-1a), returning the new hash
+ */
+uint64_t hash_data(uint64_t hash, const void* data, size_t len);
+
+/*
+ * Hashes the names of all PMU devices in sysfs with their sysfs_device_files and format
+ * files into "hash", to detect changes of the PMUs of the system, e.g. CPU hotplug or
+ * a driver with other formats
+ *
+ * Returns 0 on success, -1 if the devices can not be read
+ */
+int hash_pmu_devices(uint64_t* hash);
+
+/*
+ * Like hash_pmu_devices(), for the PMU devices in "sysfs"
+ */
+int hash_pmu_devices_from(const struct pmu_sysfs* sysfs, uint64_t* hash);
+
+/*
+ * The CPU identifier of "cpu" on the system of "sysfs", see get_cpuid_allow_env_override().
+ * For snapshots, this is the identifier that was captured for the CPU, or for CPU 0 if
+ * there is none.
+ *
+ * The caller is responsible for free()-ing the result.
+ */
+char* get_sysfs_cpuid(const struct pmu_sysfs* sysfs, struct perf_cpu cpu);
+
+/*
+ * Base path for all PMU devices in sysfs
+ */
+extern const char* const pmu_devices_base;
+
+/*
+ * Returns the index of the first entry of "snapshot" whose key starts with "prefix",
+ * and their number in "num_entries"
+ */
+size_t find_sysfs_snapshot_entries(const struct sysfs_snapshot* snapshot, const char* prefix,
+                                   size_t* num_entries);
+
+/*
+ * The files of a device that are captured in snapshots and hashed by hash_pmu_devices(),
+ * besides those in its format directory
+ */
+extern const char* const sysfs_device_files[];
+extern const size_t num_sysfs_device_files;
+
+/*
+ * Reads the names of the entries of the directory "dir_fd" into "names", sorted,
+ * skipping "." and ".."
+ *
+ * Returns the number of names, or -1 on failure. The caller is responsible for freeing
+ * the names with free_sorted_dir()
+ */
+ssize_t read_sorted_dir(int dir_fd, char*** names);
+void free_sorted_dir(char** names, ssize_t num_names);
+
+/*
+ * Returns the content of the file "path", relative to the directory "dir_fd"
+ * (or AT_FDCWD), up to the first newline, or NULL on failure
+ *
+ * The caller is responsible for free()-ing the result.
+ */
+char* get_file_content_at(int dir_fd, const char* path);
+
+/*
+ * Reads the number in the file "path", e.g. a sysfs or procfs file, into "value"
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int read_number_file(const char* path, double* value);
+
+void init_parse_arena(struct parse_arena* arena, void* buf, size_t size);
+void reset_parse_arena(struct parse_arena* arena);
+void* parse_arena_alloc(struct parse_arena* arena, size_t size, size_t align);
+
 int parse_range(const char* term, struct range* range);
 
 int parse_range_list(const char* term, struct range_list* list);
+int parse_range_list_arena(const char* term, struct range_list* list, struct parse_arena* arena);
 void free_range_list(struct range_list* list);
 
 int parse_config_def(const char* term, struct config_def* list);
+int parse_config_def_arena(const char* term, struct config_def* def, struct parse_arena* arena);
 void free_config_def(struct config_def* list);
 
 int parse_assignment(char* term, struct assignment* assignment);
 void free_assignment(struct assignment* asn);
 
 int parse_assignment_list(const char* str, struct assignment_list* list);
+int parse_assignment_list_arena(const char* str, struct assignment_list* list,
+                                struct parse_arena* arena);
 void free_assignment_list(struct assignment_list* list);
 
-int apply_range_list_to_val(unsigned long long* config, uint64_t to_apply, struct range_list* list);
-int apply_config_def_to_attr(struct perf_event_attr* attr, uint64_t val, struct config_def* def);
+int apply_range_list_to_val(unsigned long long* config, uint64_t to_apply,
+                            const struct range_list* list);
+int apply_config_def_to_attr(struct perf_event_attr* attr, uint64_t val,
+                             const struct config_def* def);
 
 char* get_format_file_content(char* fmt_file, const struct pmu_instance* pmu);
 int read_perf_type(const struct pmu_instance* pmu_instance);
+
+int load_pmu_formats(struct pmu_instance* pmu_instance);
+void free_pmu_formats(struct pmu_instance* pmu_instance);
+const struct pmu_format* find_pmu_format(const struct pmu_instance* pmu_instance,
+                                         const char* name);
+
+bool is_valid_pmu_suffix(const char* suffix);
+bool sys_pmu_name_match(const char* class_name, const char* name);
+bool identifier_match(const regex_t* compat, const char* identifier);
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <pmu-events/sysfs.h>
+#include <pmu-events/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/perf_event.h>
+
+/*
+ * A snapshot of the perf_event_attrs of all events of all PMU instances of the system,
+ * mapped from a file written by write_attr_cache().
+ *
+ * The file is only valid for the library build, kernel and PMU devices it was written
+ * with, down to the CPUs, identifiers and formats of the devices, which open_attr_cache()
+ * checks. With a valid cache, a process can open events
+ * without scanning sysfs or generating any perf_event_attr.
+ */
+struct attr_cache
+{
+    const void* data;
+    size_t size;
+};
+
+/*
+ * Generates the perf_event_attrs of all events of "pmus" and writes them to the file
+ * "path", replacing it atomically. Events for which gen_attr_for_event() fails are left out.
+ *
+ * Returns 0 on success, -1 on failure, e.g. if the PMU devices can not be read
+ */
+int write_attr_cache(const struct pmus* pmus, const char* path);
+
+/*
+ * Like write_attr_cache(), for the system "sysfs" was captured on. With a snapshot,
+ * "pmus" are usually read from it with get_pmus_from(), and the cache can be opened on
+ * all systems that match the snapshot.
+ */
+int write_attr_cache_for(const struct pmus* pmus, const struct pmu_sysfs* sysfs,
+                         const char* path);
+
+/*
+ * Maps the cache file "path" into "cache"
+ *
+ * Returns 0 on success, -1 if the file does not exist, is malformed or was written for
+ * another library build, kernel or set of PMU devices. On success, the caller is
+ * responsible for closing "cache" with close_attr_cache()
+ */
+int open_attr_cache(const char* path, struct attr_cache* cache);
+void close_attr_cache(struct attr_cache* cache);
+
+/*
+ * Returns the perf_event_attr of the event "event" of the PMU instance "instance",
+ * e.g. "uncore_cha_0", or NULL if it is not in the cache.
+ */
+const struct perf_event_attr* attr_cache_get(const struct attr_cache* cache,
+                                             const char* instance, const char* event);
+
+/*
+ * Returns the CPUs of the PMU instance "instance" as an array of "num_ranges" ranges,
+ * or NULL if the instance is not in the cache.
+ */
+const struct range* attr_cache_get_cpus(const struct attr_cache* cache, const char* instance,
+                                        size_t* num_ranges);
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <pmu-events/types.h>
+
+#include <stddef.h>
+
+#include <linux/perf_event.h>
+
+/*
+ * The perf_event_attr of an event string and the PMU it was resolved in
+ */
+struct parsed_event
+{
+    struct perf_event_attr attr;
+    /* NULL for the generic hardware and software events, e.g. "cycles" */
+    const struct pmu_class* pmu_class;
+    const struct pmu_instance* pmu_instance;
+};
+
+/*
+ * Parses the event string "str" in the syntax of perf into "ev", resolving the PMU
+ * instance and the event names in "pmus":
+ *
+ * - "pmu/terms/modifiers", e.g. "cpu/event=0x3c,umask=0x1/u" or
+ *   "uncore_imc/unc_m_cas_count.rd/". "pmu" is the name of an instance or of a class,
+ *   which resolves to its first instance in name order, e.g. uncore_imc_0. The comma
+ *   separated terms are applied in order: "format=value" or "format" (for 1) for the
+ *   formats of the instance, "config", "config1", "config2", "period", "freq" and "name",
+ *   or the name of an event of the instance. Values are decimal, or hex with "0x".
+ * - "name:modifiers", e.g. "inst_retired.any:k", for the generic events of perf or the
+ *   events of the first PMU class that has one named "name", case-insensitively, in the
+ *   first instance of the class.
+ *
+ * The modifiers are "u", "k" and "h" to count only in user, kernel or hypervisor mode,
+ * "G" and "H" to count only in guests or the host, "p" (up to 3 times) for precise events
+ * and "S" to read the other events of the group with every sample.
+ *
+ * The PMU pointers of "ev" are valid as long as "pmus".
+ *
+ * Returns 0 on success, -1 if "str" is malformed or its PMU, an event or a format is unknown
+ */
+int parse_event(const struct pmus* pmus, const char* str, struct parsed_event* ev);
+
+struct event_parser_entry
+{
+    char* str;
+    struct parsed_event ev;
+};
+
+/*
+ * Caches the results of parse_event(), so that parsing a string again is a hash table
+ * lookup. Not thread-safe.
+ */
+struct event_parser
+{
+    const struct pmus* pmus;
+    /* An open addressing hash table of the parsed strings, the size is a power of two */
+    struct event_parser_entry* entries;
+    size_t num_entries;
+    size_t num_buckets;
+};
+
+void init_event_parser(struct event_parser* parser, const struct pmus* pmus);
+void free_event_parser(struct event_parser* parser);
+
+/*
+ * Like parse_event() with the PMUs of "parser", caching the successful results
+ */
+int event_parser_parse(struct event_parser* parser, const char* str, struct parsed_event* ev);
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <pmu-events/topology.h>
+#include <pmu-events/types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/perf_event.h>
+
+/*
+ * The count of an event of an event_set, with the times needed to scale it
+ * if the event was multiplexed
+ */
+struct event_count
+{
+    uint64_t value;
+    uint64_t time_enabled;
+    uint64_t time_running;
+};
+
+/*
+ * The change of the count of an event between two reads
+ */
+struct event_delta
+{
+    /* The change of the count, scaled up to the time the event was enabled */
+    double value;
+    /* The change of the count as read, i.e. while the event was running */
+    uint64_t raw;
+    uint64_t time_enabled;
+    uint64_t time_running;
+    /*
+     * The share of the time the event was enabled in which it was running: 1 if it
+     * was not multiplexed, 0 if it was not scheduled at all
+     */
+    double ratio;
+};
+
+/*
+ * A perf group of an event_set, read with a single read() of its leader
+ */
+struct event_group
+{
+    int leader_fd;
+    /* Index of the first event of the group in event_set.fds and the counts */
+    size_t first;
+    size_t num_events;
+};
+
+/*
+ * A set of opened events, organized in perf groups.
+ *
+ * All events are opened with PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+ * PERF_FORMAT_TOTAL_TIME_RUNNING, so that reading the set takes one read() per group
+ * rather than one per event.
+ */
+struct event_set
+{
+    struct event_group* groups;
+    size_t num_groups;
+    int* fds;
+    /* The CPU every event was opened on */
+    int* cpus;
+    size_t num_events;
+    /* Buffer for the read() of the largest group */
+    uint64_t* read_buf;
+    size_t read_buf_len;
+};
+
+void init_event_set(struct event_set* set);
+
+/*
+ * Closes all events of "set" and frees it
+ */
+void free_event_set(struct event_set* set);
+
+/*
+ * Whether the events of a metric with the given grouping should be opened as one group
+ * on this system, which depends on the NMI watchdog and SMT for some values.
+ *
+ * As the library does not evaluate metric thresholds, MetricNoGroupEventsThresholdAndNmi
+ * events are grouped.
+ */
+bool should_group_events(enum metric_event_groups grouping);
+
+/*
+ * Distributes the events "evs" of "pmu_class" into groups, such that all events of a group
+ * can be counted at the same time: every event of a group needs a counter of its own, out
+ * of the counters listed in pmu_event.counters.
+ *
+ * This is a greedy heuristic, not a minimal partition: the events with the fewest counters
+ * are placed first, each into the first group where the counters can be reassigned to fit
+ * it. The number of groups is minimal when all events can use the same counters (then it
+ * is the number of events divided by the number of counters, rounded up) and when the
+ * events fit into one group, but events restricted to overlapping sets of counters may
+ * take more groups than necessary.
+ *
+ * Events without counters can use any general purpose counter. Counters used by the
+ * NMI watchdog are not taken into account.
+ *
+ * Stores the group (0 to the returned number of groups - 1) of every event in "groups".
+ *
+ * Returns the number of groups, or -1 if the counters of "pmu_class" are unknown or
+ * an event can not be counted by the PMU.
+ */
+int schedule_event_groups(const struct pmu_class* pmu_class, const struct pmu_event* evs,
+                          size_t num_evs, size_t* groups);
+
+/*
+ * Opens the events "attrs" on "cpu" (for all processes), disabled.
+ *
+ * If should_group_events("grouping"), the first event becomes the leader of a group
+ * containing all events. Otherwise every event is opened as a group of its own.
+ *
+ * Returns the index of the first event in the counts of event_set_read() on success,
+ * -1 on failure, in which case none of the events are added.
+ */
+int event_set_add_attrs(struct event_set* set, const struct perf_event_attr* attrs,
+                        size_t num_attrs, int cpu, enum metric_event_groups grouping);
+
+/*
+ * Generates the perf_event_attrs of the events "evs" of "pmu_instance" with
+ * gen_attr_for_event() and opens them with event_set_add_attrs() on every CPU of the instance.
+ *
+ * The counts of the events are stored CPU by CPU, i.e. the count of event "i" on
+ * the "n"-th CPU of the instance is at the returned index + n * num_evs + i.
+ *
+ * Returns the index of the first event in the counts of event_set_read() on success,
+ * -1 on failure, in which case none of the events are added.
+ */
+int event_set_add_events(struct event_set* set, const struct pmu_instance* pmu_instance,
+                         const struct pmu_event* evs, size_t num_evs,
+                         enum metric_event_groups grouping);
+
+/*
+ * Like event_set_add_events(), but if all "evs" are perpkg, they are only opened on the
+ * first CPU of the instance in every package of "topology", so that package-wide counts
+ * (e.g. of uncore PMUs whose instances list all CPUs) are not counted once per CPU.
+ * Lists mixing perpkg and other events are rejected with EINVAL, as they would count
+ * the perpkg events once per CPU; add them with separate calls.
+ *
+ * Stores the number of CPUs the events were opened on in "num_cpus".
+ *
+ * Returns the index of the first event in the counts of event_set_read() on success,
+ * -1 on failure, in which case none of the events are added.
+ */
+int event_set_add_events_topology(struct event_set* set, const struct pmu_instance* pmu_instance,
+                                  const struct pmu_event* evs, size_t num_evs,
+                                  enum metric_event_groups grouping,
+                                  const struct cpu_topology* topology, size_t* num_cpus);
+
+/*
+ * How event_set_add_events_on_cpus() opens the events of many CPUs
+ */
+struct event_open_pool
+{
+    /* The number of threads opening the events, including the calling one */
+    int num_threads;
+    /*
+     * If set, the threads open the events NUMA node by NUMA node, each starting with
+     * the node it is pinned to. The calling thread is not pinned.
+     */
+    const struct cpu_topology* topology;
+};
+
+/*
+ * Generates the perf_event_attrs of the events "evs" of "pmu_instance" once and opens them
+ * on each of the "num_cpus" CPUs "cpus", like event_set_add_attrs(), using the threads of
+ * "pool" (NULL to open them in the calling thread).
+ *
+ * The count of event "i" on "cpus"["n"] is at the returned index + n * num_evs + i.
+ *
+ * Stores 0 or the errno of opening the events on "cpus"["n"] in "errors"["n"], or EINVAL
+ * for all CPUs if the attrs can not be generated.
+ *
+ * Returns the index of the first event in the counts of event_set_read() on success,
+ * -1 if the events could not be opened on one or more CPUs (see "errors"), in which case
+ * none of the events are added.
+ */
+int event_set_add_events_on_cpus(struct event_set* set, const struct pmu_instance* pmu_instance,
+                                 const struct pmu_event* evs, size_t num_evs,
+                                 enum metric_event_groups grouping, const int* cpus,
+                                 size_t num_cpus, const struct event_open_pool* pool,
+                                 int* errors);
+
+/*
+ * Enables or disables all events of "set"
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int event_set_enable(const struct event_set* set);
+int event_set_disable(const struct event_set* set);
+
+/*
+ * Reads the counts of all events of "set" into "counts", which has to have space for
+ * set->num_events counts.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int event_set_read(struct event_set* set, struct event_count* counts);
+
+/*
+ * Computes the change "delta" of the count of an event from "prev" to "cur".
+ *
+ * The counts and times are treated as wrapping 64 bit counters. Multiplexed events
+ * are scaled by the times enabled and running between the two reads, not since the
+ * event was opened, so a change in the multiplexing does not skew later deltas.
+ */
+void compute_event_delta(const struct event_count* prev, const struct event_count* cur,
+                         struct event_delta* delta);
+
+/*
+ * Reads an event_set repeatedly, computing the changes of the counts between reads.
+ *
+ * All buffers are allocated by init_event_reader(), so event_reader_read() does not
+ * allocate memory, e.g. in a sampling loop.
+ */
+struct event_reader
+{
+    struct event_set* set;
+    /* The counts of the previous and of the last read */
+    struct event_count* prev;
+    struct event_count* counts;
+    /* The changes from "prev" to "counts", one per event of the set */
+    struct event_delta* deltas;
+    size_t num_events;
+};
+
+/*
+ * Prepares reading the events of "set", which must not get more events afterwards.
+ * The first event_reader_read() returns the changes since the events were opened.
+ *
+ * Returns 0 on success, -1 on failure. On success, the caller is responsible for
+ * freeing "reader" with free_event_reader()
+ */
+int init_event_reader(struct event_reader* reader, struct event_set* set);
+void free_event_reader(struct event_reader* reader);
+
+/*
+ * Reads the events of the set of "reader" and stores the changes since the previous
+ * read in reader->deltas
+ *
+ * Returns 0 on success, -1 on failure, in which case reader->deltas is unchanged
+ */
+int event_reader_read(struct event_reader* reader);
+
+/*
+ * Sums up the scaled deltas of an event opened on "num_cpus" CPUs by
+ * event_set_add_events_topology() per id of "level" of the CPUs in "topology".
+ *
+ * The deltas of the event are deltas["first"], deltas["first" + "stride"], ..., e.g. the
+ * returned index + i and num_evs for the event "i". "sums" has to have space for
+ * get_num_aggr_ids("topology", "level") values.
+ *
+ * Returns 0 on success, -1 if an event was opened on a CPU unknown to "topology"
+ */
+int aggregate_event_deltas(const struct event_set* set, const struct event_delta* deltas,
+                           size_t first, size_t stride, size_t num_cpus,
+                           const struct cpu_topology* topology, enum aggr_level level,
+                           double* sums);
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <pmu-events/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * pmu_metrics_table entries store the metrics compressed.
+ *
+ * This function decompresses the metric using the offset as its address
+ */
+void decompress_metric(int offset, struct pmu_metric* pm);
+
+/*
+ * Searches for the metric "name" (case-insensitive) in all PMUs of "table",
+ * returning the result in "pm".
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int get_metric_by_name(const struct pmu_metrics_table* table, const char* name,
+                       struct pmu_metric* pm);
+
+/*
+ * The maximum number of values on the evaluation stack of a compiled metric.
+ *
+ * Expressions that need more are rejected at compile time, so that the evaluation
+ * can use a fixed-size stack.
+ */
+#define METRIC_MAX_STACK 64
+
+/*
+ * The operations of the compiled metric bytecode.
+ *
+ * The bytecode is in postfix order: every operation pops its operands from the stack and
+ * pushes its result.
+ */
+enum metric_op
+{
+    /* Push insn.constant */
+    METRIC_OP_CONST,
+    /* Push the value of the variable insn.var */
+    METRIC_OP_VAR,
+    METRIC_OP_NEG,
+    METRIC_OP_ADD,
+    METRIC_OP_SUB,
+    METRIC_OP_MUL,
+    /* Division by zero results in NAN */
+    METRIC_OP_DIV,
+    /* Integer modulo, modulo by zero results in NAN */
+    METRIC_OP_MOD,
+    METRIC_OP_LT,
+    METRIC_OP_GT,
+    /* Logical (not bitwise) and, or and xor, resulting in 0 or 1 */
+    METRIC_OP_AND,
+    METRIC_OP_OR,
+    METRIC_OP_XOR,
+    METRIC_OP_MIN,
+    METRIC_OP_MAX,
+    /* Division that results in 0 if the divisor is 0 */
+    METRIC_OP_D_RATIO,
+    /* Pops "false value", "condition", "true value", pushes "true value if condition else false
+       value" */
+    METRIC_OP_SELECT,
+};
+
+struct metric_insn
+{
+    enum metric_op op;
+    union
+    {
+        double constant;
+        uint32_t var;
+    };
+};
+
+/*
+ * The kinds of values a metric expression refers to.
+ *
+ * All of these are variables of the compiled metric, for which the caller provides
+ * the values on evaluation.
+ */
+enum metric_var_kind
+{
+    /* The count of an event, e.g. "INST_RETIRED.ANY" or "cpu_core/TOPDOWN.SLOTS/" */
+    METRIC_VAR_EVENT,
+    /* A runtime literal, e.g. "#smt_on", see resolve_metric_var() */
+    METRIC_VAR_LITERAL,
+    /* The number of PMU instances whose counts were summed up for "source_count(event)" */
+    METRIC_VAR_SOURCE_COUNT,
+    /* 1 if the event of "has_event(event)" is available, 0 otherwise */
+    METRIC_VAR_HAS_EVENT,
+    /* 1 if the CPU identifier of "strcmp_cpuid_str(cpuid)" matches the CPU, 0 otherwise */
+    METRIC_VAR_CPUID,
+};
+
+struct metric_var
+{
+    /*
+     * For events, the name in perf event syntax: backslash escapes are removed and
+     * the "@" used instead of "/" in metric expressions is replaced, e.g.
+     * "cha@UNC_CHA_TOR_INSERTS.IA_MISS\,config1\=0x40433@" becomes
+     * "cha/UNC_CHA_TOR_INSERTS.IA_MISS,config1=0x40433/"
+     */
+    char* name;
+    enum metric_var_kind kind;
+};
+
+/*
+ * A metric expression compiled into bytecode.
+ *
+ * The values passed to eval_metric_expr() are indexed like "vars".
+ */
+struct metric_expr
+{
+    struct metric_insn* insns;
+    size_t num_insns;
+    struct metric_var* vars;
+    size_t num_vars;
+};
+
+/*
+ * Compiles the perf metric expression "expr", e.g.
+ * "d_ratio(INST_RETIRED.ANY, CPU_CLK_UNHALTED.THREAD) if #smt_on else 0"
+ *
+ * Every identifier in the expression becomes a METRIC_VAR_EVENT variable.
+ *
+ * Returns 0 on success, -1 on failure. On success, the caller is responsible for freeing
+ * "res" with free_metric_expr()
+ */
+int compile_metric_expr(const char* expr, struct metric_expr* res);
+
+/*
+ * Compiles the expression of "metric", which is a metric of "table".
+ *
+ * Unlike compile_metric_expr(), identifiers naming other metrics of "table" are replaced
+ * by the expressions of those metrics, so that all variables are events or literals.
+ * Metrics of the same PMU as "metric" take precedence over those of other PMUs.
+ *
+ * If the library was generated with precompiled metrics (the PMU_EVENTS_METRIC_BYTECODE
+ * CMake option), "metric" has to be decompressed from "table" for them to be used.
+ * Otherwise the expressions are parsed.
+ *
+ * Returns 0 on success, -1 on failure. On success, the caller is responsible for freeing
+ * "res" with free_metric_expr()
+ */
+int compile_metric(const struct pmu_metrics_table* table, const struct pmu_metric* metric,
+                   struct metric_expr* res);
+
+void free_metric_expr(struct metric_expr* expr);
+
+/*
+ * Evaluates the compiled metric "expr".
+ *
+ * "values" has to contain one value per variable of "expr", in the order of expr->vars.
+ *
+ * Does not allocate memory.
+ */
+double eval_metric_expr(const struct metric_expr* expr, const double* values);
+
+/*
+ * Resolves the value of variables that depend only on the system the metric is evaluated on.
+ * These are the METRIC_VAR_CPUID variables and the METRIC_VAR_LITERAL variables
+ * "#smt_on", "#num_cpus", "#num_cpus_online", "#core_wide", "#target_cpu" and "#has_pmem".
+ *
+ * As the library opens events per CPU, "#core_wide" and "#target_cpu" are always 1.
+ *
+ * Returns 0 on success, -1 if the variable can not be resolved by the library, in which case
+ * the caller has to provide its value.
+ */
+int resolve_metric_var(const struct metric_var* var, double* value);
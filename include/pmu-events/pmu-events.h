@@ -12,6 +12,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #include <linux/perf_event.h>
 
@@ -30,6 +31,42 @@ void free_pmus(struct pmus* pmus);
 int get_event_by_name(const struct pmu_instance* pmu_instance, const char* ev,
                       struct pmu_event* pmu_ev);
 
+/*
+ * Start iterating over the events of "pmu_instance" whose names match "pattern"
+ * case-insensitively, either as a prefix or as a shell wildcard pattern (see fnmatch(3)).
+ *
+ * The events are sorted by name, so only those starting with the characters of "pattern"
+ * before its first wildcard are looked at.
+ *
+ * Returns 0 on success, -1 on failure. On success, the caller is responsible for
+ * freeing "iter" with free_event_iter()
+ */
+int init_event_iter(struct event_iter* iter, const struct pmu_instance* pmu_instance,
+                    const char* pattern, enum event_match match);
+
+/*
+ * Restricts "iter" to the events of the topic and with the flags of "filter". The topics
+ * and flags are stored with the compact events, so the other events are not decompressed.
+ */
+void filter_event_iter(struct event_iter* iter, const struct event_filter* filter);
+
+/*
+ * Decompresses the next matching event of "iter" into "pmu_ev"
+ *
+ * Returns 0 on success, -1 if there are no more matching events
+ */
+int next_event(struct event_iter* iter, struct pmu_event* pmu_ev);
+void free_event_iter(struct event_iter* iter);
+
+/*
+ * Puts the distinct topics of the events of "pmu_instance", e.g. "cache" and "memory",
+ * into "topics", which has room for "max_topics" entries
+ *
+ * Returns the number of topics, which may be more than "max_topics", or -1 on failure
+ */
+ssize_t get_event_topics(const struct pmu_instance* pmu_instance, const char** topics,
+                         size_t max_topics);
+
 /*
  * For the given "pmu_instance, and "ev", set the perf_event_attr to be able to then open
  * the event.
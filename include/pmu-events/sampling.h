@@ -0,0 +1,98 @@
+#pragma once
+
+#include <pmu-events/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <linux/perf_event.h>
+
+/*
+ * The fields of the PERF_RECORD_SAMPLEs of a sampler, in the order of the record
+ */
+#define SAMPLER_SAMPLE_TYPE                                                                        \
+    (PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_CPU | PERF_SAMPLE_PERIOD)
+
+/*
+ * A PERF_RECORD_SAMPLE of a sampler, laid out like the fields of the record in the ring
+ * buffer (cpu is followed by 4 reserved bytes)
+ */
+struct sample_record
+{
+    uint64_t ip;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t time;
+    uint32_t cpu;
+    uint64_t period;
+};
+
+/*
+ * An event opened for sampling, with its ring buffer mapped
+ */
+struct sampler
+{
+    int fd;
+    struct perf_event_mmap_page* meta;
+    /* The data area of the ring buffer, its size is a power of 2 */
+    const uint8_t* data;
+    size_t data_size;
+    size_t mmap_len;
+    /* The number of samples the kernel could not write because the ring buffer was full */
+    uint64_t num_lost;
+};
+
+/*
+ * Called for every sample of sampler_consume(). "sample" is only valid during the call,
+ * as it usually points into the ring buffer.
+ */
+typedef void (*sample_callback)(const struct sample_record* sample, void* arg);
+
+/*
+ * Reads the period= term of the event string of "ev", i.e. the SampleAfterValue of the
+ * event, into "period"
+ *
+ * Returns 0 on success, -1 if the event has no period
+ */
+int get_event_period(const struct pmu_event* ev, uint64_t* period);
+
+/*
+ * Like gen_attr_for_event(), and sets up "attr" for a sampler: the sample_period is
+ * "period", or the period of the event (see get_event_period()) if "period" is 0.
+ *
+ * Returns 0 on success, -1 on failure, e.g. if "period" is 0 and the event has no period
+ */
+int gen_sampling_attr_for_event(const struct pmu_instance* pmu_instance,
+                                const struct pmu_event* ev, uint64_t period,
+                                struct perf_event_attr* attr);
+
+/*
+ * Opens "attr" disabled for "pid" on "cpu" (see perf_event_open(2)) with a ring buffer of
+ * "num_pages" data pages, which has to be a power of 2. The sample_type of "attr" is
+ * replaced by SAMPLER_SAMPLE_TYPE.
+ *
+ * Returns 0 on success, -1 on failure. On success, the caller is responsible for
+ * closing "sampler" with close_sampler()
+ */
+int open_sampler(struct sampler* sampler, const struct perf_event_attr* attr, pid_t pid, int cpu,
+                 size_t num_pages);
+void close_sampler(struct sampler* sampler);
+
+/*
+ * Enables or disables the event of "sampler"
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int sampler_enable(const struct sampler* sampler);
+int sampler_disable(const struct sampler* sampler);
+
+/*
+ * Calls "callback" for every sample written to the ring buffer of "sampler" since the last
+ * call, and then releases their space to the kernel. The samples are passed in place,
+ * without copying them, except for those that wrap around the end of the ring buffer.
+ * Lost records are added to sampler->num_lost, other records are skipped.
+ *
+ * Returns the number of samples
+ */
+size_t sampler_consume(struct sampler* sampler, sample_callback callback, void* arg);
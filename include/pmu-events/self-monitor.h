@@ -0,0 +1,79 @@
+#pragma once
+
+#include <pmu-events/event-set.h>
+#include <pmu-events/types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <linux/perf_event.h>
+
+/*
+ * An event counting the calling thread, with its perf user page mapped
+ */
+struct self_monitor_event
+{
+    char* name;
+    int fd;
+    struct perf_event_mmap_page* page;
+};
+
+/*
+ * A set of events counting the calling thread, read without syscalls where possible.
+ *
+ * When the kernel allows it (cap_user_rdpmc and cap_user_time of the user page), the
+ * counters are read with rdpmc on x86, or the PMU registers on arm64, and the times from
+ * the TSC or the virtual counter. Otherwise the events are read with read().
+ */
+struct self_monitor
+{
+    struct self_monitor_event* events;
+    size_t num_events;
+    /* The counts of self_monitor_begin() */
+    struct event_count* start;
+};
+
+void init_self_monitor(struct self_monitor* monitor);
+
+/*
+ * Closes all events of "monitor" and frees it
+ */
+void free_self_monitor(struct self_monitor* monitor);
+
+/*
+ * Opens the event "name" of "pmu_instance", resolved with get_event_by_name(), for the
+ * calling thread on any CPU, enabled, and maps its user page. Sets the "rdpmc" format
+ * term if the instance has one, as arm64 PMUs need it for reads from user space.
+ *
+ * Returns the index of the event in the counts of the monitor on success, -1 on failure
+ */
+int self_monitor_add_event(struct self_monitor* monitor, const struct pmu_instance* pmu_instance,
+                           const char* name);
+
+/*
+ * Like self_monitor_add_event(), for the event "attr" named "name"
+ */
+int self_monitor_add_attr(struct self_monitor* monitor, const struct perf_event_attr* attr,
+                          const char* name);
+
+/*
+ * Whether the event "i" of "monitor" can currently be read without a syscall
+ */
+bool self_monitor_user_read(const struct self_monitor* monitor, size_t i);
+
+/*
+ * Reads the count of the event "i" of "monitor", with the times enabled and running
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int self_monitor_read(const struct self_monitor* monitor, size_t i, struct event_count* count);
+
+/*
+ * Begins and ends a measured region: self_monitor_end() stores the change of the count
+ * of every event since self_monitor_begin() in "deltas", which has to have space for
+ * monitor->num_events deltas. Neither allocates memory.
+ *
+ * Return 0 on success, -1 on failure
+ */
+int self_monitor_begin(struct self_monitor* monitor);
+int self_monitor_end(const struct self_monitor* monitor, struct event_delta* deltas);
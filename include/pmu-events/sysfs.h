@@ -0,0 +1,74 @@
+#pragma once
+
+#include <pmu-events/types.h>
+
+#include <stddef.h>
+
+/*
+ * One line of a sysfs snapshot: a file of a PMU device, e.g. "cpu/format/umask",
+ * or a property of the system, e.g. "cpuid.0", and its content
+ */
+struct sysfs_snapshot_entry
+{
+    const char* key;
+    const char* value;
+};
+
+/*
+ * The PMU devices of a system, read from a file written by write_sysfs_snapshot().
+ *
+ * Besides the type, cpus, cpumask, identifier and format files of all devices, a snapshot
+ * holds the CPU identifiers, the number of online CPUs and the kernel of the system, so
+ * that get_pmus_from() and write_attr_cache_for() give the same results on any machine
+ * as get_pmus() and write_attr_cache() on the captured one.
+ */
+struct sysfs_snapshot
+{
+    char* data;
+    /* Sorted by key */
+    struct sysfs_snapshot_entry* entries;
+    size_t num_entries;
+};
+
+/*
+ * Where the PMU devices are read from
+ *
+ * With "snapshot" set, everything is read from the snapshot. Otherwise, the devices are
+ * read from the directory "root", which is laid out like /sys/bus/event_source/devices,
+ * or from that directory if "root" is NULL.
+ */
+struct pmu_sysfs
+{
+    const char* root;
+    const struct sysfs_snapshot* snapshot;
+};
+
+/*
+ * Like get_pmus(), with the PMU devices read from "sysfs"
+ *
+ * On success, returns 0, otherwise -1.
+ * On success, the caller is responsible for free-ing the struct pmus using free_pmus()
+ */
+int get_pmus_from(const struct pmu_sysfs* sysfs, struct pmus* pmus);
+
+/*
+ * Captures the PMU devices in the directory "root" (NULL for /sys/bus/event_source/devices)
+ * and the properties of this system into the file "path", replacing it atomically
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int write_sysfs_snapshot(const char* root, const char* path);
+
+/*
+ * Reads the snapshot file "path" into "snapshot"
+ *
+ * Returns 0 on success, -1 if the file can not be read or is malformed. On success,
+ * the caller is responsible for closing "snapshot" with close_sysfs_snapshot()
+ */
+int open_sysfs_snapshot(const char* path, struct sysfs_snapshot* snapshot);
+void close_sysfs_snapshot(struct sysfs_snapshot* snapshot);
+
+/*
+ * Returns the content of the entry "key" of "snapshot", or NULL if there is none
+ */
+const char* get_sysfs_snapshot_value(const struct sysfs_snapshot* snapshot, const char* key);
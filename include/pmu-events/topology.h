@@ -0,0 +1,67 @@
+#pragma once
+
+#include <pmu-events/types.h>
+
+#include <stddef.h>
+
+/*
+ * The levels the counts of events on several CPUs can be summed up at
+ */
+enum aggr_level
+{
+    AGGR_CPU,
+    AGGR_CORE,
+    AGGR_PACKAGE,
+    AGGR_NODE,
+    AGGR_SYSTEM,
+};
+
+/*
+ * The cores, packages and NUMA nodes of the online CPUs, as flat arrays indexed by
+ * the CPU number. The ids are dense, i.e. 0 to num_cores - 1 for the cores, and -1
+ * for CPUs which are not online.
+ *
+ * Core ids are unique across packages, unlike the core_id files of sysfs.
+ */
+struct cpu_topology
+{
+    int* core;
+    int* package;
+    int* node;
+    /* The length of the arrays, the highest online CPU + 1 */
+    int num_cpus;
+    int num_cores;
+    int num_packages;
+    int num_nodes;
+};
+
+/*
+ * Reads the topology of the online CPUs from /sys/devices/system/cpu
+ *
+ * Returns 0 on success, -1 on failure. On success, the caller is responsible for
+ * freeing "topology" with free_cpu_topology()
+ */
+int get_cpu_topology(struct cpu_topology* topology);
+
+/*
+ * Like get_cpu_topology(), from the directory "root" laid out like /sys/devices/system/cpu
+ */
+int get_cpu_topology_from(const char* root, struct cpu_topology* topology);
+void free_cpu_topology(struct cpu_topology* topology);
+
+/*
+ * Returns the id of the core, package, node, ... of "cpu" at "level", or -1 if
+ * "cpu" is not online
+ */
+int get_aggr_id(const struct cpu_topology* topology, int cpu, enum aggr_level level);
+
+/*
+ * Returns the number of ids at "level", i.e. the number of sums of aggregate_event_deltas()
+ */
+int get_num_aggr_ids(const struct cpu_topology* topology, enum aggr_level level);
+
+/*
+ * The level the events of "metric" are summed up at: per package for PerChip metrics,
+ * per core for PerCore metrics and for the whole system otherwise
+ */
+enum aggr_level get_metric_aggr_level(const struct pmu_metric* metric);
@@ -53,6 +53,11 @@ struct pmu_event
 {
     const char* name;
     const char* compat;
+    /*
+     * The hardware counters the event can be counted on, e.g. "0,1,2,3" or
+     * "Fixed counter 1", see schedule_event_groups()
+     */
+    const char* counters;
     const char* event;
     const char* desc;
     const char* topic;
@@ -83,9 +88,22 @@ struct pmu_metric
     enum metric_event_groups event_grouping;
 };
 
+/*
+ * The flags of an event, stored with its compact_pmu_event
+ */
+enum event_flag
+{
+    EVENT_FLAG_DEPRECATED = 1 << 0,
+    EVENT_FLAG_PERPKG = 1 << 1,
+};
+
 struct compact_pmu_event
 {
     int offset;
+    /* The id of the topic of events, see get_event_topic(), 0 for metrics */
+    uint16_t topic;
+    /* The enum event_flags of events, 0 for metrics */
+    uint16_t flags;
 };
 
 struct pmu_table_entry
@@ -109,6 +127,22 @@ struct pmu_metrics_table
     uint32_t num_pmus;
 };
 
+/*
+ * The number of counters of a PMU, from the counter.json of the CPU
+ */
+struct pmu_layout
+{
+    const char* pmu;
+    uint32_t counters_num_gp;
+    uint32_t counters_num_fixed;
+};
+
+struct pmu_layouts_table
+{
+    const struct pmu_layout* entries;
+    uint32_t num_entries;
+};
+
 /*
  * Map a CPU to its table of PMU events. The CPU is identified by the
  * cpuid field, which is an arch-specific identifier for the CPU.
@@ -123,14 +157,34 @@ struct pmu_events_map
     const char* cpuid;
     struct pmu_events_table event_table;
     struct pmu_metrics_table metric_table;
+    struct pmu_layouts_table layout_table;
 };
 
 /*
  * Returns the list of all events for the given cpu, or NULL on
  * failure
+ *
+ * The maps of all CPUs are resolved on the first call and shared by all threads,
+ * so concurrent calls take no locks. With the PERF_CPUID override set, the map is
+ * resolved on every call instead.
  */
 const struct pmu_events_map* map_for_cpu(struct perf_cpu cpu);
 
+/*
+ * Returns the list of all events for the CPU identifier "cpuid", in the format of
+ * get_cpuid_str(), or NULL if there is none
+ */
+const struct pmu_events_map* map_for_cpuid(const char* cpuid);
+
+/*
+ * Returns the "idx"-th table of events of system (SoC) PMUs, such as DDR controllers,
+ * or NULL if there are less than idx + 1 tables.
+ *
+ * Unlike the tables in pmu_events_map, these are not tied to a CPU but matched to
+ * PMU instances using the "compat" field of the events.
+ */
+const struct pmu_events_table* get_sys_event_table(size_t idx);
+
 /*
  * pmu_table_entries store the pmu events compressed.
  *
@@ -138,6 +192,15 @@ const struct pmu_events_map* map_for_cpu(struct perf_cpu cpu);
  */
 void decompress_event(int offset, struct pmu_event* pe);
 
+/*
+ * Like decompress_event(), but leaves the "topic", "desc" and "long_desc" fields NULL.
+ *
+ * With PMU_EVENTS_COMPRESS_COLD_STRINGS, these fields are stored compressed and
+ * decompress_event() inflates their block on first use. Code that only needs the
+ * fields to open events should use this variant, which never does.
+ */
+void decompress_event_hot(int offset, struct pmu_event* pe);
+
 /*
  * Non-Linux functions
  */
@@ -162,8 +225,16 @@ struct range_list
     struct range* ranges;
 };
 
+/*
+ * The parsed format definitions of a PMU instance, opaque to callers
+ */
+struct pmu_format;
+
 /*
  * An instance of a pmu class, such as uncore_cbox_0
+ *
+ * "type" and "formats" are read from sysfs once when the instance is discovered,
+ * so that generating a perf_event_attr for it does not touch sysfs again.
  */
 struct pmu_instance
 {
@@ -171,6 +242,9 @@ struct pmu_instance
     char* name;
     const struct compact_pmu_event* entries;
     uint32_t num_entries;
+    int type;
+    struct pmu_format* formats;
+    size_t num_formats;
 };
 
 /*
@@ -181,6 +255,9 @@ struct pmu_class
     const char* name;
     struct pmu_instance* instances;
     int num_instances;
+    /* The number of general purpose and fixed counters of every instance, 0 if unknown */
+    uint32_t counters_num_gp;
+    uint32_t counters_num_fixed;
 };
 
 // The list of all PMUs
@@ -189,3 +266,48 @@ struct pmus
     size_t num_classes;
     struct pmu_class* classes;
 };
+
+/*
+ * How the pattern of an event_iter is matched against the event names
+ */
+enum event_match
+{
+    /* Names starting with the pattern, e.g. "unc_cha_tor_inserts." */
+    EVENT_MATCH_PREFIX,
+    /* Names matching the shell wildcard pattern, e.g. "unc_cha_tor_inserts.ia_*" */
+    EVENT_MATCH_GLOB,
+};
+
+/*
+ * Restricts the events of an event_iter, see filter_event_iter()
+ */
+struct event_filter
+{
+    /* Only events of this topic, e.g. "memory", or of any topic if NULL */
+    const char* topic;
+    /*
+     * Only events whose enum event_flags masked with "flags_mask" equal "flags",
+     * e.g. no deprecated events with flags_mask = EVENT_FLAG_DEPRECATED and flags = 0
+     */
+    uint16_t flags;
+    uint16_t flags_mask;
+};
+
+/*
+ * Iterates over the events of a PMU instance whose names match a pattern, see
+ * init_event_iter(). Only the matching events are decompressed.
+ */
+struct event_iter
+{
+    const struct compact_pmu_event* entries;
+    /* The range of entries starting with the literal prefix of the pattern */
+    uint32_t pos;
+    uint32_t end;
+    enum event_match match;
+    /* The lowercase pattern, the names of the tables are lowercase */
+    char* pattern;
+    /* The topic id of the events, -1 for any, and their flags, see struct event_filter */
+    int topic;
+    uint16_t flags;
+    uint16_t flags_mask;
+};
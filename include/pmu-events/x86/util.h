@@ -13,6 +13,7 @@
 #include <errno.h>
 #include <regex.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -162,4 +163,124 @@ int strcmp_cpuid_str(const char* mapcpuid, const char* id)
 
     return 1;
 }
+
+/*
+ * A cpuid of the form "GenuineIntel-6-55-4" split into its fields.
+ * "stepping" is -1 if the cpuid has none.
+ */
+struct cpuid_key
+{
+    char vendor[16];
+    unsigned int family;
+    unsigned int model;
+    int stepping;
+};
+
+/*
+ * A mapfile cpuid pattern such as "GenuineIntel-6-(97|9A|B7|BA|BF)", precompiled by
+ * jevents.py into the family range and the bitmaps of the models and steppings it matches.
+ *
+ * "vendor" is NULL if jevents.py could not precompile the pattern, which then has to be
+ * matched with strcmp_cpuid_str().
+ */
+struct cpuid_matcher
+{
+    const char* vendor;
+    uint16_t family_min;
+    uint16_t family_max;
+    uint64_t models[4];
+    uint16_t steppings;
+    /* Whether the pattern contains the stepping, and so only matches full cpuids */
+    bool full;
+};
+
+/*
+ * Parses the number at "*str" in the format get_cpuid_str() prints it with, i.e. without
+ * leading zeros and with upper case hex digits, and advances "*str" past it
+ */
+static int parse_cpuid_number(const char** str, unsigned int base, unsigned int max,
+                              unsigned int* val)
+{
+    const char* cur = *str;
+    unsigned int res = 0;
+
+    for (; *cur != '\0' && *cur != '-'; cur++)
+    {
+        unsigned int digit;
+        if (*cur >= '0' && *cur <= '9')
+            digit = *cur - '0';
+        else if (base == 16 && *cur >= 'A' && *cur <= 'F')
+            digit = *cur - 'A' + 10;
+        else
+            return -1;
+
+        if ((cur != *str && res == 0) || res > (max - digit) / base)
+            return -1;
+        res = res * base + digit;
+    }
+
+    if (cur == *str)
+        return -1;
+
+    *val = res;
+    *str = cur;
+    return 0;
+}
+
+/*
+ * Splits the cpuid "id" into "key"
+ *
+ * Returns 0 on success, -1 if "id" is not of the form printed by get_cpuid_str(),
+ * in which case it has to be matched with strcmp_cpuid_str()
+ */
+int parse_cpuid_key(const char* id, struct cpuid_key* key)
+{
+    const char* dash = strchr(id, '-');
+    if (dash == NULL || dash == id || (size_t)(dash - id) >= sizeof(key->vendor))
+        return -1;
+
+    memcpy(key->vendor, id, dash - id);
+    key->vendor[dash - id] = '\0';
+
+    /* The largest family and model __get_cpuid() can return */
+    const char* cur = dash + 1;
+    if (parse_cpuid_number(&cur, 10, 0xf + 0xff, &key->family) == -1 || *cur++ != '-')
+        return -1;
+    if (parse_cpuid_number(&cur, 16, 0xff, &key->model) == -1)
+        return -1;
+
+    key->stepping = -1;
+    if (*cur == '-')
+    {
+        unsigned int stepping;
+        cur++;
+        if (parse_cpuid_number(&cur, 16, 0xf, &stepping) == -1)
+            return -1;
+        key->stepping = stepping;
+    }
+
+    return *cur == '\0' ? 0 : -1;
+}
+
+/*
+ * Returns true if the cpuid "key" matches the precompiled pattern "matcher",
+ * like strcmp_cpuid_str() does for the pattern itself
+ */
+bool match_cpuid_key(const struct cpuid_matcher* matcher, const struct cpuid_key* key)
+{
+    if (strcmp(matcher->vendor, key->vendor) != 0)
+        return false;
+
+    if (key->family < matcher->family_min || key->family > matcher->family_max)
+        return false;
+
+    if (!(matcher->models[key->model / 64] & (UINT64_C(1) << (key->model % 64))))
+        return false;
+
+    /* Patterns without a stepping ignore the stepping of the cpuid */
+    if (!matcher->full)
+        return true;
+
+    return key->stepping != -1 && (matcher->steppings & (1u << key->stepping));
+}
 #endif
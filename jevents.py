@@ -4,10 +4,13 @@
 import argparse
 import csv
 from functools import lru_cache
+import hashlib
 import json
 import metric
 import os
+import re
 import sys
+import zlib
 from typing import (Callable, Dict, Optional, Sequence, Set, Tuple)
 import collections
 
@@ -31,12 +34,26 @@ _arch_std_events = {}
 _pending_events = []
 # Name of events table to be written out
 _pending_events_tblname = None
+# PMU counter layouts from counter.json to write out when the table is closed
+_pending_pmu_layouts = []
+# Names of the written PMU layout tables
+_pmu_layouts_tables = []
 # Metrics to write out when the table is closed
 _pending_metrics = []
 # Name of metrics table to be written out
 _pending_metrics_tblname = None
 # Global BigCString shared by all structures.
 _bcs = None
+# Global ColdStrings holding the compressed event fields with --compress-cold-strings.
+_cold_strings = None
+# Names of metric tables with precompiled bytecode.
+_metric_bytecode_tables = []
+# Topics of the events mapped to their ids in the compact_pmu_events, 0 for no topic.
+_event_topics = {'': 0}
+# The bits of the flags of the compact_pmu_events, see enum event_flag in types.h.
+_event_flags = {'deprecated': 1 << 0, 'perpkg': 1 << 1}
+# The precompiled cpuid patterns of the rows of pmu_events_map, see compile_cpuid_pattern().
+_cpuid_matchers = []
 # Map from the name of a metric group to a description of the group.
 _metricgroups = {}
 # Order specific JsonEvent attributes will be visited.
@@ -46,7 +63,7 @@ _json_event_attributes = [
     # Seems useful, put it early.
     'event',
     # Short things in alphabetical order.
-    'compat', 'deprecated', 'perpkg', 'unit',
+    'compat', 'counters', 'deprecated', 'perpkg', 'unit',
     # Retirement latency specific to Intel granite rapids currently.
     'retirement_latency_mean', 'retirement_latency_min',
     'retirement_latency_max',
@@ -54,6 +71,10 @@ _json_event_attributes = [
     'long_desc'
 ]
 
+# Event attributes that are only read for display, stored in the ColdStrings
+# with --compress-cold-strings.
+_json_event_cold_attributes = ['topic', 'desc', 'long_desc']
+
 # Attributes that are in pmu_metric rather than pmu_event.
 _json_metric_attributes = [
     'metric_name', 'metric_group', 'metric_expr', 'metric_threshold',
@@ -198,6 +219,69 @@ class BigCString:
 
 _bcs = BigCString()
 
+def c_unescape(s: str) -> bytes:
+  """Return the bytes of the C string literal contents s."""
+  simple = {'n': b'\n', 'r': b'\r', 't': b'\t'}
+  out = bytearray()
+  utf = s.encode('utf-8')
+  i = 0
+  while i < len(utf):
+    c = utf[i:i + 1]
+    i += 1
+    if c != b'\\':
+      out += c
+      continue
+    if utf[i:i + 3].isdigit():
+      out.append(int(utf[i:i + 3], 8))
+      i += 3
+      continue
+    out += simple.get(utf[i:i + 1].decode(), utf[i:i + 1])
+    i += 1
+  return bytes(out)
+
+class ColdStrings:
+  """Event fields that are not needed to open events, compressed in blocks.
+
+  The fields of an event are stored as consecutive NUL terminated strings
+  and referred to by an id, the index of the block times BLOCK_SIZE plus
+  the offset within the uncompressed block. Every block is compressed on
+  its own as a raw deflate stream, so that reading a description only
+  inflates the block holding it.
+  """
+  BLOCK_SIZE = 65536
+  ids: Dict[bytes, int]
+  blocks: Sequence[bytearray]
+
+  def __init__(self):
+    self.ids = {}
+    self.blocks = [bytearray()]
+
+  def add(self, fields: bytes) -> int:
+    """Returns the id of fields, adding them if they are new."""
+    if fields in self.ids:
+      return self.ids[fields]
+    assert len(fields) <= self.BLOCK_SIZE
+    if len(self.blocks[-1]) + len(fields) > self.BLOCK_SIZE:
+      self.blocks.append(bytearray())
+    block = self.blocks[-1]
+    self.ids[fields] = (len(self.blocks) - 1) * self.BLOCK_SIZE + len(block)
+    block += fields
+    return self.ids[fields]
+
+  def compressed_blocks(self) -> Sequence[bytes]:
+    def deflate(block: bytes) -> bytes:
+      z = zlib.compressobj(9, zlib.DEFLATED, -15)
+      return z.compress(block) + z.flush()
+    return [deflate(bytes(b)) for b in self.blocks]
+
+_cold_strings = ColdStrings()
+
+def event_string_attributes() -> Sequence[str]:
+  """The attributes of an event stored in the big string, in order."""
+  if not _args.compress_cold_strings:
+    return _json_event_attributes
+  return [x for x in _json_event_attributes if x not in _json_event_cold_attributes] + ['cold']
+
 class JsonEvent:
   """Representation of an event loaded from a json file dictionary."""
 
@@ -269,7 +353,7 @@ class JsonEvent:
 
     def unit_to_pmu(unit: str) -> Optional[str]:
       """Convert a JSON Unit to Linux PMU name."""
-      if not unit:
+      if not unit or unit == 'core':
         return 'default_core'
       # Comment brought over from jevents.c:
       # it's not realistic to keep adding these, we need something more scalable ...
@@ -341,6 +425,10 @@ class JsonEvent:
     if 'Errata' in jd:
       extra_desc += '  Spec update: ' + jd['Errata']
     self.pmu = unit_to_pmu(jd.get('Unit'))
+    self.counters = jd.get('Counter')
+    # Only set for the entries of counter.json
+    self.counters_num_gp = jd.get('CountersNumGeneric')
+    self.counters_num_fixed = jd.get('CountersNumFixed')
     filter = jd.get('Filter')
     self.unit = jd.get('ScaleUnit')
     self.perpkg = jd.get('PerPkg')
@@ -424,7 +512,12 @@ class JsonEvent:
 
   def build_c_string(self, metric: bool) -> str:
     s = ''
-    for attr in _json_metric_attributes if metric else _json_event_attributes:
+    for attr in _json_metric_attributes if metric else event_string_attributes():
+      if attr == 'cold':
+        fields = b''.join(c_unescape(getattr(self, x) or '') + b'\0'
+                          for x in _json_event_cold_attributes)
+        s += f'{_cold_strings.add(fields)}\\000'
+        continue
       x = getattr(self, attr)
       if metric and x and attr == 'metric_expr':
         # Convert parsed metric expressions into a string. Slashes
@@ -445,7 +538,121 @@ class JsonEvent:
         return s.replace('*/', r'\*\/')
 
     s = self.build_c_string(metric)
-    return f'{{ { _bcs.offsets[s] } }}, /* {fix_comment(s)} */\n'
+    if metric:
+      # Metrics have no topic id or flags, the fields are zeroed explicitly
+      # to initialize every field of compact_pmu_event.
+      return f'{{ { _bcs.offsets[s] }, 0, 0 }}, /* {fix_comment(s)} */\n'
+
+    # Events carry the id of their topic and their flags, so that they can be
+    # filtered on them without decompressing them.
+    topic = _event_topics.setdefault(self.topic or '', len(_event_topics))
+    flags = 0
+    for attr, bit in _event_flags.items():
+      if getattr(self, attr) not in (None, '', '0'):
+        flags |= bit
+    return f'{{ { _bcs.offsets[s] }, {topic}, {flags} }}, /* {fix_comment(s)} */\n'
+
+
+def metric_var_name(symbol: str) -> str:
+  """Convert a symbol of a metric expression to the perf event syntax.
+
+  Like symbol_to_name() in src/metric.c, backslash escapes are removed
+  and '@' is replaced by '/'.
+  """
+  name = ''
+  i = 0
+  while i < len(symbol):
+    if symbol[i] == '\\' and i + 1 < len(symbol):
+      i += 1
+      name += symbol[i]
+    elif symbol[i] == '@':
+      name += '/'
+    else:
+      name += symbol[i]
+    i += 1
+  return name
+
+
+def metric_var_c_string(name: str) -> str:
+  """The big string entry of a metric variable name."""
+  return name.replace('\\', '\\\\').replace('"', '\\"') + '\\000'
+
+
+_metric_ops = {
+    '|': 'METRIC_OP_OR',
+    '^': 'METRIC_OP_XOR',
+    '&': 'METRIC_OP_AND',
+    '<': 'METRIC_OP_LT',
+    '>': 'METRIC_OP_GT',
+    '+': 'METRIC_OP_ADD',
+    '-': 'METRIC_OP_SUB',
+    '*': 'METRIC_OP_MUL',
+    '/': 'METRIC_OP_DIV',
+    '%': 'METRIC_OP_MOD',
+    'min': 'METRIC_OP_MIN',
+    'max': 'METRIC_OP_MAX',
+    'd_ratio': 'METRIC_OP_D_RATIO',
+}
+
+_metric_id_functions = {
+    'source_count': 'METRIC_VAR_SOURCE_COUNT',
+    'has_event': 'METRIC_VAR_HAS_EVENT',
+    'strcmp_cpuid_str': 'METRIC_VAR_CPUID',
+}
+
+
+def compile_metric_bytecode(expr: metric.Expression,
+                            resolve_metric: Callable[[str], Optional[int]]
+                            ) -> Tuple[Sequence[str], Sequence[Tuple[str, str]]]:
+  """Compile a metric expression into the postfix bytecode of metric.h.
+
+  Returns the instructions as C initializers and the variables as
+  (kind, name) tuples. Identifiers for which resolve_metric() returns
+  the index of a metric of the table become COMPACT_METRIC_VAR_METRIC
+  variables referring to that index, they are inlined when linking the
+  metric at runtime.
+  """
+  insns = []
+  variables = []
+
+  def var(kind: str, name: str) -> None:
+    if (kind, name) not in variables:
+      variables.append((kind, name))
+    insns.append(f'{{ .op = METRIC_OP_VAR, .var = {variables.index((kind, name))} }}')
+
+  def visit(e: metric.Expression) -> None:
+    if isinstance(e, metric.Constant):
+      insns.append(f'{{ .op = METRIC_OP_CONST, .constant = {float(e.value)!r} }}')
+    elif isinstance(e, metric.Literal):
+      var('METRIC_VAR_LITERAL', metric_var_name(e.ToPerfJson()))
+    elif isinstance(e, metric.Event):
+      name = metric_var_name(e.ToPerfJson())
+      index = resolve_metric(name)
+      if index is None:
+        var('METRIC_VAR_EVENT', name)
+      else:
+        var('COMPACT_METRIC_VAR_METRIC', str(index))
+    elif isinstance(e, metric.Operator):
+      visit(e.lhs)
+      visit(e.rhs)
+      insns.append(f'{{ .op = {_metric_ops[e.operator]} }}')
+    elif isinstance(e, metric.Select):
+      visit(e.true_val)
+      visit(e.cond)
+      visit(e.false_val)
+      insns.append('{ .op = METRIC_OP_SELECT }')
+    elif isinstance(e, metric.Function) and e.fn in _metric_id_functions:
+      assert isinstance(e.lhs, metric.Event), f'{e.fn} of a non event: {e}'
+      var(_metric_id_functions[e.fn], metric_var_name(e.lhs.ToPerfJson()))
+    elif isinstance(e, metric.Function):
+      visit(e.lhs)
+      visit(e.rhs)
+      insns.append(f'{{ .op = {_metric_ops[e.fn]} }}')
+    else:
+      raise TypeError(f'Unexpected metric expression {e}')
+
+  visit(expr)
+  return insns, variables
 
 
 @lru_cache(maxsize=None)
@@ -489,6 +696,9 @@ def preprocess_arch_std_files(archpath: str) -> None:
 
 def add_events_table_entries(item: os.DirEntry, topic: str) -> None:
   """Add contents of file to _pending_events table."""
+  if item.name == 'counter.json':
+    _pending_pmu_layouts.extend(read_json_events(item.path, topic))
+    return
   for e in read_json_events(item.path, topic):
     if e.name:
       _pending_events.append(e)
@@ -524,9 +734,11 @@ def print_pending_events() -> None:
   last_pmu = None
   last_name = None
   pmus = set()
+  # Events of a PMU are sorted by name, get_event_by_name() binary searches them.
   for event in sorted(_pending_events, key=event_cmp_key):
     if last_pmu and last_pmu == event.pmu:
       assert event.name != last_name, f"Duplicate event: {last_pmu}/{last_name}/ in {_pending_events_tblname}"
+      assert event.name > last_name, f"Unsorted event: {last_pmu}/{event.name}/ in {_pending_events_tblname}"
     if event.pmu != last_pmu:
       if not first:
         _args.output_file.write('};\n')
@@ -556,6 +768,25 @@ const struct pmu_table_entry {_pending_events_tblname}[] = {{
 """)
   _args.output_file.write('};\n\n')
 
+def print_pending_pmu_layouts() -> None:
+  """Optionally close the PMU counter layouts table of the events table."""
+  global _pending_pmu_layouts
+  if not _pending_pmu_layouts:
+    return
+
+  tblname = _pending_events_tblname.replace('pmu_events_', 'pmu_layouts_', 1)
+  _pmu_layouts_tables.append(tblname)
+  _args.output_file.write(f'static const struct pmu_layout {tblname}[] = {{\n')
+  for layout in sorted(_pending_pmu_layouts, key=lambda l: l.pmu):
+    _args.output_file.write(f"""{{
+\t.pmu = "{layout.pmu}",
+\t.counters_num_gp = {layout.counters_num_gp or 0},
+\t.counters_num_fixed = {layout.counters_num_fixed or 0},
+}},
+""")
+  _args.output_file.write('};\n\n')
+  _pending_pmu_layouts = []
+
 def print_pending_metrics() -> None:
   """Optionally close metrics table."""
 
@@ -582,7 +813,8 @@ def print_pending_metrics() -> None:
   first = True
   last_pmu = None
   pmus = set()
-  for metric in sorted(_pending_metrics, key=metric_cmp_key):
+  metrics = sorted(_pending_metrics, key=metric_cmp_key)
+  for metric in metrics:
     if metric.pmu != last_pmu:
       if not first:
         _args.output_file.write('};\n')
@@ -611,6 +843,59 @@ const struct pmu_table_entry {_pending_metrics_tblname}[] = {{
 """)
   _args.output_file.write('};\n\n')
 
+  if _args.metric_bytecode:
+    # The metrics in the order of the table, which is the order of the bytecode.
+    table_metrics = []
+    for (pmu, _) in sorted(pmus):
+      table_metrics += [m for m in metrics if m.pmu == pmu]
+    print_metric_bytecode(table_metrics)
+
+def print_metric_bytecode(table_metrics: Sequence[JsonEvent]) -> None:
+  """Write the precompiled bytecode of all metrics of the pending metrics table."""
+  _metric_bytecode_tables.append(_pending_metrics_tblname)
+
+  def find_metric(name: str, pmu: Optional[str]) -> Optional[int]:
+    for i, m in enumerate(table_metrics):
+      if (pmu is None or m.pmu == pmu) and m.metric_name.lower() == name.lower():
+        return i if m.metric_expr else None
+    return None
+
+  insns = []
+  variables = []
+  exprs = []
+  for m in table_metrics:
+    # Like compile_metric(), references are resolved in the PMU of the metric first.
+    def resolve_metric(name: str) -> Optional[int]:
+      i = find_metric(name, m.pmu)
+      return i if i is not None else find_metric(name, None)
+
+    metric_insns, metric_variables = [], []
+    if m.metric_expr:
+      metric_insns, metric_variables = compile_metric_bytecode(m.metric_expr, resolve_metric)
+    exprs.append((m.metric_name, len(insns), len(metric_insns), len(variables),
+                  len(metric_variables)))
+    insns += metric_insns
+    variables += metric_variables
+
+  _args.output_file.write(
+      f'static const struct metric_insn {_pending_metrics_tblname}_insns[] = {{\n')
+  for insn in insns:
+    _args.output_file.write(f'{insn},\n')
+  _args.output_file.write(
+      f'}};\n\nstatic const struct compact_metric_var {_pending_metrics_tblname}_vars[] = {{\n')
+  for (kind, name) in variables:
+    if kind == 'COMPACT_METRIC_VAR_METRIC':
+      _args.output_file.write(
+          f'{{ {name}, {kind} }}, /* {table_metrics[int(name)].metric_name} */\n')
+    else:
+      s = metric_var_c_string(name)
+      _args.output_file.write(f'{{ {_bcs.offsets[s]}, {kind} }}, /* {s} */\n')
+  _args.output_file.write(
+      f'}};\n\nstatic const struct compact_metric_expr {_pending_metrics_tblname}_exprs[] = {{\n')
+  for (name, insn, num_insns, var, num_vars) in exprs:
+    _args.output_file.write(f'{{ {insn}, {num_insns}, {var}, {num_vars} }}, /* {name} */\n')
+  _args.output_file.write('};\n\n')
+
 def get_topic(topic: str) -> str:
   if topic.endswith('metrics.json'):
     return 'metrics'
@@ -651,6 +936,10 @@ def preprocess_one_file(parents: Sequence[str], item: os.DirEntry) -> None:
     if event.metric_name:
       _bcs.add(pmu_name, metric=True)
       _bcs.add(event.build_c_string(metric=True), metric=True)
+      if _args.metric_bytecode and event.metric_expr:
+        _, variables = compile_metric_bytecode(event.metric_expr, lambda name: None)
+        for _, name in variables:
+          _bcs.add(metric_var_c_string(name), metric=True)
 
 def process_one_file(parents: Sequence[str], item: os.DirEntry) -> None:
   """Process a JSON file during the main walk."""
@@ -666,6 +955,7 @@ def process_one_file(parents: Sequence[str], item: os.DirEntry) -> None:
   # model directory.
   if item.is_dir() and is_leaf_dir_ignoring_sys(item.path):
     print_pending_events()
+    print_pending_pmu_layouts()
     print_pending_metrics()
 
     global _pending_events_tblname
@@ -690,6 +980,161 @@ def process_one_file(parents: Sequence[str], item: os.DirEntry) -> None:
   add_events_table_entries(item, get_topic(item.name))
 
 
+def _split_cpuid_pattern(pattern: str) -> Sequence[str]:
+  """Split a mapfile cpuid pattern at the dashes outside of brackets and parentheses."""
+  parts = ['']
+  depth = 0
+  for c in pattern:
+    if c in '[(':
+      depth += 1
+    elif c in '])':
+      depth -= 1
+    if c == '-' and depth == 0:
+      parts.append('')
+    else:
+      parts[-1] += c
+  return parts
+
+
+def compile_cpuid_pattern(pattern: str) -> Optional[str]:
+  """Precompile an x86 mapfile cpuid pattern into a struct cpuid_matcher initializer.
+
+  A pattern like "GenuineIntel-6-(97|9A|B7|BA|BF)" becomes the vendor, the range
+  of families and the bitmaps of the models and steppings matching the pattern,
+  formatted like get_cpuid_str() prints them. Returns None for patterns that can
+  not be split into these fields, which are matched with strcmp_cpuid_str().
+  """
+  if any(c in pattern for c in '.*?\\^$'):
+    return None
+  parts = _split_cpuid_pattern(pattern)
+  if len(parts) not in (3, 4) or not parts[0].isalpha():
+    return None
+  if any('|' in p and not (p.startswith('(') and p.endswith(')')) for p in parts):
+    return None
+
+  try:
+    regexes = [re.compile(p.replace('[:xdigit:]', '0-9A-Fa-f')) for p in parts[1:]]
+  except re.error:
+    return None
+
+  families = [f for f in range(0xf + 0xff + 1) if regexes[0].fullmatch(str(f))]
+  models = [m for m in range(256) if regexes[1].fullmatch(f'{m:X}')]
+  steppings = [s for s in range(16) if len(parts) == 3 or regexes[2].fullmatch(f'{s:X}')]
+  if not families or families != list(range(families[0], families[-1] + 1)):
+    return None
+
+  model_words = [sum(1 << (m % 64) for m in models if m // 64 == w) for w in range(4)]
+  return (f'{{ "{parts[0]}", {families[0]}, {families[-1]}, '
+          f'{{ {", ".join(f"0x{w:x}ULL" for w in model_words)} }}, '
+          f'0x{sum(1 << s for s in steppings):x}, {"true" if len(parts) == 4 else "false"} }}')
+
+
+def print_cpuid_matchers() -> None:
+  """Write the precompiled cpuid patterns of the rows of pmu_events_map."""
+  _args.output_file.write("""
+/*
+ * The precompiled cpuid patterns of pmu_events_map, in the same order.
+ */
+static const struct cpuid_matcher pmu_events_cpuid_matchers[] = {
+""")
+  for matcher in _cpuid_matchers:
+    _args.output_file.write(f'\t{matcher or "{ NULL }"},\n')
+  _args.output_file.write('};\n')
+
+
+def print_search_map() -> None:
+  """Write search_map(), which finds the pmu_events_map row of a cpuid."""
+  if not any(_cpuid_matchers):
+    _args.output_file.write("""static const struct pmu_events_map *search_map(const char *cpuid)
+{
+        for (size_t i = 0; pmu_events_map[i].arch; i++) {
+                if (!strcmp_cpuid_str(pmu_events_map[i].cpuid, cpuid))
+                        return &pmu_events_map[i];
+        }
+        return NULL;
+}
+""")
+    return
+
+  _args.output_file.write("""static const struct pmu_events_map *search_map(const char *cpuid)
+{
+        struct cpuid_key key;
+        bool has_key = parse_cpuid_key(cpuid, &key) == 0;
+
+        for (size_t i = 0; pmu_events_map[i].arch; i++) {
+                const struct cpuid_matcher *matcher = &pmu_events_cpuid_matchers[i];
+
+                if (has_key && matcher->vendor) {
+                        if (match_cpuid_key(matcher, &key))
+                                return &pmu_events_map[i];
+                } else if (!strcmp_cpuid_str(pmu_events_map[i].cpuid, cpuid)) {
+                        return &pmu_events_map[i];
+                }
+        }
+        return NULL;
+}
+""")
+
+
+def host_cpuids(arch: str) -> Sequence[str]:
+  """The cpuids of the CPUs of this host, formatted like get_cpuid_str() does."""
+  if arch == 'x86':
+    fields = {}
+    with open('/proc/cpuinfo') as cpuinfo:
+      for line in cpuinfo:
+        if not line.strip():
+          break
+        key, _, value = line.partition(':')
+        fields[key.strip()] = value.strip()
+    return [f"{fields['vendor_id']}-{int(fields['cpu family'])}-"
+            f"{int(fields['model']):X}-{int(fields['stepping']):X}"]
+  if arch == 'arm64':
+    cpuids = set()
+    cpu_dir = '/sys/devices/system/cpu'
+    for item in os.scandir(cpu_dir):
+      midr = f'{item.path}/regs/identification/midr_el1'
+      if re.fullmatch(r'cpu[0-9]+', item.name) and os.path.exists(midr):
+        with open(midr) as f:
+          cpuids.add(f.read().strip())
+    return sorted(cpuids)
+  return []
+
+
+def cpuid_matches(arch: str, pattern: str, cpuid: str) -> bool:
+  """Whether "cpuid" matches the mapfile cpuid "pattern", like strcmp_cpuid_str()."""
+  if arch == 'arm64':
+    variant_mask = 0xf << 20
+    revision_mask = 0xf
+    map_id = int(pattern, 16)
+    cpu_id = int(cpuid, 16)
+    if map_id & ~(variant_mask | revision_mask) != cpu_id & ~(variant_mask | revision_mask):
+      return False
+    return (cpu_id & (variant_mask | revision_mask)) >= (map_id & (variant_mask | revision_mask))
+
+  # Patterns without a stepping ignore the stepping of the cpuid.
+  if pattern.count('-') < 3 and cpuid.count('-') == 3:
+    cpuid = cpuid[:cpuid.rindex('-')]
+  try:
+    return re.fullmatch(pattern.replace('[:xdigit:]', '0-9A-Fa-f'), cpuid) is not None
+  except re.error:
+    return False
+
+
+def detect_host_models(arch: str, starting_dir: str) -> Sequence[str]:
+  """The models of mapfile.csv matching the CPUs of this host."""
+  models = set()
+  with open(f'{starting_dir}/{arch}/mapfile.csv') as csvfile:
+    # Like print_mapping_table(), skip the first row and any row beginning with #.
+    rows = [row for row in list(csv.reader(csvfile))[1:]
+            if len(row) > 2 and not row[0].startswith('#')]
+  for cpuid in host_cpuids(arch):
+    for row in rows:
+      if cpuid_matches(arch, row[0], cpuid):
+        models.add(row[2])
+        break
+  return sorted(models)
+
+
 def print_mapping_table(archs: Sequence[str]) -> None:
   """Read the mapfile and generate the struct from cpuid string to event table."""
   _args.output_file.write("""
@@ -701,6 +1146,7 @@ const struct pmu_events_map pmu_events_map[] = {
 """)
   for arch in archs:
     if arch == 'test':
+      _cpuid_matchers.append(None)
       _args.output_file.write("""{
 \t.arch = "testarch",
 \t.cpuid = "testcpu",
@@ -715,6 +1161,7 @@ const struct pmu_events_map pmu_events_map[] = {
 },
 """)
     elif arch == 'common':
+      _cpuid_matchers.append(None)
       _args.output_file.write("""{
 \t.arch = "common",
 \t.cpuid = "common",
@@ -746,7 +1193,14 @@ const struct pmu_events_map pmu_events_map[] = {
               metric_size = '0'
             if event_size == '0' and metric_size == '0':
               continue
+            layout_tblname = file_name_to_table_name('pmu_layouts_', [], row[2].replace('/', '_'))
+            if layout_tblname in _pmu_layouts_tables:
+              layout_size = f'ARRAY_SIZE({layout_tblname})'
+            else:
+              layout_tblname = 'NULL'
+              layout_size = '0'
             cpuid = row[0].replace('\\', '\\\\')
+            _cpuid_matchers.append(compile_cpuid_pattern(row[0]) if arch == 'x86' else None)
             _args.output_file.write(f"""{{
 \t.arch = "{arch}",
 \t.cpuid = "{cpuid}",
@@ -757,6 +1211,10 @@ const struct pmu_events_map pmu_events_map[] = {
 \t.metric_table = {{
 \t\t.pmus = {metric_tblname},
 \t\t.num_pmus = {metric_size}
+\t}},
+\t.layout_table = {{
+\t\t.entries = {layout_tblname},
+\t\t.num_entries = {layout_size}
 \t}}
 }},
 """)
@@ -767,11 +1225,143 @@ const struct pmu_events_map pmu_events_map[] = {
 \t.cpuid = 0,
 \t.event_table = { 0, 0 },
 \t.metric_table = { 0, 0 },
+\t.layout_table = { 0, 0 },
 }
 };
 """)
 
 
+def print_cold_strings() -> None:
+  """Writes the compressed blocks of _cold_strings and get_cold_strings()."""
+  blocks = _cold_strings.compressed_blocks()
+
+  def c_bytes(data: bytes) -> str:
+    return ''.join(chr(b) if 32 <= b < 127 and chr(b) not in '"\\?' else f'\\{b:03o}'
+                   for b in data)
+
+  _args.output_file.write('static const char cold_strings_data[] =\n')
+  offset = 0
+  for idx, block in enumerate(blocks):
+    _args.output_file.write(f'/* block={idx} offset={offset} */\n')
+    for pos in range(0, len(block), 64):
+      _args.output_file.write(f'"{c_bytes(block[pos:pos + 64])}"\n')
+    offset += len(block)
+  _args.output_file.write(""";
+
+static const struct {
+	uint32_t offset;
+	uint32_t compressed_size;
+	uint32_t size;
+} cold_strings_blocks[] = {
+""")
+  offset = 0
+  for block, compressed in zip(_cold_strings.blocks, blocks):
+    _args.output_file.write(f'\t{{ {offset}, {len(compressed)}, {len(block)} }},\n')
+    offset += len(compressed)
+  _args.output_file.write(f"""}};
+
+/* The inflated blocks, published with a compare-and-swap and never freed */
+static _Atomic(char *) cold_strings_cache[ARRAY_SIZE(cold_strings_blocks)];
+
+/*
+ * Returns the cold fields with the id "id", inflating their block on first use,
+ * or NULL if the block can't be inflated.
+ */
+static const char *get_cold_strings(unsigned long id)
+{{
+	size_t idx = id / {ColdStrings.BLOCK_SIZE};
+	size_t offset = id % {ColdStrings.BLOCK_SIZE};
+	char *block, *expected = NULL;
+
+	if (idx >= ARRAY_SIZE(cold_strings_blocks) || offset >= cold_strings_blocks[idx].size)
+		return NULL;
+
+	block = atomic_load_explicit(&cold_strings_cache[idx], memory_order_acquire);
+	if (block)
+		return &block[offset];
+
+	block = malloc(cold_strings_blocks[idx].size);
+	if (!block)
+		return NULL;
+	if (inflate_raw(block, cold_strings_blocks[idx].size,
+			&cold_strings_data[cold_strings_blocks[idx].offset],
+			cold_strings_blocks[idx].compressed_size) == -1) {{
+		free(block);
+		return NULL;
+	}}
+
+	if (!atomic_compare_exchange_strong_explicit(&cold_strings_cache[idx], &expected, block,
+						     memory_order_acq_rel, memory_order_acquire)) {{
+		/* Another thread published the block first */
+		free(block);
+		block = expected;
+	}}
+	return &block[offset];
+}}
+
+""")
+
+def print_decompress_event() -> None:
+  """Writes decompress_event() and decompress_event_hot()."""
+
+  def print_fields(var: str, attrs: Sequence[str]) -> None:
+    for attr in attrs:
+      _args.output_file.write(f'\n\t{var}->{attr} = ')
+      if attr in _json_enum_attributes:
+        _args.output_file.write("*p - '0';\n")
+      else:
+        _args.output_file.write("(*p == '\\0' ? NULL : p);\n")
+      if attr == attrs[-1]:
+        continue
+      if attr in _json_enum_attributes:
+        _args.output_file.write('\tp++;')
+      else:
+        _args.output_file.write('\twhile (*p++);')
+
+  if not _args.compress_cold_strings:
+    _args.output_file.write("""void decompress_event(int offset, struct pmu_event *pe)
+{
+\tconst char *p = &big_c_string[offset];
+""")
+    print_fields('pe', _json_event_attributes)
+    _args.output_file.write("""}
+
+void decompress_event_hot(int offset, struct pmu_event *pe)
+{
+\tdecompress_event(offset, pe);
+}
+""")
+    return
+
+  hot_attributes = event_string_attributes()[:-1]
+  _args.output_file.write("""/* Decompresses all but the cold fields, returns the id of the cold fields */
+static unsigned long decompress_hot_fields(int offset, struct pmu_event *pe)
+{
+\tconst char *p = &big_c_string[offset];
+
+""")
+  for attr in _json_event_cold_attributes:
+    _args.output_file.write(f'\tpe->{attr} = NULL;\n')
+  print_fields('pe', hot_attributes)
+  _args.output_file.write("""\twhile (*p++);
+\treturn strtoul(p, NULL, 10);
+}
+
+void decompress_event_hot(int offset, struct pmu_event *pe)
+{
+\tdecompress_hot_fields(offset, pe);
+}
+
+void decompress_event(int offset, struct pmu_event *pe)
+{
+\tconst char *p = get_cold_strings(decompress_hot_fields(offset, pe));
+
+\tif (!p)
+\t\treturn;
+""")
+  print_fields('pe', _json_event_cold_attributes)
+  _args.output_file.write('}\n')
+
 def print_system_mapping_table() -> None:
   """C struct mapping table array for tables from /sys directories."""
   _args.output_file.write("""
@@ -819,25 +1409,17 @@ static const struct pmu_sys_events pmu_sys_event_tables[] = {
 \t},
 };
 
-void decompress_event(int offset, struct pmu_event *pe)
+const struct pmu_events_table *get_sys_event_table(size_t idx)
 {
-\tconst char *p = &big_c_string[offset];
-""")
-  for attr in _json_event_attributes:
-    _args.output_file.write(f'\n\tpe->{attr} = ')
-    if attr in _json_enum_attributes:
-      _args.output_file.write("*p - '0';\n")
-    else:
-      _args.output_file.write("(*p == '\\0' ? NULL : p);\n")
-    if attr == _json_event_attributes[-1]:
-      continue
-    if attr in _json_enum_attributes:
-      _args.output_file.write('\tp++;')
-    else:
-      _args.output_file.write('\twhile (*p++);')
-  _args.output_file.write("""}
+\tif (idx >= ARRAY_SIZE(pmu_sys_event_tables) - 1)
+\t\treturn NULL;
+\treturn &pmu_sys_event_tables[idx].event_table;
+}
 
-static void decompress_metric(int offset, struct pmu_metric *pm)
+""")
+  print_decompress_event()
+  _args.output_file.write("""
+void decompress_metric(int offset, struct pmu_metric *pm)
 {
 \tconst char *p = &big_c_string[offset];
 """)
@@ -857,65 +1439,169 @@ static void decompress_metric(int offset, struct pmu_metric *pm)
 
 
 
-const struct pmu_events_map *map_for_cpu(struct perf_cpu cpu)
+/*
+ * The maps of all CPUs, indexed by cpu + 1 so that cpu -1 has a slot as well.
+ *
+ * The table is built once, published with a compare-and-swap and never modified
+ * or freed afterwards, so map_for_cpu() can be called from any thread without locks.
+ */
+struct cpu_map_table {
+        int num_cpus;
+        const struct pmu_events_map *maps[];
+};
+
+static _Atomic(struct cpu_map_table *) cpu_map_table;
+
+""")
+  print_search_map()
+  _args.output_file.write("""
+static const struct pmu_events_map *resolve_map(struct perf_cpu cpu)
 {
-        static struct {
-                const struct pmu_events_map *map;
-                struct perf_cpu cpu;
-        } last_result;
-        static struct {
-                const struct pmu_events_map *map;
-                char *cpuid;
-        } last_map_search;
-        static bool has_last_result, has_last_map_search;
-        const struct pmu_events_map *map = NULL;
-        char *cpuid = NULL;
-        size_t i;
-
-        if (has_last_result && last_result.cpu.cpu == cpu.cpu)
-                return last_result.map;
-
-        cpuid = get_cpuid_allow_env_override(cpu);
+        const struct pmu_events_map *map;
+        char *cpuid = get_cpuid_allow_env_override(cpu);
 
         /*
          * On some platforms which uses cpus map, cpuid can be NULL for
          * PMUs other than CORE PMUs.
          */
         if (!cpuid)
-                goto out_update_last_result;
-
-        if (has_last_map_search && !strcmp(last_map_search.cpuid, cpuid)) {
-                map = last_map_search.map;
-                free(cpuid);
-        } else {
-                i = 0;
-                for (;;) {
-                        map = &pmu_events_map[i++];
-
-                        if (!map->arch) {
-                                map = NULL;
-                                break;
-                        }
-
-                        if (!strcmp_cpuid_str(map->cpuid, cpuid))
-                                break;
-               }
-               free(last_map_search.cpuid);
-               last_map_search.cpuid = cpuid;
-               last_map_search.map = map;
-               has_last_map_search = true;
-        }
-out_update_last_result:
-        last_result.cpu = cpu;
-        last_result.map = map;
-        has_last_result = true;
+                return NULL;
+
+        map = search_map(cpuid);
+        free(cpuid);
         return map;
 }
 
+static struct cpu_map_table *build_cpu_map_table(void)
+{
+        long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+        struct cpu_map_table *table;
+        const struct pmu_events_map *last_map = NULL;
+        char *last_cpuid = NULL;
+
+        if (num_cpus < 1)
+                num_cpus = 1;
+
+        table = malloc(sizeof(*table) + (num_cpus + 1) * sizeof(table->maps[0]));
+        if (!table)
+                return NULL;
+
+        table->num_cpus = num_cpus;
+        for (int i = -1; i < num_cpus; i++) {
+                struct perf_cpu cpu = { .cpu = i };
+                char *cpuid = get_cpuid_allow_env_override(cpu);
+
+                /* Usually all CPUs share a cpuid, so only search the maps once per cpuid */
+                if (cpuid && last_cpuid && !strcmp(cpuid, last_cpuid)) {
+                        free(cpuid);
+                } else if (cpuid) {
+                        free(last_cpuid);
+                        last_cpuid = cpuid;
+                        last_map = search_map(cpuid);
+                }
+                table->maps[i + 1] = cpuid ? last_map : NULL;
+        }
+        free(last_cpuid);
+        return table;
+}
+
+const struct pmu_events_map *map_for_cpu(struct perf_cpu cpu)
+{
+        struct cpu_map_table *table;
+
+        /* The override is meant for testing and may change, so it is not cached */
+        if (getenv("PERF_CPUID"))
+                return resolve_map(cpu);
+
+        table = atomic_load_explicit(&cpu_map_table, memory_order_acquire);
+        if (!table) {
+                struct cpu_map_table *expected = NULL;
+
+                table = build_cpu_map_table();
+                if (!table)
+                        return resolve_map(cpu);
+
+                if (!atomic_compare_exchange_strong_explicit(&cpu_map_table, &expected, table,
+                                                             memory_order_acq_rel,
+                                                             memory_order_acquire)) {
+                        /* Another thread published its table first */
+                        free(table);
+                        table = expected;
+                }
+        }
+
+        /* E.g. CPUs that were hotplugged after the table was built */
+        if (cpu.cpu < -1 || cpu.cpu >= table->num_cpus)
+                return resolve_map(cpu);
+
+        return table->maps[cpu.cpu + 1];
+}
+
+const struct pmu_events_map *map_for_cpuid(const char *cpuid)
+{
+        return search_map(cpuid);
+}
+
 const char *get_pmu_name(struct pmu_table_entry entry)
 {
     return &big_c_string[entry.pmu_name.offset];
 }
+
+const char *get_event_name(struct compact_pmu_event entry)
+{
+    return &big_c_string[entry.offset];
+}
+""")
+
+def print_metric_bytecode_tables() -> None:
+  """Write the mapping from metric tables to their precompiled bytecode."""
+  if not _metric_bytecode_tables:
+    _args.output_file.write("""
+const struct metric_bytecode_table *get_metric_bytecode(const struct pmu_metrics_table *table)
+{
+        return NULL;
+}
+""")
+    return
+
+  _args.output_file.write("""
+static const struct metric_bytecode_table metric_bytecode_tables[] = {
+""")
+  for tblname in _metric_bytecode_tables:
+    _args.output_file.write(f"""{{
+\t.pmus = {tblname},
+\t.exprs = {tblname}_exprs,
+\t.insns = {tblname}_insns,
+\t.vars = {tblname}_vars,
+}},
+""")
+  _args.output_file.write("""};
+
+const struct metric_bytecode_table *get_metric_bytecode(const struct pmu_metrics_table *table)
+{
+        for (size_t i = 0; i < ARRAY_SIZE(metric_bytecode_tables); i++) {
+                if (metric_bytecode_tables[i].pmus == table->pmus)
+                        return &metric_bytecode_tables[i];
+        }
+        return NULL;
+}
+""")
+
+def print_event_topics() -> None:
+  """Write the names of the topic ids of the compact_pmu_events."""
+  _args.output_file.write("""
+static const char *const event_topics[] = {
+""")
+  for topic, topic_id in sorted(_event_topics.items(), key=lambda t: t[1]):
+    _args.output_file.write(f'\t"{topic}", /* {topic_id} */\n')
+  _args.output_file.write("""};
+
+const char *get_event_topic(uint16_t topic)
+{
+        if (topic >= ARRAY_SIZE(event_topics))
+                return NULL;
+        return event_topics[topic];
+}
 """)
 
 def print_metricgroups() -> None:
@@ -992,8 +1678,21 @@ such as "arm/cortex-a34".''',
   )
   ap.add_argument(
       'output_file', type=argparse.FileType('w', encoding='utf-8'), nargs='?', default=sys.stdout)
+  ap.add_argument(
+      '--metric-bytecode', action='store_true',
+      help='Also emit the metric expressions as precompiled bytecode, see get_metric_bytecode()')
+  ap.add_argument(
+      '--compress-cold-strings', action='store_true',
+      help='Store the topics and descriptions of events in compressed blocks')
+  ap.add_argument(
+      '--detect-host-model', action='store_true',
+      help='Only print the comma-separated models of the CPUs of this host, for use as "model"')
   _args = ap.parse_args()
 
+  if _args.detect_host_model:
+    print(','.join(detect_host_models(_args.arch, _args.starting_dir)))
+    return
+
   _args.output_file.write(f"""
 /* SPDX-License-Identifier: GPL-2.0 */
 /* THIS FILE WAS AUTOGENERATED BY jevents.py arch={_args.arch} model={_args.model} ! */
@@ -1006,7 +1705,11 @@ such as "arm/cortex-a34".''',
 #include <stdint.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdatomic.h>
+#include <unistd.h>
 #include <pmu-events/pmu-events.h>
+#include <pmu-events/metric.h>
+#include <pmu-events/_impl/pmu-events.h>
 
 #ifdef __x86_64__
 #include <pmu-events/x86/util.h>
@@ -1058,14 +1761,26 @@ char *get_cpuid_allow_env_override(struct perf_cpu cpu)
   for s in _bcs.big_string:
     _args.output_file.write(s)
   _args.output_file.write(';\n\n')
+  if _args.compress_cold_strings:
+    print_cold_strings()
+  tables_hash = hashlib.sha256(''.join(_bcs.big_string).encode('utf-8'))
+  for block in _cold_strings.blocks:
+    tables_hash.update(block)
+  tables_hash = tables_hash.hexdigest()[:16]
+  _args.output_file.write(f'const uint64_t pmu_events_tables_hash = 0x{tables_hash}ULL;\n\n')
   for arch in archs:
     arch_path = f'{_args.starting_dir}/{arch}'
     ftw(arch_path, [], process_one_file)
     print_pending_events()
+    print_pending_pmu_layouts()
     print_pending_metrics()
 
   print_mapping_table(archs)
+  if any(_cpuid_matchers):
+    print_cpuid_matchers()
   print_system_mapping_table()
+  print_metric_bytecode_tables()
+  print_event_topics()
   print_metricgroups()
 
 if __name__ == '__main__':
@@ -0,0 +1,538 @@
+#include <pmu-events/attr-cache.h>
+#include <pmu-events/pmu-events.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#define ATTR_CACHE_MAGIC "PMUATTR"
+/*
+ * Has to be increased whenever the file layout changes
+ */
+#define ATTR_CACHE_VERSION 1
+
+/*
+ * The file starts with the header, followed by the instances, ranges, attrs and strings
+ * sections. All sections are arrays of the structs below, the strings section contains
+ * the null-terminated names of the instances.
+ */
+struct attr_cache_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t attr_size;
+    /* pmu_events_tables_hash of the library that wrote the file */
+    uint64_t tables_hash;
+    /* See system_hash() */
+    uint64_t system_hash;
+    /* hash_pmu_devices() when the file was written */
+    uint64_t devices_hash;
+    uint64_t size;
+    uint32_t num_instances;
+    uint32_t num_ranges;
+    uint32_t num_attrs;
+    uint32_t strings_size;
+};
+
+/*
+ * A PMU instance, the instances are sorted by name
+ */
+struct cached_instance
+{
+    /* Offset of the name in the strings section */
+    uint32_t name;
+    int32_t type;
+    /* Index of the first range of the cpus of the instance */
+    uint32_t ranges;
+    uint32_t num_ranges;
+    /* Index of the first attr of the instance, the attrs are sorted by event name */
+    uint32_t attrs;
+    uint32_t num_attrs;
+};
+
+struct cached_attr
+{
+    /* The offset of the compact_pmu_event of the event */
+    int32_t event;
+    uint32_t reserved;
+    struct perf_event_attr attr;
+};
+
+/*
+ * A hash of the kernel and the CPU the cache is used on, or of those recorded in the
+ * snapshot of "sysfs"
+ */
+static uint64_t system_hash(const struct pmu_sysfs* sysfs)
+{
+    uint64_t hash = HASH_DATA_INIT;
+
+    if (sysfs != NULL && sysfs->snapshot != NULL)
+    {
+        static const char* const keys[] = { "uname.release", "uname.version", "uname.machine" };
+        for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+        {
+            const char* value = get_sysfs_snapshot_value(sysfs->snapshot, keys[i]);
+            if (value != NULL)
+            {
+                hash = hash_data(hash, value, strlen(value) + 1);
+            }
+        }
+    }
+    else
+    {
+        struct utsname uts;
+        if (uname(&uts) == 0)
+        {
+            hash = hash_data(hash, uts.release, strlen(uts.release) + 1);
+            hash = hash_data(hash, uts.version, strlen(uts.version) + 1);
+            hash = hash_data(hash, uts.machine, strlen(uts.machine) + 1);
+        }
+    }
+
+    struct perf_cpu cpu = { .cpu = 0 };
+    char* cpuid = get_sysfs_cpuid(sysfs, cpu);
+    if (cpuid != NULL)
+    {
+        hash = hash_data(hash, cpuid, strlen(cpuid) + 1);
+        free(cpuid);
+    }
+    return hash;
+}
+
+static int cmp_instances_by_name(const void* a, const void* b)
+{
+    const struct pmu_instance* lhs = *(const struct pmu_instance* const*)a;
+    const struct pmu_instance* rhs = *(const struct pmu_instance* const*)b;
+    return strcmp(lhs->name, rhs->name);
+}
+
+/*
+ * Appends "len" bytes of "data" to the buffer "buf" of size "size" and capacity "capacity"
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int append(char** buf, size_t* size, size_t* capacity, const void* data, size_t len)
+{
+    if (*size + len > *capacity)
+    {
+        size_t new_capacity = *capacity == 0 ? 4096 : *capacity;
+        while (*size + len > new_capacity)
+        {
+            new_capacity *= 2;
+        }
+        char* tmp = realloc(*buf, new_capacity);
+        if (tmp == NULL)
+        {
+            return -1;
+        }
+        *buf = tmp;
+        *capacity = new_capacity;
+    }
+    memcpy(*buf + *size, data, len);
+    *size += len;
+    return 0;
+}
+
+/*
+ * A section of the cache file while it is being built
+ */
+struct section
+{
+    char* data;
+    size_t size;
+    size_t capacity;
+};
+
+static int append_to(struct section* section, const void* data, size_t len)
+{
+    return append(&section->data, &section->size, &section->capacity, data, len);
+}
+
+/*
+ * Builds the sections of the instances "instances" into "sections"
+ * (instances, ranges, attrs and strings)
+ */
+static int build_sections(const struct pmu_instance** instances, size_t num_instances,
+                          struct section* sections)
+{
+    struct section* cached_instances = &sections[0];
+    struct section* ranges = &sections[1];
+    struct section* attrs = &sections[2];
+    struct section* strings = &sections[3];
+
+    for (size_t i = 0; i < num_instances; i++)
+    {
+        const struct pmu_instance* instance = instances[i];
+        struct cached_instance cached = {
+            .name = strings->size,
+            .type = instance->type,
+            .ranges = ranges->size / sizeof(struct range),
+            .num_ranges = instance->cpus.len,
+            .attrs = attrs->size / sizeof(struct cached_attr),
+        };
+
+        if (append_to(strings, instance->name, strlen(instance->name) + 1) == -1)
+        {
+            return -1;
+        }
+        if (append_to(ranges, instance->cpus.ranges, instance->cpus.len * sizeof(struct range)) ==
+            -1)
+        {
+            return -1;
+        }
+
+        /* The entries are sorted by name, so the attrs are as well */
+        for (uint32_t x = 0; x < instance->num_entries; x++)
+        {
+            struct pmu_event ev;
+            decompress_event_hot(instance->entries[x].offset, &ev);
+
+            struct cached_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.event = instance->entries[x].offset;
+            attr.attr.size = sizeof(attr.attr);
+            if (gen_attr_for_event(instance, &ev, &attr.attr) == -1)
+            {
+                continue;
+            }
+            if (append_to(attrs, &attr, sizeof(attr)) == -1)
+            {
+                return -1;
+            }
+            cached.num_attrs++;
+        }
+
+        if (append_to(cached_instances, &cached, sizeof(cached)) == -1)
+        {
+            return -1;
+        }
+    }
+
+    /* Keep the size of the file a multiple of 8 */
+    while (strings->size % 8 != 0)
+    {
+        if (append_to(strings, "", 1) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int write_file(const char* path, const struct attr_cache_header* header,
+                      const struct section* sections, size_t num_sections)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    int ret = fwrite(header, sizeof(*header), 1, file) == 1 ? 0 : -1;
+    for (size_t i = 0; i < num_sections && ret == 0; i++)
+    {
+        if (sections[i].size != 0 && fwrite(sections[i].data, sections[i].size, 1, file) != 1)
+        {
+            ret = -1;
+        }
+    }
+
+    if (fclose(file) != 0)
+    {
+        ret = -1;
+    }
+    return ret;
+}
+
+int write_attr_cache(const struct pmus* pmus, const char* path)
+{
+    return write_attr_cache_for(pmus, NULL, path);
+}
+
+int write_attr_cache_for(const struct pmus* pmus, const struct pmu_sysfs* sysfs,
+                         const char* path)
+{
+    size_t num_instances = 0;
+    for (size_t cur_class = 0; cur_class < pmus->num_classes; cur_class++)
+    {
+        num_instances += pmus->classes[cur_class].num_instances;
+    }
+
+    const struct pmu_instance** instances = malloc(num_instances * sizeof(struct pmu_instance*));
+    if (instances == NULL && num_instances != 0)
+    {
+        return -1;
+    }
+    size_t cur = 0;
+    for (size_t cur_class = 0; cur_class < pmus->num_classes; cur_class++)
+    {
+        for (int x = 0; x < pmus->classes[cur_class].num_instances; x++)
+        {
+            instances[cur++] = &pmus->classes[cur_class].instances[x];
+        }
+    }
+    qsort(instances, num_instances, sizeof(struct pmu_instance*), cmp_instances_by_name);
+
+    struct section sections[4] = { 0 };
+    int ret = build_sections(instances, num_instances, sections);
+    free(instances);
+
+    /* A cache written without the hash of the devices could never be validated */
+    uint64_t devices_hash;
+    if (ret == 0)
+    {
+        ret = hash_pmu_devices_from(sysfs, &devices_hash);
+    }
+
+    char* tmp_path = NULL;
+    if (ret == 0)
+    {
+        struct attr_cache_header header = {
+            .magic = ATTR_CACHE_MAGIC,
+            .version = ATTR_CACHE_VERSION,
+            .attr_size = sizeof(struct perf_event_attr),
+            .tables_hash = pmu_events_tables_hash,
+            .system_hash = system_hash(sysfs),
+            .devices_hash = devices_hash,
+            .size = sizeof(struct attr_cache_header),
+            .num_instances = num_instances,
+            .num_ranges = sections[1].size / sizeof(struct range),
+            .num_attrs = sections[2].size / sizeof(struct cached_attr),
+            .strings_size = sections[3].size,
+        };
+        for (size_t i = 0; i < 4; i++)
+        {
+            header.size += sections[i].size;
+        }
+
+        /* Write to a temporary file and rename it, so that readers never see a partial file */
+        size_t tmp_path_len = strlen(path) + 32;
+        tmp_path = malloc(tmp_path_len);
+        if (tmp_path == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            snprintf(tmp_path, tmp_path_len, "%s.%ld.tmp", path, (long)getpid());
+            ret = write_file(tmp_path, &header, sections, 4);
+            if (ret == 0 && rename(tmp_path, path) == -1)
+            {
+                ret = -1;
+            }
+            if (ret == -1)
+            {
+                unlink(tmp_path);
+            }
+        }
+    }
+
+    free(tmp_path);
+    for (size_t i = 0; i < 4; i++)
+    {
+        free(sections[i].data);
+    }
+    return ret;
+}
+
+static const struct attr_cache_header* get_header(const struct attr_cache* cache)
+{
+    return cache->data;
+}
+
+static const struct cached_instance* get_instances(const struct attr_cache* cache)
+{
+    return (const struct cached_instance*)(get_header(cache) + 1);
+}
+
+static const struct range* get_ranges(const struct attr_cache* cache)
+{
+    return (const struct range*)(get_instances(cache) + get_header(cache)->num_instances);
+}
+
+static const struct cached_attr* get_attrs(const struct attr_cache* cache)
+{
+    return (const struct cached_attr*)(get_ranges(cache) + get_header(cache)->num_ranges);
+}
+
+static const char* get_strings(const struct attr_cache* cache)
+{
+    return (const char*)(get_attrs(cache) + get_header(cache)->num_attrs);
+}
+
+/*
+ * Checks that "cache" is a well-formed cache file for this library, kernel and
+ * set of PMU devices
+ */
+static bool is_valid_cache(const struct attr_cache* cache)
+{
+    if (cache->size < sizeof(struct attr_cache_header))
+    {
+        return false;
+    }
+
+    const struct attr_cache_header* header = get_header(cache);
+    if (memcmp(header->magic, ATTR_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != ATTR_CACHE_VERSION ||
+        header->attr_size != sizeof(struct perf_event_attr) || header->size != cache->size)
+    {
+        return false;
+    }
+
+    uint64_t expected_size = sizeof(struct attr_cache_header) +
+                             (uint64_t)header->num_instances * sizeof(struct cached_instance) +
+                             (uint64_t)header->num_ranges * sizeof(struct range) +
+                             (uint64_t)header->num_attrs * sizeof(struct cached_attr) +
+                             header->strings_size;
+    if (expected_size != cache->size)
+    {
+        return false;
+    }
+
+    const struct cached_instance* instances = get_instances(cache);
+    for (uint32_t i = 0; i < header->num_instances; i++)
+    {
+        if (instances[i].name >= header->strings_size ||
+            (uint64_t)instances[i].ranges + instances[i].num_ranges > header->num_ranges ||
+            (uint64_t)instances[i].attrs + instances[i].num_attrs > header->num_attrs)
+        {
+            return false;
+        }
+    }
+    if (header->strings_size != 0 && get_strings(cache)[header->strings_size - 1] != '\0')
+    {
+        return false;
+    }
+
+    /* The cheap checks first, hashing the devices reads sysfs */
+    uint64_t devices_hash;
+    return header->tables_hash == pmu_events_tables_hash &&
+           header->system_hash == system_hash(NULL) && hash_pmu_devices(&devices_hash) == 0 &&
+           header->devices_hash == devices_hash;
+}
+
+int open_attr_cache(const char* path, struct attr_cache* cache)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    cache->data = data;
+    cache->size = st.st_size;
+    if (!is_valid_cache(cache))
+    {
+        close_attr_cache(cache);
+        return -1;
+    }
+    return 0;
+}
+
+void close_attr_cache(struct attr_cache* cache)
+{
+    if (cache->data != NULL)
+    {
+        munmap((void*)cache->data, cache->size);
+    }
+    cache->data = NULL;
+    cache->size = 0;
+}
+
+static const struct cached_instance* find_instance(const struct attr_cache* cache,
+                                                   const char* name)
+{
+    const struct cached_instance* instances = get_instances(cache);
+    const char* strings = get_strings(cache);
+    size_t low = 0;
+    size_t high = get_header(cache)->num_instances;
+
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        int cmp = strcmp(&strings[instances[mid].name], name);
+
+        if (cmp == 0)
+        {
+            return &instances[mid];
+        }
+        else if (cmp < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+const struct perf_event_attr* attr_cache_get(const struct attr_cache* cache,
+                                             const char* instance, const char* event)
+{
+    const struct cached_instance* cached = find_instance(cache, instance);
+    if (cached == NULL)
+    {
+        return NULL;
+    }
+
+    const struct cached_attr* attrs = &get_attrs(cache)[cached->attrs];
+    size_t low = 0;
+    size_t high = cached->num_attrs;
+
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        struct compact_pmu_event entry = { .offset = attrs[mid].event };
+        int cmp = strcmp(get_event_name(entry), event);
+
+        if (cmp == 0)
+        {
+            return &attrs[mid].attr;
+        }
+        else if (cmp < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+const struct range* attr_cache_get_cpus(const struct attr_cache* cache, const char* instance,
+                                        size_t* num_ranges)
+{
+    const struct cached_instance* cached = find_instance(cache, instance);
+    if (cached == NULL)
+    {
+        return NULL;
+    }
+
+    *num_ranges = cached->num_ranges;
+    return &get_ranges(cache)[cached->ranges];
+}
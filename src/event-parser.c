@@ -0,0 +1,473 @@
+/* For strverscmp() */
+#define _GNU_SOURCE
+
+#include <pmu-events/event-parser.h>
+#include <pmu-events/pmu-events.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The longest PMU name, event name or term of an event string
+ */
+#define MAX_TOKEN_LEN 256
+
+/*
+ * The generic events of perf, which are not in the event tables
+ */
+static const struct
+{
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+} generic_events[] = {
+    { "alignment-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_ALIGNMENT_FAULTS },
+    { "branch-instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+    { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+    { "bus-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BUS_CYCLES },
+    { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+    { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { "cpu-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK },
+    { "cpu-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+    { "cs", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "emulation-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_EMULATION_FAULTS },
+    { "faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "major-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ },
+    { "migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+    { "minor-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN },
+    { "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { "ref-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES },
+    { "task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+};
+
+/*
+ * Copies the "len" characters of "src" into "dest" as a string, lowercased
+ * if "lower" is set
+ *
+ * Returns 0 on success, -1 if they do not fit into MAX_TOKEN_LEN characters
+ */
+static int copy_token(char* dest, const char* src, size_t len, bool lower)
+{
+    if (len == 0 || len >= MAX_TOKEN_LEN)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        dest[i] = lower ? tolower((unsigned char)src[i]) : src[i];
+    }
+    dest[len] = '\0';
+    return 0;
+}
+
+/*
+ * Returns the first instance of "pmu_class" in natural name order, e.g. uncore_imc_2
+ * before uncore_imc_10, independent of the order the devices were found in
+ */
+static const struct pmu_instance* first_instance(const struct pmu_class* pmu_class)
+{
+    const struct pmu_instance* first = &pmu_class->instances[0];
+    for (int x = 1; x < pmu_class->num_instances; x++)
+    {
+        if (strverscmp(pmu_class->instances[x].name, first->name) < 0)
+        {
+            first = &pmu_class->instances[x];
+        }
+    }
+    return first;
+}
+
+/*
+ * Returns the instance named "name", or the first instance of the class named "name",
+ * of "pmus" and its class, or NULL if there is none
+ */
+static const struct pmu_instance* find_instance(const struct pmus* pmus, const char* name,
+                                                const struct pmu_class** pmu_class)
+{
+    for (size_t i = 0; i < pmus->num_classes; i++)
+    {
+        for (int x = 0; x < pmus->classes[i].num_instances; x++)
+        {
+            if (strcmp(pmus->classes[i].instances[x].name, name) == 0)
+            {
+                *pmu_class = &pmus->classes[i];
+                return &pmus->classes[i].instances[x];
+            }
+        }
+    }
+    for (size_t i = 0; i < pmus->num_classes; i++)
+    {
+        if (pmus->classes[i].num_instances > 0 && strcmp(pmus->classes[i].name, name) == 0)
+        {
+            *pmu_class = &pmus->classes[i];
+            return first_instance(&pmus->classes[i]);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Sets the type and config of "attr" to the event "name" of "pmu_instance"
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int apply_event_name(const struct pmu_instance* pmu_instance, const char* name,
+                            struct perf_event_attr* attr)
+{
+    struct pmu_event ev;
+    if (get_event_by_name(pmu_instance, name, &ev) == -1)
+    {
+        return -1;
+    }
+    return gen_attr_for_event(pmu_instance, &ev, attr);
+}
+
+/*
+ * Applies the term "term" inside the slashes of a "pmu/terms/" event string to "ev"
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int apply_term(struct parsed_event* ev, char* term)
+{
+    char* equal_sign = strchr(term, '=');
+    if (equal_sign == NULL)
+    {
+        /* A flag of the formats, or the name of an event */
+        const struct pmu_format* fmt = find_pmu_format(ev->pmu_instance, term);
+        if (fmt != NULL)
+        {
+            return apply_config_def_to_attr(&ev->attr, 1, &fmt->def);
+        }
+        for (char* c = term; *c != '\0'; c++)
+        {
+            *c = tolower((unsigned char)*c);
+        }
+        return apply_event_name(ev->pmu_instance, term, &ev->attr);
+    }
+
+    *equal_sign = '\0';
+    const char* key = term;
+    const char* value_str = equal_sign + 1;
+    if (strcmp(key, "name") == 0)
+    {
+        return *value_str != '\0' ? 0 : -1;
+    }
+
+    /* As in perf, numbers are decimal unless they start with 0x, a leading 0 is not octal */
+    int base = 10;
+    if (strncmp(value_str, "0x", strlen("0x")) == 0)
+    {
+        value_str += strlen("0x");
+        base = 16;
+    }
+    /* Only digits, strtoull() would also take signs, spaces and a second 0x */
+    if (*value_str == '\0')
+    {
+        return -1;
+    }
+    for (const char* c = value_str; *c != '\0'; c++)
+    {
+        if (base == 16 ? !isxdigit((unsigned char)*c) : !isdigit((unsigned char)*c))
+        {
+            return -1;
+        }
+    }
+    uint64_t value = strtoull(value_str, NULL, base);
+
+    if (strcmp(key, "config") == 0)
+    {
+        ev->attr.config = value;
+    }
+    else if (strcmp(key, "config1") == 0)
+    {
+        ev->attr.config1 = value;
+    }
+    else if (strcmp(key, "config2") == 0)
+    {
+        ev->attr.config2 = value;
+    }
+    else if (strcmp(key, "period") == 0)
+    {
+        ev->attr.sample_period = value;
+        ev->attr.freq = 0;
+    }
+    else if (strcmp(key, "freq") == 0)
+    {
+        ev->attr.sample_freq = value;
+        ev->attr.freq = 1;
+    }
+    else
+    {
+        const struct pmu_format* fmt = find_pmu_format(ev->pmu_instance, key);
+        if (fmt == NULL)
+        {
+            return -1;
+        }
+        return apply_config_def_to_attr(&ev->attr, value, &fmt->def);
+    }
+    return 0;
+}
+
+/*
+ * Parses the "len" characters of "terms" of a "pmu/terms/" event string into "ev"
+ */
+static int parse_terms(struct parsed_event* ev, const char* terms, size_t len)
+{
+    ev->attr.type = ev->pmu_instance->type;
+    if (ev->pmu_instance->type == -1)
+    {
+        return -1;
+    }
+
+    const char* end = terms + len;
+    while (terms < end)
+    {
+        const char* comma = memchr(terms, ',', end - terms);
+        size_t term_len = (comma != NULL ? comma : end) - terms;
+
+        char term[MAX_TOKEN_LEN];
+        if (copy_token(term, terms, term_len, false) == -1 || apply_term(ev, term) == -1)
+        {
+            return -1;
+        }
+        terms += term_len + 1;
+    }
+    return 0;
+}
+
+/*
+ * Resolves the event "name", which is lowercase, without a PMU into "ev"
+ */
+static int resolve_event_name(const struct pmus* pmus, const char* name, struct parsed_event* ev)
+{
+    for (size_t i = 0; i < sizeof(generic_events) / sizeof(generic_events[0]); i++)
+    {
+        if (strcmp(generic_events[i].name, name) == 0)
+        {
+            ev->attr.type = generic_events[i].type;
+            ev->attr.config = generic_events[i].config;
+            return 0;
+        }
+    }
+
+    for (size_t i = 0; i < pmus->num_classes; i++)
+    {
+        const struct pmu_class* pmu_class = &pmus->classes[i];
+        if (pmu_class->num_instances == 0)
+        {
+            continue;
+        }
+        const struct pmu_instance* pmu_instance = first_instance(pmu_class);
+        if (apply_event_name(pmu_instance, name, &ev->attr) == 0)
+        {
+            ev->pmu_class = pmu_class;
+            ev->pmu_instance = pmu_instance;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Applies the modifiers "mods" of an event string to "attr"
+ *
+ * Returns 0 on success, -1 for unknown modifiers
+ */
+static int apply_modifiers(const char* mods, struct perf_event_attr* attr)
+{
+    bool user = false, kernel = false, hv = false;
+    bool guest = false, host = false;
+    for (const char* c = mods; *c != '\0'; c++)
+    {
+        switch (*c)
+        {
+        case 'u':
+            user = true;
+            break;
+        case 'k':
+            kernel = true;
+            break;
+        case 'h':
+            hv = true;
+            break;
+        case 'G':
+            guest = true;
+            break;
+        case 'H':
+            host = true;
+            break;
+        case 'p':
+            if (attr->precise_ip == 3)
+            {
+                return -1;
+            }
+            attr->precise_ip++;
+            break;
+        case 'S':
+            attr->sample_type |= PERF_SAMPLE_READ;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    /* Any of the modes excludes the others, as in perf */
+    if (user || kernel || hv)
+    {
+        attr->exclude_user = !user;
+        attr->exclude_kernel = !kernel;
+        attr->exclude_hv = !hv;
+    }
+    if (guest || host)
+    {
+        attr->exclude_guest = !guest;
+        attr->exclude_host = !host;
+    }
+    return 0;
+}
+
+int parse_event(const struct pmus* pmus, const char* str, struct parsed_event* ev)
+{
+    memset(ev, 0, sizeof(*ev));
+
+    char name[MAX_TOKEN_LEN];
+    const char* mods;
+    const char* slash = strchr(str, '/');
+    if (slash != NULL)
+    {
+        const char* terms_end = strchr(slash + 1, '/');
+        if (terms_end == NULL || copy_token(name, str, slash - str, false) == -1)
+        {
+            return -1;
+        }
+        ev->pmu_instance = find_instance(pmus, name, &ev->pmu_class);
+        if (ev->pmu_instance == NULL ||
+            parse_terms(ev, slash + 1, terms_end - (slash + 1)) == -1)
+        {
+            return -1;
+        }
+        mods = terms_end + 1;
+        mods += *mods == ':';
+    }
+    else
+    {
+        const char* colon = strchr(str, ':');
+        size_t name_len = colon != NULL ? (size_t)(colon - str) : strlen(str);
+        if (copy_token(name, str, name_len, true) == -1 ||
+            resolve_event_name(pmus, name, ev) == -1)
+        {
+            return -1;
+        }
+        mods = colon != NULL ? colon + 1 : "";
+    }
+
+    if (apply_modifiers(mods, &ev->attr) == -1)
+    {
+        return -1;
+    }
+    ev->attr.size = sizeof(ev->attr);
+    return 0;
+}
+
+void init_event_parser(struct event_parser* parser, const struct pmus* pmus)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->pmus = pmus;
+}
+
+void free_event_parser(struct event_parser* parser)
+{
+    for (size_t i = 0; i < parser->num_buckets; i++)
+    {
+        free(parser->entries[i].str);
+    }
+    free(parser->entries);
+    init_event_parser(parser, NULL);
+}
+
+/*
+ * Returns the bucket of "str" in "entries" of "num_buckets" buckets, which is empty
+ * if "str" is not in there
+ */
+static struct event_parser_entry* find_parser_entry(struct event_parser_entry* entries,
+                                                    size_t num_buckets, const char* str)
+{
+    size_t mask = num_buckets - 1;
+    size_t cur = hash_data(HASH_DATA_INIT, str, strlen(str)) & mask;
+
+    while (entries[cur].str != NULL && strcmp(entries[cur].str, str) != 0)
+    {
+        cur = (cur + 1) & mask;
+    }
+    return &entries[cur];
+}
+
+/*
+ * Doubles the buckets of "parser", or allocates the first ones
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int grow_event_parser(struct event_parser* parser)
+{
+    size_t num_buckets = parser->num_buckets != 0 ? parser->num_buckets * 2 : 16;
+    struct event_parser_entry* entries = calloc(num_buckets, sizeof(*entries));
+    if (entries == NULL)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < parser->num_buckets; i++)
+    {
+        if (parser->entries[i].str != NULL)
+        {
+            *find_parser_entry(entries, num_buckets, parser->entries[i].str) = parser->entries[i];
+        }
+    }
+    free(parser->entries);
+    parser->entries = entries;
+    parser->num_buckets = num_buckets;
+    return 0;
+}
+
+int event_parser_parse(struct event_parser* parser, const char* str, struct parsed_event* ev)
+{
+    if (parser->num_buckets != 0)
+    {
+        const struct event_parser_entry* entry =
+            find_parser_entry(parser->entries, parser->num_buckets, str);
+        if (entry->str != NULL)
+        {
+            *ev = entry->ev;
+            return 0;
+        }
+    }
+
+    if (parse_event(parser->pmus, str, ev) == -1)
+    {
+        return -1;
+    }
+
+    /* At most half of the buckets are used, so that the probe sequences stay short */
+    if ((parser->num_entries + 1) * 2 > parser->num_buckets && grow_event_parser(parser) == -1)
+    {
+        /* The result is still valid, it is just not cached */
+        return 0;
+    }
+    struct event_parser_entry* entry = find_parser_entry(parser->entries, parser->num_buckets, str);
+    entry->str = strdup(str);
+    if (entry->str != NULL)
+    {
+        entry->ev = *ev;
+        parser->num_entries++;
+    }
+    return 0;
+}
@@ -0,0 +1,902 @@
+/* For pthread_setaffinity_np() and the CPU_SET macros */
+#define _GNU_SOURCE
+
+#include <pmu-events/event-set.h>
+#include <pmu-events/pmu-events.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * The read_format of all events of an event_set
+ */
+#define EVENT_SET_READ_FORMAT                                                                      \
+    (PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING)
+
+/*
+ * The number of uint64_t read() returns for a group of "num_events" events with
+ * EVENT_SET_READ_FORMAT: nr, time_enabled, time_running and one value per event
+ */
+#define GROUP_READ_LEN(num_events) (3 + (num_events))
+
+static int perf_event_open(struct perf_event_attr* attr, pid_t pid, int cpu, int group_fd,
+                           unsigned long flags)
+{
+    return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+void init_event_set(struct event_set* set)
+{
+    memset(set, 0, sizeof(*set));
+}
+
+/*
+ * Closes and removes all events and groups after the first "num_events" events and
+ * "num_groups" groups of "set"
+ */
+static void truncate_event_set(struct event_set* set, size_t num_events, size_t num_groups)
+{
+    for (size_t i = num_events; i < set->num_events; i++)
+    {
+        close(set->fds[i]);
+    }
+    set->num_events = num_events;
+    set->num_groups = num_groups;
+}
+
+void free_event_set(struct event_set* set)
+{
+    truncate_event_set(set, 0, 0);
+    free(set->fds);
+    free(set->cpus);
+    free(set->groups);
+    free(set->read_buf);
+    init_event_set(set);
+}
+
+bool should_group_events(enum metric_event_groups grouping)
+{
+    double value;
+    switch (grouping)
+    {
+    case MetricNoGroupEvents:
+        return false;
+    case MetricNoGroupEventsNmi:
+        return read_number_file("/proc/sys/kernel/nmi_watchdog", &value) == -1 || value == 0;
+    case MetricNoGroupEventsSmt:
+        return read_number_file("/sys/devices/system/cpu/smt/active", &value) == -1 ||
+               value == 0;
+    default:
+        return true;
+    }
+}
+
+/*
+ * Bit "n" of a counter mask stands for the general purpose counter "n",
+ * bit FIXED_COUNTER_BIT + "n" for the fixed counter "n"
+ */
+#define FIXED_COUNTER_BIT 32
+#define MAX_COUNTERS 64
+
+static uint64_t low_bits(uint32_t num)
+{
+    return num >= FIXED_COUNTER_BIT ? UINT32_MAX : (UINT64_C(1) << num) - 1;
+}
+
+/*
+ * Parses the counters of "ev" into a counter mask of the counters "pmu_class" has.
+ *
+ * The counters are a comma separated list of general purpose counter numbers, or
+ * "Fixed counter N" or "FIXED" (any fixed counter).
+ */
+static uint64_t get_counter_mask(const struct pmu_class* pmu_class, const struct pmu_event* ev)
+{
+    uint64_t available = low_bits(pmu_class->counters_num_gp) |
+                         low_bits(pmu_class->counters_num_fixed) << FIXED_COUNTER_BIT;
+    if (ev->counters == NULL)
+    {
+        return available & low_bits(pmu_class->counters_num_gp);
+    }
+
+    uint64_t mask = 0;
+    const char* p = ev->counters;
+    while (*p != '\0')
+    {
+        char* end;
+        if (strncasecmp(p, "Fixed counter ", strlen("Fixed counter ")) == 0)
+        {
+            unsigned long counter = strtoul(p + strlen("Fixed counter "), &end, 10);
+            if (counter < FIXED_COUNTER_BIT)
+            {
+                mask |= UINT64_C(1) << (FIXED_COUNTER_BIT + counter);
+            }
+        }
+        else if (strncasecmp(p, "FIXED", strlen("FIXED")) == 0)
+        {
+            mask |= low_bits(FIXED_COUNTER_BIT) << FIXED_COUNTER_BIT;
+            end = (char*)p + strlen("FIXED");
+        }
+        else
+        {
+            unsigned long counter = strtoul(p, &end, 10);
+            if (end == p)
+            {
+                /* Unknown syntax, skip to the next counter */
+                end = strchr(p, ',');
+                end = end == NULL ? (char*)p + strlen(p) : end;
+            }
+            else if (counter < FIXED_COUNTER_BIT)
+            {
+                mask |= UINT64_C(1) << counter;
+            }
+        }
+
+        p = end;
+        while (*p == ',' || *p == ' ')
+        {
+            p++;
+        }
+    }
+    return mask & available;
+}
+
+static int count_counters(uint64_t mask)
+{
+    int num = 0;
+    for (; mask != 0; mask &= mask - 1)
+    {
+        num++;
+    }
+    return num;
+}
+
+/*
+ * The counters of one scheduled group: the event counted by every counter, or -1
+ */
+struct counter_assignment
+{
+    int events[MAX_COUNTERS];
+};
+
+/*
+ * Tries to find a counter for "event" in "assignment", possibly moving other events
+ * to other counters of their masks (an augmenting path of bipartite matching).
+ *
+ * "visited" holds the counters already tried in this search.
+ */
+static bool assign_counter(struct counter_assignment* assignment, const uint64_t* masks,
+                           int event, uint64_t* visited)
+{
+    for (int counter = 0; counter < MAX_COUNTERS; counter++)
+    {
+        uint64_t bit = UINT64_C(1) << counter;
+        if ((masks[event] & bit) == 0 || (*visited & bit) != 0)
+        {
+            continue;
+        }
+        *visited |= bit;
+
+        int owner = assignment->events[counter];
+        if (owner == -1 || assign_counter(assignment, masks, owner, visited))
+        {
+            assignment->events[counter] = event;
+            return true;
+        }
+    }
+    return false;
+}
+
+int schedule_event_groups(const struct pmu_class* pmu_class, const struct pmu_event* evs,
+                          size_t num_evs, size_t* groups)
+{
+    if (num_evs == 0)
+    {
+        return 0;
+    }
+
+    uint64_t* masks = malloc(num_evs * sizeof(uint64_t));
+    size_t* order = malloc(num_evs * sizeof(size_t));
+    struct counter_assignment* assignments = malloc(num_evs * sizeof(struct counter_assignment));
+    if (masks == NULL || order == NULL || assignments == NULL)
+    {
+        free(masks);
+        free(order);
+        free(assignments);
+        return -1;
+    }
+
+    int num_groups = 0;
+    for (size_t i = 0; i < num_evs; i++)
+    {
+        masks[i] = get_counter_mask(pmu_class, &evs[i]);
+        if (masks[i] == 0)
+        {
+            num_groups = -1;
+            goto out;
+        }
+    }
+
+    /*
+     * Schedule the events with the fewest counters first, as they are the hardest to
+     * place. Insertion sort keeps events with the same number of counters in order.
+     */
+    for (size_t i = 0; i < num_evs; i++)
+    {
+        size_t j = i;
+        for (; j > 0 && count_counters(masks[order[j - 1]]) > count_counters(masks[i]); j--)
+        {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+
+    /* Place every event in the first group that still has a counter for it */
+    for (size_t i = 0; i < num_evs; i++)
+    {
+        size_t event = order[i];
+        int group = 0;
+        for (; group < num_groups; group++)
+        {
+            /* A failed search leaves the assignment unchanged */
+            uint64_t visited = 0;
+            if (assign_counter(&assignments[group], masks, event, &visited))
+            {
+                break;
+            }
+        }
+
+        if (group == num_groups)
+        {
+            for (int counter = 0; counter < MAX_COUNTERS; counter++)
+            {
+                assignments[group].events[counter] = -1;
+            }
+            uint64_t visited = 0;
+            assign_counter(&assignments[group], masks, event, &visited);
+            num_groups++;
+        }
+        groups[event] = group;
+    }
+
+out:
+    free(masks);
+    free(order);
+    free(assignments);
+    return num_groups;
+}
+
+/*
+ * Makes room for "num_events" more events in "num_groups" more groups, the largest of
+ * which has "max_group_size" events
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int reserve_event_set(struct event_set* set, size_t num_events, size_t num_groups,
+                             size_t max_group_size)
+{
+    int* fds = realloc(set->fds, (set->num_events + num_events) * sizeof(int));
+    if (fds == NULL)
+    {
+        return -1;
+    }
+    set->fds = fds;
+
+    int* cpus = realloc(set->cpus, (set->num_events + num_events) * sizeof(int));
+    if (cpus == NULL)
+    {
+        return -1;
+    }
+    set->cpus = cpus;
+
+    struct event_group* groups =
+        realloc(set->groups, (set->num_groups + num_groups) * sizeof(struct event_group));
+    if (groups == NULL)
+    {
+        return -1;
+    }
+    set->groups = groups;
+
+    size_t read_buf_len = GROUP_READ_LEN(max_group_size);
+    if (read_buf_len > set->read_buf_len)
+    {
+        uint64_t* read_buf = realloc(set->read_buf, read_buf_len * sizeof(uint64_t));
+        if (read_buf == NULL)
+        {
+            return -1;
+        }
+        set->read_buf = read_buf;
+        set->read_buf_len = read_buf_len;
+    }
+    return 0;
+}
+
+/*
+ * Opens the events "attrs" on "cpu", as one group if "group", otherwise as one group per
+ * event, into the reserved entries of "set" starting at the event "first" and the group
+ * "first_group", without adding them to the set
+ *
+ * Returns 0 on success, otherwise the errno of the failed perf_event_open, in which case
+ * the opened events are closed again
+ */
+static int open_attrs_at(struct event_set* set, const struct perf_event_attr* attrs,
+                         size_t num_attrs, int cpu, bool group, size_t first, size_t first_group)
+{
+    size_t cur_group = first_group;
+    int leader_fd = -1;
+    for (size_t i = 0; i < num_attrs; i++)
+    {
+        bool is_leader = !group || i == 0;
+
+        struct perf_event_attr attr = attrs[i];
+        attr.size = sizeof(attr);
+        attr.read_format = EVENT_SET_READ_FORMAT;
+        /* Members of a group follow their leader */
+        attr.disabled = is_leader;
+
+        int group_fd = is_leader ? -1 : leader_fd;
+        int fd = perf_event_open(&attr, -1, cpu, group_fd, PERF_FLAG_FD_CLOEXEC);
+        if (fd == -1)
+        {
+            int err = errno;
+            for (size_t x = 0; x < i; x++)
+            {
+                close(set->fds[first + x]);
+            }
+            return err;
+        }
+        set->cpus[first + i] = cpu;
+        set->fds[first + i] = fd;
+
+        if (is_leader)
+        {
+            leader_fd = fd;
+            struct event_group* new_group = &set->groups[cur_group++];
+            new_group->leader_fd = fd;
+            new_group->first = first + i;
+            new_group->num_events = 0;
+        }
+        set->groups[cur_group - 1].num_events++;
+    }
+    return 0;
+}
+
+/*
+ * Opens the events "attrs" on "cpu", as one group if "group", otherwise as one group per event
+ *
+ * Returns the index of the first event on success, -1 on failure
+ */
+static int add_attrs(struct event_set* set, const struct perf_event_attr* attrs,
+                     size_t num_attrs, int cpu, bool group)
+{
+    if (num_attrs == 0)
+    {
+        return -1;
+    }
+
+    size_t num_groups = group ? 1 : num_attrs;
+    if (reserve_event_set(set, num_attrs, num_groups, num_attrs / num_groups) == -1)
+    {
+        return -1;
+    }
+
+    size_t first = set->num_events;
+    int err = open_attrs_at(set, attrs, num_attrs, cpu, group, first, set->num_groups);
+    if (err != 0)
+    {
+        errno = err;
+        return -1;
+    }
+    set->num_events += num_attrs;
+    set->num_groups += num_groups;
+    return first;
+}
+
+int event_set_add_attrs(struct event_set* set, const struct perf_event_attr* attrs,
+                        size_t num_attrs, int cpu, enum metric_event_groups grouping)
+{
+    return add_attrs(set, attrs, num_attrs, cpu, should_group_events(grouping));
+}
+
+/*
+ * Generates the perf_event_attrs of "evs" for "pmu_instance"
+ *
+ * Returns the attrs, which the caller has to free(), or NULL on failure
+ */
+static struct perf_event_attr* gen_event_attrs(const struct pmu_instance* pmu_instance,
+                                               const struct pmu_event* evs, size_t num_evs)
+{
+    struct perf_event_attr* attrs = calloc(num_evs, sizeof(struct perf_event_attr));
+    if (attrs == NULL)
+    {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < num_evs; i++)
+    {
+        if (gen_attr_for_event(pmu_instance, &evs[i], &attrs[i]) == -1)
+        {
+            free(attrs);
+            return NULL;
+        }
+    }
+    return attrs;
+}
+
+int event_set_add_events(struct event_set* set, const struct pmu_instance* pmu_instance,
+                         const struct pmu_event* evs, size_t num_evs,
+                         enum metric_event_groups grouping)
+{
+    size_t num_cpus;
+    return event_set_add_events_topology(set, pmu_instance, evs, num_evs, grouping, NULL,
+                                         &num_cpus);
+}
+
+int event_set_add_events_topology(struct event_set* set, const struct pmu_instance* pmu_instance,
+                                  const struct pmu_event* evs, size_t num_evs,
+                                  enum metric_event_groups grouping,
+                                  const struct cpu_topology* topology, size_t* num_cpus)
+{
+    /*
+     * Package-wide events are only opened once per package. All events of a call share
+     * the layout of the counts, so perpkg and other events can not be mixed.
+     */
+    size_t num_perpkg = 0;
+    for (size_t i = 0; i < num_evs; i++)
+    {
+        num_perpkg += evs[i].perpkg;
+    }
+    if (topology != NULL && num_perpkg != 0 && num_perpkg != num_evs)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    bool per_package = topology != NULL && num_evs > 0 && num_perpkg == num_evs;
+
+    struct perf_event_attr* attrs = gen_event_attrs(pmu_instance, evs, num_evs);
+    if (attrs == NULL)
+    {
+        return -1;
+    }
+
+    bool* packages_seen = NULL;
+    if (per_package)
+    {
+        packages_seen = calloc(topology->num_packages, sizeof(bool));
+        if (packages_seen == NULL)
+        {
+            free(attrs);
+            return -1;
+        }
+    }
+
+    bool group = should_group_events(grouping);
+    size_t num_events = set->num_events;
+    size_t num_groups = set->num_groups;
+    int first = -1;
+    *num_cpus = 0;
+    for (size_t cur_range = 0; cur_range < pmu_instance->cpus.len; cur_range++)
+    {
+        const struct range* range = &pmu_instance->cpus.ranges[cur_range];
+        for (uint64_t cpu = range->start; cpu <= range->end; cpu++)
+        {
+            if (per_package)
+            {
+                int package = get_aggr_id(topology, cpu, AGGR_PACKAGE);
+                if (package == -1 || packages_seen[package])
+                {
+                    continue;
+                }
+                packages_seen[package] = true;
+            }
+
+            int idx = add_attrs(set, attrs, num_evs, cpu, group);
+            if (idx == -1)
+            {
+                truncate_event_set(set, num_events, num_groups);
+                free(packages_seen);
+                free(attrs);
+                return -1;
+            }
+            if (first == -1)
+            {
+                first = idx;
+            }
+            (*num_cpus)++;
+        }
+    }
+
+    free(packages_seen);
+    free(attrs);
+    return first;
+}
+
+/*
+ * A part of the CPUs of an open_job, e.g. those of a NUMA node, which the
+ * threads take the CPUs of one at a time
+ */
+struct open_queue
+{
+    atomic_size_t next;
+    size_t end;
+    int node;
+};
+
+/*
+ * The opening of the same events on many CPUs by event_set_add_events_on_cpus()
+ *
+ * The events of the "n"-th CPU go to the reserved entries of the set starting at
+ * the event first + n * num_attrs and the group first_group + n * groups_per_cpu,
+ * so the threads never write to the same entries.
+ */
+struct open_job
+{
+    struct event_set* set;
+    const struct perf_event_attr* attrs;
+    size_t num_attrs;
+    bool group;
+    size_t groups_per_cpu;
+    size_t first;
+    size_t first_group;
+    const int* cpus;
+    /* The indices of the CPUs, ordered by queue */
+    size_t* order;
+    struct open_queue* queues;
+    size_t num_queues;
+    const struct cpu_topology* topology;
+    int* errors;
+};
+
+struct open_worker
+{
+    struct open_job* job;
+    /* The queue the worker starts with */
+    size_t home;
+    pthread_t thread;
+};
+
+/*
+ * Opens the events of the CPUs of all queues of "job", starting with the queue "home"
+ */
+static void open_queued_cpus(struct open_job* job, size_t home)
+{
+    for (size_t i = 0; i < job->num_queues; i++)
+    {
+        struct open_queue* queue = &job->queues[(home + i) % job->num_queues];
+        size_t pos;
+        while ((pos = atomic_fetch_add(&queue->next, 1)) < queue->end)
+        {
+            size_t n = job->order[pos];
+            job->errors[n] = open_attrs_at(job->set, job->attrs, job->num_attrs, job->cpus[n],
+                                           job->group, job->first + n * job->num_attrs,
+                                           job->first_group + n * job->groups_per_cpu);
+        }
+    }
+}
+
+static void* open_worker_main(void* arg)
+{
+    struct open_worker* worker = arg;
+    struct open_job* job = worker->job;
+
+    /* Run on the NUMA node whose events are opened first, where the kernel allocates them */
+    const struct cpu_topology* topology = job->topology;
+    if (topology != NULL)
+    {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        for (int cpu = 0; cpu < topology->num_cpus && cpu < CPU_SETSIZE; cpu++)
+        {
+            if (topology->node[cpu] == job->queues[worker->home].node)
+            {
+                CPU_SET(cpu, &cpu_set);
+            }
+        }
+        /* Not being pinned only costs performance */
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    }
+
+    open_queued_cpus(job, worker->home);
+    return NULL;
+}
+
+/*
+ * Orders the CPUs of "job" into one queue per NUMA node of job->topology, or a single
+ * queue without a topology
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int make_open_queues(struct open_job* job, size_t num_cpus)
+{
+    const struct cpu_topology* topology = job->topology;
+    size_t num_nodes = topology != NULL ? (size_t)topology->num_nodes : 1;
+
+    job->order = malloc(num_cpus * sizeof(size_t));
+    job->queues = calloc(num_nodes + 1, sizeof(struct open_queue));
+    if (job->order == NULL || job->queues == NULL)
+    {
+        return -1;
+    }
+
+    /* CPUs unknown to the topology go into the last queue */
+    size_t pos = 0;
+    for (size_t node = 0; node <= num_nodes; node++)
+    {
+        struct open_queue* queue = &job->queues[job->num_queues];
+        atomic_init(&queue->next, pos);
+        queue->node = node;
+        for (size_t n = 0; n < num_cpus; n++)
+        {
+            int cpu_node = topology != NULL ? get_aggr_id(topology, job->cpus[n], AGGR_NODE) : 0;
+            if ((cpu_node == -1 && node == num_nodes) || (size_t)cpu_node == node)
+            {
+                job->order[pos++] = n;
+            }
+        }
+        queue->end = pos;
+        if (queue->end != atomic_load(&queue->next))
+        {
+            job->num_queues++;
+        }
+    }
+    return 0;
+}
+
+int event_set_add_events_on_cpus(struct event_set* set, const struct pmu_instance* pmu_instance,
+                                 const struct pmu_event* evs, size_t num_evs,
+                                 enum metric_event_groups grouping, const int* cpus,
+                                 size_t num_cpus, const struct event_open_pool* pool,
+                                 int* errors)
+{
+    for (size_t n = 0; n < num_cpus; n++)
+    {
+        errors[n] = EINVAL;
+    }
+    if (num_evs == 0 || num_cpus == 0)
+    {
+        return -1;
+    }
+
+    /* The attrs are the same for all CPUs */
+    struct perf_event_attr* attrs = gen_event_attrs(pmu_instance, evs, num_evs);
+    if (attrs == NULL)
+    {
+        return -1;
+    }
+
+    struct open_job job = {
+        .set = set,
+        .attrs = attrs,
+        .num_attrs = num_evs,
+        .group = should_group_events(grouping),
+        .first = set->num_events,
+        .first_group = set->num_groups,
+        .cpus = cpus,
+        .topology = pool != NULL ? pool->topology : NULL,
+        .errors = errors,
+    };
+    job.groups_per_cpu = job.group ? 1 : num_evs;
+
+    int ret = -1;
+    struct open_worker* workers = NULL;
+    if (reserve_event_set(set, num_cpus * num_evs, num_cpus * job.groups_per_cpu,
+                          num_evs / job.groups_per_cpu) == -1 ||
+        make_open_queues(&job, num_cpus) == -1)
+    {
+        goto out;
+    }
+
+    size_t num_threads = pool != NULL && pool->num_threads > 1 ? pool->num_threads : 1;
+    if (num_threads > num_cpus)
+    {
+        num_threads = num_cpus;
+    }
+    workers = calloc(num_threads, sizeof(struct open_worker));
+    if (workers == NULL)
+    {
+        goto out;
+    }
+
+    /* The calling thread is worker 0, fewer threads only make the opening slower */
+    size_t num_started = 1;
+    for (size_t i = 1; i < num_threads; i++)
+    {
+        workers[num_started].job = &job;
+        workers[num_started].home = i % job.num_queues;
+        if (pthread_create(&workers[num_started].thread, NULL, open_worker_main,
+                           &workers[num_started]) == 0)
+        {
+            num_started++;
+        }
+    }
+    open_queued_cpus(&job, 0);
+    for (size_t i = 1; i < num_started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    ret = job.first;
+    for (size_t n = 0; n < num_cpus; n++)
+    {
+        ret = errors[n] != 0 ? -1 : ret;
+    }
+    if (ret == -1)
+    {
+        /* Close the events of the CPUs which were opened successfully */
+        for (size_t n = 0; n < num_cpus; n++)
+        {
+            for (size_t x = 0; errors[n] == 0 && x < num_evs; x++)
+            {
+                close(set->fds[job.first + n * num_evs + x]);
+            }
+        }
+    }
+    else
+    {
+        set->num_events += num_cpus * num_evs;
+        set->num_groups += num_cpus * job.groups_per_cpu;
+    }
+
+out:
+    free(workers);
+    free(job.order);
+    free(job.queues);
+    free(attrs);
+    return ret;
+}
+
+static int ioctl_groups(const struct event_set* set, unsigned long request)
+{
+    for (size_t i = 0; i < set->num_groups; i++)
+    {
+        if (ioctl(set->groups[i].leader_fd, request, PERF_IOC_FLAG_GROUP) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int event_set_enable(const struct event_set* set)
+{
+    return ioctl_groups(set, PERF_EVENT_IOC_ENABLE);
+}
+
+int event_set_disable(const struct event_set* set)
+{
+    return ioctl_groups(set, PERF_EVENT_IOC_DISABLE);
+}
+
+int event_set_read(struct event_set* set, struct event_count* counts)
+{
+    for (size_t i = 0; i < set->num_groups; i++)
+    {
+        const struct event_group* group = &set->groups[i];
+        ssize_t len = GROUP_READ_LEN(group->num_events) * sizeof(uint64_t);
+        if (read(group->leader_fd, set->read_buf, len) != len)
+        {
+            return -1;
+        }
+
+        const uint64_t* buf = set->read_buf;
+        if (buf[0] != group->num_events)
+        {
+            return -1;
+        }
+        for (size_t x = 0; x < group->num_events; x++)
+        {
+            struct event_count* count = &counts[group->first + x];
+            count->value = buf[3 + x];
+            count->time_enabled = buf[1];
+            count->time_running = buf[2];
+        }
+    }
+    return 0;
+}
+
+void compute_event_delta(const struct event_count* prev, const struct event_count* cur,
+                         struct event_delta* delta)
+{
+    /* Unsigned subtraction is modulo 2^64, so wrapped counters give the right delta */
+    delta->raw = cur->value - prev->value;
+    delta->time_enabled = cur->time_enabled - prev->time_enabled;
+    delta->time_running = cur->time_running - prev->time_running;
+
+    if (delta->time_running == 0)
+    {
+        delta->value = 0;
+        delta->ratio = 0;
+    }
+    else if (delta->time_running >= delta->time_enabled)
+    {
+        delta->value = delta->raw;
+        delta->ratio = 1;
+    }
+    else
+    {
+        delta->ratio = (double)delta->time_running / delta->time_enabled;
+        delta->value = delta->raw / delta->ratio;
+    }
+}
+
+int init_event_reader(struct event_reader* reader, struct event_set* set)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->set = set;
+    reader->num_events = set->num_events;
+
+    /* The counts are 0 when the events are opened */
+    reader->prev = calloc(set->num_events, sizeof(struct event_count));
+    reader->counts = calloc(set->num_events, sizeof(struct event_count));
+    reader->deltas = calloc(set->num_events, sizeof(struct event_delta));
+    if (set->num_events != 0 &&
+        (reader->prev == NULL || reader->counts == NULL || reader->deltas == NULL))
+    {
+        free_event_reader(reader);
+        return -1;
+    }
+    return 0;
+}
+
+void free_event_reader(struct event_reader* reader)
+{
+    free(reader->prev);
+    free(reader->counts);
+    free(reader->deltas);
+    memset(reader, 0, sizeof(*reader));
+}
+
+int event_reader_read(struct event_reader* reader)
+{
+    if (reader->set->num_events != reader->num_events)
+    {
+        return -1;
+    }
+
+    /* The counts of the last read become the previous ones */
+    struct event_count* prev = reader->counts;
+    reader->counts = reader->prev;
+    reader->prev = prev;
+
+    if (event_set_read(reader->set, reader->counts) == -1)
+    {
+        reader->prev = reader->counts;
+        reader->counts = prev;
+        return -1;
+    }
+
+    for (size_t i = 0; i < reader->num_events; i++)
+    {
+        compute_event_delta(&reader->prev[i], &reader->counts[i], &reader->deltas[i]);
+    }
+    return 0;
+}
+
+int aggregate_event_deltas(const struct event_set* set, const struct event_delta* deltas,
+                           size_t first, size_t stride, size_t num_cpus,
+                           const struct cpu_topology* topology, enum aggr_level level,
+                           double* sums)
+{
+    memset(sums, 0, get_num_aggr_ids(topology, level) * sizeof(double));
+
+    for (size_t i = 0; i < num_cpus; i++)
+    {
+        size_t idx = first + i * stride;
+        int id = get_aggr_id(topology, set->cpus[idx], level);
+        if (id == -1)
+        {
+            return -1;
+        }
+        sums[id] += deltas[idx].value;
+    }
+    return 0;
+}
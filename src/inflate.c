@@ -0,0 +1,362 @@
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * A small decoder for raw deflate streams (RFC 1951), used for the cold strings
+ * of the generated tables. It decodes one bit at a time, following puff.c of zlib,
+ * which is plenty for decompressing a block once.
+ */
+
+#define MAX_BITS 15
+#define MAX_LITERAL_CODES 288
+#define MAX_DIST_CODES 30
+
+struct inflate_state
+{
+    const uint8_t* src;
+    size_t src_len;
+    size_t src_pos;
+    uint32_t bit_buf;
+    int bit_count;
+    uint8_t* dest;
+    size_t dest_len;
+    size_t dest_pos;
+};
+
+/*
+ * A canonical Huffman code: the number of codes of every length and
+ * the symbols ordered by their codes
+ */
+struct huffman
+{
+    uint16_t counts[MAX_BITS + 1];
+    uint16_t symbols[MAX_LITERAL_CODES];
+};
+
+static const uint16_t length_base[29] = { 3,  4,  5,  6,  7,  8,  9,  10, 11,  13,
+                                          15, 17, 19, 23, 27, 31, 35, 43, 51,  59,
+                                          67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                          2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t dist_base[MAX_DIST_CODES] = {
+    1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+    193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[MAX_DIST_CODES] = { 0, 0, 0, 0, 1, 1, 2, 2,   3,  3,
+                                                    4, 4, 5, 5, 6, 6, 7, 7,   8,  8,
+                                                    9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+/*
+ * Reads the next "num_bits" bits (at most 16) of the stream into "val"
+ */
+static int get_bits(struct inflate_state* state, int num_bits, uint32_t* val)
+{
+    while (state->bit_count < num_bits)
+    {
+        if (state->src_pos >= state->src_len)
+        {
+            return -1;
+        }
+        state->bit_buf |= (uint32_t)state->src[state->src_pos++] << state->bit_count;
+        state->bit_count += 8;
+    }
+
+    *val = state->bit_buf & ((UINT32_C(1) << num_bits) - 1);
+    state->bit_buf >>= num_bits;
+    state->bit_count -= num_bits;
+    return 0;
+}
+
+static void build_huffman(struct huffman* huffman, const uint8_t* lengths, int num_symbols)
+{
+    uint16_t offsets[MAX_BITS + 1];
+
+    memset(huffman->counts, 0, sizeof(huffman->counts));
+    for (int sym = 0; sym < num_symbols; sym++)
+    {
+        huffman->counts[lengths[sym]]++;
+    }
+    huffman->counts[0] = 0;
+
+    offsets[1] = 0;
+    for (int len = 1; len < MAX_BITS; len++)
+    {
+        offsets[len + 1] = offsets[len] + huffman->counts[len];
+    }
+
+    for (int sym = 0; sym < num_symbols; sym++)
+    {
+        if (lengths[sym] != 0)
+        {
+            huffman->symbols[offsets[lengths[sym]]++] = sym;
+        }
+    }
+}
+
+/*
+ * Returns the next symbol of the stream coded with "huffman", or -1 on failure
+ */
+static int decode_symbol(struct inflate_state* state, const struct huffman* huffman)
+{
+    int code = 0;
+    int first = 0;
+    int index = 0;
+
+    for (int len = 1; len <= MAX_BITS; len++)
+    {
+        uint32_t bit;
+        if (get_bits(state, 1, &bit) == -1)
+        {
+            return -1;
+        }
+        code |= bit;
+
+        int count = huffman->counts[len];
+        if (code - count < first)
+        {
+            return huffman->symbols[index + (code - first)];
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static int inflate_stored(struct inflate_state* state)
+{
+    /* Stored blocks start at a byte boundary */
+    state->bit_buf = 0;
+    state->bit_count = 0;
+
+    if (state->src_len - state->src_pos < 4)
+    {
+        return -1;
+    }
+    const uint8_t* header = &state->src[state->src_pos];
+    size_t len = header[0] | (header[1] << 8);
+    size_t nlen = header[2] | (header[3] << 8);
+    state->src_pos += 4;
+
+    if (len != (~nlen & 0xffff) || len > state->src_len - state->src_pos ||
+        len > state->dest_len - state->dest_pos)
+    {
+        return -1;
+    }
+    memcpy(&state->dest[state->dest_pos], &state->src[state->src_pos], len);
+    state->src_pos += len;
+    state->dest_pos += len;
+    return 0;
+}
+
+static int inflate_codes(struct inflate_state* state, const struct huffman* lencode,
+                         const struct huffman* distcode)
+{
+    while (true)
+    {
+        int sym = decode_symbol(state, lencode);
+        if (sym < 0)
+        {
+            return -1;
+        }
+
+        if (sym < 256)
+        {
+            if (state->dest_pos >= state->dest_len)
+            {
+                return -1;
+            }
+            state->dest[state->dest_pos++] = sym;
+            continue;
+        }
+        if (sym == 256)
+        {
+            return 0;
+        }
+
+        sym -= 257;
+        uint32_t extra;
+        if (sym >= 29 || get_bits(state, length_extra[sym], &extra) == -1)
+        {
+            return -1;
+        }
+        size_t len = length_base[sym] + extra;
+
+        int dist_sym = decode_symbol(state, distcode);
+        if (dist_sym < 0 || dist_sym >= MAX_DIST_CODES ||
+            get_bits(state, dist_extra[dist_sym], &extra) == -1)
+        {
+            return -1;
+        }
+        size_t dist = dist_base[dist_sym] + extra;
+
+        if (dist > state->dest_pos || len > state->dest_len - state->dest_pos)
+        {
+            return -1;
+        }
+        /* The copy may overlap its own output, so copy byte by byte */
+        for (size_t i = 0; i < len; i++, state->dest_pos++)
+        {
+            state->dest[state->dest_pos] = state->dest[state->dest_pos - dist];
+        }
+    }
+}
+
+static int inflate_fixed(struct inflate_state* state)
+{
+    uint8_t lengths[MAX_LITERAL_CODES];
+    struct huffman lencode, distcode;
+
+    memset(lengths, 8, 144);
+    memset(lengths + 144, 9, 256 - 144);
+    memset(lengths + 256, 7, 280 - 256);
+    memset(lengths + 280, 8, MAX_LITERAL_CODES - 280);
+    build_huffman(&lencode, lengths, MAX_LITERAL_CODES);
+
+    memset(lengths, 5, MAX_DIST_CODES);
+    build_huffman(&distcode, lengths, MAX_DIST_CODES);
+
+    return inflate_codes(state, &lencode, &distcode);
+}
+
+static int inflate_dynamic(struct inflate_state* state)
+{
+    static const uint8_t order[19] = { 16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                       11, 4,  12, 3, 13, 2, 14, 1, 15 };
+    uint8_t lengths[MAX_LITERAL_CODES + 32] = { 0 };
+    struct huffman lencode, distcode;
+    uint32_t hlit, hdist, hclen;
+
+    if (get_bits(state, 5, &hlit) == -1 || get_bits(state, 5, &hdist) == -1 ||
+        get_bits(state, 4, &hclen) == -1)
+    {
+        return -1;
+    }
+    hlit += 257;
+    hdist += 1;
+    hclen += 4;
+    if (hlit > 286 || hdist > MAX_DIST_CODES)
+    {
+        return -1;
+    }
+
+    /* The code lengths of the code lengths */
+    for (uint32_t i = 0; i < hclen; i++)
+    {
+        uint32_t len;
+        if (get_bits(state, 3, &len) == -1)
+        {
+            return -1;
+        }
+        lengths[order[i]] = len;
+    }
+    build_huffman(&lencode, lengths, 19);
+
+    uint32_t index = 0;
+    while (index < hlit + hdist)
+    {
+        int sym = decode_symbol(state, &lencode);
+        if (sym < 0)
+        {
+            return -1;
+        }
+        if (sym < 16)
+        {
+            lengths[index++] = sym;
+            continue;
+        }
+
+        uint8_t len = 0;
+        uint32_t repeat;
+        if (sym == 16)
+        {
+            if (index == 0 || get_bits(state, 2, &repeat) == -1)
+            {
+                return -1;
+            }
+            len = lengths[index - 1];
+            repeat += 3;
+        }
+        else if (sym == 17)
+        {
+            if (get_bits(state, 3, &repeat) == -1)
+            {
+                return -1;
+            }
+            repeat += 3;
+        }
+        else
+        {
+            if (get_bits(state, 7, &repeat) == -1)
+            {
+                return -1;
+            }
+            repeat += 11;
+        }
+
+        if (index + repeat > hlit + hdist)
+        {
+            return -1;
+        }
+        while (repeat-- > 0)
+        {
+            lengths[index++] = len;
+        }
+    }
+
+    /* There has to be an end of block code */
+    if (lengths[256] == 0)
+    {
+        return -1;
+    }
+    build_huffman(&lencode, lengths, hlit);
+    build_huffman(&distcode, lengths + hlit, hdist);
+
+    return inflate_codes(state, &lencode, &distcode);
+}
+
+int inflate_raw(void* dest, size_t dest_len, const void* src, size_t src_len)
+{
+    struct inflate_state state = {
+        .src = src,
+        .src_len = src_len,
+        .dest = dest,
+        .dest_len = dest_len,
+    };
+
+    uint32_t last;
+    do
+    {
+        uint32_t type;
+        if (get_bits(&state, 1, &last) == -1 || get_bits(&state, 2, &type) == -1)
+        {
+            return -1;
+        }
+
+        int ret;
+        switch (type)
+        {
+        case 0:
+            ret = inflate_stored(&state);
+            break;
+        case 1:
+            ret = inflate_fixed(&state);
+            break;
+        case 2:
+            ret = inflate_dynamic(&state);
+            break;
+        default:
+            ret = -1;
+            break;
+        }
+        if (ret == -1)
+        {
+            return -1;
+        }
+    } while (!last);
+
+    return state.dest_pos == dest_len ? 0 : -1;
+}
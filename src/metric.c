@@ -0,0 +1,1017 @@
+#include <pmu-events/metric.h>
+#include <pmu-events/pmu-events.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+/*
+ * How deep metrics referring to other metrics are inlined by compile_metric()
+ */
+#define METRIC_MAX_INLINE_DEPTH 16
+
+enum metric_token
+{
+    TOK_END,
+    TOK_NUMBER,
+    TOK_ID,
+    TOK_LITERAL,
+    /* A single character operator or parenthesis, stored in lexer.op */
+    TOK_OP,
+    TOK_IF,
+    TOK_ELSE,
+    TOK_MIN,
+    TOK_MAX,
+    TOK_D_RATIO,
+    TOK_SOURCE_COUNT,
+    TOK_HAS_EVENT,
+    TOK_STRCMP_CPUID_STR,
+};
+
+static const struct
+{
+    const char* name;
+    enum metric_token tok;
+} metric_keywords[] = {
+    { "if", TOK_IF },
+    { "else", TOK_ELSE },
+    { "min", TOK_MIN },
+    { "max", TOK_MAX },
+    { "d_ratio", TOK_D_RATIO },
+    { "source_count", TOK_SOURCE_COUNT },
+    { "has_event", TOK_HAS_EVENT },
+    { "strcmp_cpuid_str", TOK_STRCMP_CPUID_STR },
+};
+
+/*
+ * Tokenizer for metric expressions, following the lexer of perf
+ * (linux/tools/perf/util/expr.l)
+ */
+struct metric_lexer
+{
+    const char* pos;
+    enum metric_token tok;
+    const char* tok_start;
+    size_t tok_len;
+    double number;
+    char op;
+};
+
+/*
+ * State shared by all (possibly inlined) expressions of one compilation
+ */
+struct metric_compiler
+{
+    struct metric_expr* res;
+    size_t insns_capacity;
+    const struct pmu_metrics_table* table;
+    /* The PMU of the metric being compiled, whose metrics are preferred for references */
+    const struct pmu_table_entry* entry;
+    int inline_depth;
+    size_t stack_depth;
+};
+
+void free_metric_expr(struct metric_expr* expr)
+{
+    if (expr == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < expr->num_vars; i++)
+    {
+        free(expr->vars[i].name);
+    }
+    free(expr->vars);
+    free(expr->insns);
+}
+
+int get_metric_by_name(const struct pmu_metrics_table* table, const char* name,
+                       struct pmu_metric* pm)
+{
+    for (uint32_t cur_pmu = 0; cur_pmu < table->num_pmus; cur_pmu++)
+    {
+        const struct pmu_table_entry* entry = &table->pmus[cur_pmu];
+        for (uint32_t x = 0; x < entry->num_entries; x++)
+        {
+            /* The metric name is the first string of a compressed metric */
+            if (strcasecmp(get_event_name(entry->entries[x]), name) == 0)
+            {
+                decompress_metric(entry->entries[x].offset, pm);
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+/*
+ * Searches for the metric "name" (case-insensitive) in "table", first in the PMU "entry"
+ * if not NULL, then in all PMUs.
+ *
+ * Returns 0 and stores the PMU and the index of the metric in it in "res_entry"
+ * and "res_idx" on success, -1 on failure.
+ */
+static int find_table_metric(const struct pmu_metrics_table* table,
+                             const struct pmu_table_entry* entry, const char* name,
+                             const struct pmu_table_entry** res_entry, uint32_t* res_idx)
+{
+    if (entry != NULL)
+    {
+        for (uint32_t x = 0; x < entry->num_entries; x++)
+        {
+            if (strcasecmp(get_event_name(entry->entries[x]), name) == 0)
+            {
+                *res_entry = entry;
+                *res_idx = x;
+                return 0;
+            }
+        }
+    }
+
+    for (uint32_t cur_pmu = 0; cur_pmu < table->num_pmus; cur_pmu++)
+    {
+        const struct pmu_table_entry* cur_entry = &table->pmus[cur_pmu];
+        for (uint32_t x = 0; x < cur_entry->num_entries; x++)
+        {
+            if (strcasecmp(get_event_name(cur_entry->entries[x]), name) == 0)
+            {
+                *res_entry = cur_entry;
+                *res_idx = x;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+static bool is_symbol_char(char c)
+{
+    return isalnum((unsigned char)c) || c == '_' || c == '.' || c == ':' || c == '@' || c == '?';
+}
+
+/*
+ * Length of the symbol at "p", symbols can contain backslash escaped characters
+ */
+static size_t symbol_len(const char* p)
+{
+    const char* start = p;
+    while (true)
+    {
+        if (*p == '\\' && p[1] != '\0')
+        {
+            p += 2;
+        }
+        else if (is_symbol_char(*p))
+        {
+            p++;
+        }
+        else
+        {
+            return p - start;
+        }
+    }
+}
+
+/*
+ * Length of the number at "p" of the form ([0-9]+\.?[0-9]*|[0-9]*\.?[0-9]+)(e-?[0-9]+)?
+ */
+static size_t number_len(const char* p)
+{
+    const char* start = p;
+    size_t digits = 0;
+
+    while (isdigit((unsigned char)*p))
+    {
+        p++;
+        digits++;
+    }
+    if (*p == '.')
+    {
+        p++;
+        while (isdigit((unsigned char)*p))
+        {
+            p++;
+            digits++;
+        }
+    }
+    if (digits == 0)
+    {
+        return 0;
+    }
+
+    if (*p == 'e')
+    {
+        const char* exp = p + 1;
+        if (*exp == '-')
+        {
+            exp++;
+        }
+        if (isdigit((unsigned char)*exp))
+        {
+            while (isdigit((unsigned char)*exp))
+            {
+                exp++;
+            }
+            p = exp;
+        }
+    }
+    return p - start;
+}
+
+/*
+ * Advances the lexer to the next token.
+ *
+ * Like in perf, a token is the longest match, so "0x10" is a symbol and "1e9" a number.
+ *
+ * Returns 0 on success, -1 on invalid input.
+ */
+static int next_token(struct metric_lexer* lexer)
+{
+    while (isspace((unsigned char)*lexer->pos))
+    {
+        lexer->pos++;
+    }
+
+    const char* p = lexer->pos;
+    lexer->tok_start = p;
+
+    if (*p == '\0')
+    {
+        lexer->tok = TOK_END;
+        lexer->tok_len = 0;
+        return 0;
+    }
+
+    if (*p == '#')
+    {
+        size_t len = 1;
+        while (isalnum((unsigned char)p[len]) || p[len] == '_' || p[len] == '.' || p[len] == '-')
+        {
+            len++;
+        }
+        if (len == 1)
+        {
+            return -1;
+        }
+        lexer->tok = TOK_LITERAL;
+        lexer->tok_len = len;
+        lexer->pos += len;
+        return 0;
+    }
+
+    size_t num_len = number_len(p);
+    size_t sym_len = symbol_len(p);
+    if (num_len != 0 && num_len >= sym_len)
+    {
+        char buf[64];
+        if (num_len >= sizeof(buf))
+        {
+            return -1;
+        }
+        memcpy(buf, p, num_len);
+        buf[num_len] = '\0';
+
+        lexer->tok = TOK_NUMBER;
+        lexer->number = strtod(buf, NULL);
+        lexer->tok_len = num_len;
+        lexer->pos += num_len;
+        return 0;
+    }
+
+    if (sym_len != 0)
+    {
+        lexer->tok = TOK_ID;
+        for (size_t i = 0; i < sizeof(metric_keywords) / sizeof(metric_keywords[0]); i++)
+        {
+            if (strlen(metric_keywords[i].name) == sym_len &&
+                strncmp(metric_keywords[i].name, p, sym_len) == 0)
+            {
+                lexer->tok = metric_keywords[i].tok;
+                break;
+            }
+        }
+        lexer->tok_len = sym_len;
+        lexer->pos += sym_len;
+        return 0;
+    }
+
+    if (strchr("|^&<>-+*/%(),", *p) != NULL)
+    {
+        lexer->tok = TOK_OP;
+        lexer->op = *p;
+        lexer->tok_len = 1;
+        lexer->pos++;
+        return 0;
+    }
+
+    return -1;
+}
+
+static bool is_op(const struct metric_lexer* lexer, char op)
+{
+    return lexer->tok == TOK_OP && lexer->op == op;
+}
+
+static int expect_op(struct metric_lexer* lexer, char op)
+{
+    if (!is_op(lexer, op))
+    {
+        return -1;
+    }
+    return next_token(lexer);
+}
+
+/*
+ * Appends "insn" to the compiled expression, keeping track of the stack depth
+ * the expression needs.
+ *
+ * "stack_change" is the number of values the instruction pushes minus the number it pops.
+ */
+static int emit(struct metric_compiler* c, struct metric_insn insn, int stack_change)
+{
+    struct metric_expr* res = c->res;
+    if (res->num_insns == c->insns_capacity)
+    {
+        size_t capacity = c->insns_capacity == 0 ? 16 : c->insns_capacity * 2;
+        struct metric_insn* tmp = realloc(res->insns, capacity * sizeof(struct metric_insn));
+        if (tmp == NULL)
+        {
+            return -1;
+        }
+        res->insns = tmp;
+        c->insns_capacity = capacity;
+    }
+    res->insns[res->num_insns++] = insn;
+
+    c->stack_depth += stack_change;
+    if (c->stack_depth > METRIC_MAX_STACK)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static int emit_op(struct metric_compiler* c, enum metric_op op, int stack_change)
+{
+    struct metric_insn insn = { .op = op };
+    return emit(c, insn, stack_change);
+}
+
+/*
+ * Copies the symbol of "len" characters at "sym" into a new string, removing backslash
+ * escapes and replacing "@" by "/" to get the perf event syntax.
+ *
+ * The caller is responsible for free()-ing the result.
+ */
+static char* symbol_to_name(const char* sym, size_t len)
+{
+    char* name = malloc(len + 1);
+    if (name == NULL)
+    {
+        return NULL;
+    }
+
+    size_t name_len = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (sym[i] == '\\' && i + 1 < len)
+        {
+            i++;
+            name[name_len++] = sym[i];
+        }
+        else if (sym[i] == '@')
+        {
+            name[name_len++] = '/';
+        }
+        else
+        {
+            name[name_len++] = sym[i];
+        }
+    }
+    name[name_len] = '\0';
+    return name;
+}
+
+/*
+ * Emits a METRIC_OP_VAR for the variable "name" of kind "kind", adding the variable
+ * to the compiled expression if it is not already used.
+ *
+ * Takes ownership of "name".
+ */
+static int emit_var(struct metric_compiler* c, char* name, enum metric_var_kind kind)
+{
+    struct metric_expr* res = c->res;
+    size_t var = 0;
+    for (; var < res->num_vars; var++)
+    {
+        if (res->vars[var].kind == kind && strcmp(res->vars[var].name, name) == 0)
+        {
+            break;
+        }
+    }
+
+    if (var == res->num_vars)
+    {
+        struct metric_var* tmp =
+            realloc(res->vars, (res->num_vars + 1) * sizeof(struct metric_var));
+        if (tmp == NULL)
+        {
+            free(name);
+            return -1;
+        }
+        res->vars = tmp;
+        res->vars[var].name = name;
+        res->vars[var].kind = kind;
+        res->num_vars++;
+    }
+    else
+    {
+        free(name);
+    }
+
+    struct metric_insn insn = { .op = METRIC_OP_VAR, .var = var };
+    return emit(c, insn, 1);
+}
+
+static int parse_if_expr(struct metric_compiler* c, struct metric_lexer* lexer);
+
+/*
+ * Compiles the expression "expr" of a metric into the current position of the bytecode
+ */
+static int parse_whole_expr(struct metric_compiler* c, const char* expr)
+{
+    struct metric_lexer lexer = { .pos = expr };
+    if (next_token(&lexer) == -1)
+    {
+        return -1;
+    }
+    if (parse_if_expr(c, &lexer) == -1)
+    {
+        return -1;
+    }
+    if (lexer.tok != TOK_END)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Compiles an identifier, which is either an event or, if compiling a metric of a table,
+ * the name of another metric in that table.
+ */
+static int parse_id(struct metric_compiler* c, struct metric_lexer* lexer)
+{
+    char* name = symbol_to_name(lexer->tok_start, lexer->tok_len);
+    if (name == NULL)
+    {
+        return -1;
+    }
+
+    const struct pmu_table_entry* entry;
+    uint32_t idx;
+    struct pmu_metric pm = { 0 };
+    if (c->table != NULL && find_table_metric(c->table, c->entry, name, &entry, &idx) == 0)
+    {
+        decompress_metric(entry->entries[idx].offset, &pm);
+    }
+
+    if (pm.metric_expr != NULL)
+    {
+        free(name);
+        if (c->inline_depth == METRIC_MAX_INLINE_DEPTH)
+        {
+            return -1;
+        }
+
+        const struct pmu_table_entry* outer_entry = c->entry;
+        c->entry = entry;
+        c->inline_depth++;
+        int ret = parse_whole_expr(c, pm.metric_expr);
+        c->inline_depth--;
+        c->entry = outer_entry;
+        if (ret == -1)
+        {
+            return -1;
+        }
+    }
+    else if (emit_var(c, name, METRIC_VAR_EVENT) == -1)
+    {
+        return -1;
+    }
+
+    return next_token(lexer);
+}
+
+/*
+ * Compiles "fn(expr, expr)" for min, max and d_ratio
+ */
+static int parse_function2(struct metric_compiler* c, struct metric_lexer* lexer,
+                           enum metric_op op)
+{
+    if (next_token(lexer) == -1 || expect_op(lexer, '(') == -1)
+    {
+        return -1;
+    }
+    if (parse_if_expr(c, lexer) == -1 || expect_op(lexer, ',') == -1)
+    {
+        return -1;
+    }
+    if (parse_if_expr(c, lexer) == -1 || expect_op(lexer, ')') == -1)
+    {
+        return -1;
+    }
+    return emit_op(c, op, -1);
+}
+
+/*
+ * Compiles "fn(ID)" for source_count, has_event and strcmp_cpuid_str
+ */
+static int parse_id_function(struct metric_compiler* c, struct metric_lexer* lexer,
+                             enum metric_var_kind kind)
+{
+    if (next_token(lexer) == -1 || expect_op(lexer, '(') == -1)
+    {
+        return -1;
+    }
+    /* CPU identifiers can look like numbers, e.g. "410fd493" */
+    if (lexer->tok != TOK_ID && lexer->tok != TOK_NUMBER)
+    {
+        return -1;
+    }
+
+    char* name = symbol_to_name(lexer->tok_start, lexer->tok_len);
+    if (name == NULL)
+    {
+        return -1;
+    }
+    if (emit_var(c, name, kind) == -1)
+    {
+        return -1;
+    }
+
+    if (next_token(lexer) == -1)
+    {
+        return -1;
+    }
+    return expect_op(lexer, ')');
+}
+
+static int parse_unary(struct metric_compiler* c, struct metric_lexer* lexer)
+{
+    switch (lexer->tok)
+    {
+    case TOK_NUMBER:
+    {
+        struct metric_insn insn = { .op = METRIC_OP_CONST, .constant = lexer->number };
+        if (emit(c, insn, 1) == -1)
+        {
+            return -1;
+        }
+        return next_token(lexer);
+    }
+    case TOK_LITERAL:
+    {
+        char* name = symbol_to_name(lexer->tok_start, lexer->tok_len);
+        if (name == NULL || emit_var(c, name, METRIC_VAR_LITERAL) == -1)
+        {
+            return -1;
+        }
+        return next_token(lexer);
+    }
+    case TOK_ID:
+        return parse_id(c, lexer);
+    case TOK_MIN:
+        return parse_function2(c, lexer, METRIC_OP_MIN);
+    case TOK_MAX:
+        return parse_function2(c, lexer, METRIC_OP_MAX);
+    case TOK_D_RATIO:
+        return parse_function2(c, lexer, METRIC_OP_D_RATIO);
+    case TOK_SOURCE_COUNT:
+        return parse_id_function(c, lexer, METRIC_VAR_SOURCE_COUNT);
+    case TOK_HAS_EVENT:
+        return parse_id_function(c, lexer, METRIC_VAR_HAS_EVENT);
+    case TOK_STRCMP_CPUID_STR:
+        return parse_id_function(c, lexer, METRIC_VAR_CPUID);
+    case TOK_OP:
+        if (lexer->op == '-')
+        {
+            if (next_token(lexer) == -1 || parse_unary(c, lexer) == -1)
+            {
+                return -1;
+            }
+            return emit_op(c, METRIC_OP_NEG, 0);
+        }
+        if (lexer->op == '(')
+        {
+            if (next_token(lexer) == -1 || parse_if_expr(c, lexer) == -1)
+            {
+                return -1;
+            }
+            return expect_op(lexer, ')');
+        }
+        return -1;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Returns the precedence of the binary operator "op", or -1 if "op" is not a binary
+ * operator. The precedences are the ones of perf (linux/tools/perf/util/expr.y)
+ */
+static int binary_precedence(char op, enum metric_op* metric_op)
+{
+    switch (op)
+    {
+    case '|':
+        *metric_op = METRIC_OP_OR;
+        return 0;
+    case '^':
+        *metric_op = METRIC_OP_XOR;
+        return 1;
+    case '&':
+        *metric_op = METRIC_OP_AND;
+        return 2;
+    case '<':
+        *metric_op = METRIC_OP_LT;
+        return 3;
+    case '>':
+        *metric_op = METRIC_OP_GT;
+        return 3;
+    case '+':
+        *metric_op = METRIC_OP_ADD;
+        return 4;
+    case '-':
+        *metric_op = METRIC_OP_SUB;
+        return 4;
+    case '*':
+        *metric_op = METRIC_OP_MUL;
+        return 5;
+    case '/':
+        *metric_op = METRIC_OP_DIV;
+        return 5;
+    case '%':
+        *metric_op = METRIC_OP_MOD;
+        return 5;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Compiles left-associative binary operators with a precedence of at least "min_prec"
+ */
+static int parse_binary(struct metric_compiler* c, struct metric_lexer* lexer, int min_prec)
+{
+    if (parse_unary(c, lexer) == -1)
+    {
+        return -1;
+    }
+
+    while (lexer->tok == TOK_OP)
+    {
+        enum metric_op op;
+        int prec = binary_precedence(lexer->op, &op);
+        if (prec == -1 || prec < min_prec)
+        {
+            break;
+        }
+
+        if (next_token(lexer) == -1 || parse_binary(c, lexer, prec + 1) == -1)
+        {
+            return -1;
+        }
+        if (emit_op(c, op, -1) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Compiles "expr if expr else if_expr" or "expr"
+ */
+static int parse_if_expr(struct metric_compiler* c, struct metric_lexer* lexer)
+{
+    if (parse_binary(c, lexer, 0) == -1)
+    {
+        return -1;
+    }
+
+    if (lexer->tok != TOK_IF)
+    {
+        return 0;
+    }
+
+    if (next_token(lexer) == -1 || parse_binary(c, lexer, 0) == -1)
+    {
+        return -1;
+    }
+    if (lexer->tok != TOK_ELSE || next_token(lexer) == -1)
+    {
+        return -1;
+    }
+    if (parse_if_expr(c, lexer) == -1)
+    {
+        return -1;
+    }
+    return emit_op(c, METRIC_OP_SELECT, -2);
+}
+
+/*
+ * The number of values "op" pushes minus the number it pops
+ */
+static int stack_change(enum metric_op op)
+{
+    switch (op)
+    {
+    case METRIC_OP_CONST:
+    case METRIC_OP_VAR:
+        return 1;
+    case METRIC_OP_NEG:
+        return 0;
+    case METRIC_OP_SELECT:
+        return -2;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Appends the precompiled expression "metric" of "bytecode" to the compiled expression,
+ * inlining the metrics it refers to
+ */
+static int link_metric(struct metric_compiler* c, const struct metric_bytecode_table* bytecode,
+                       uint32_t metric)
+{
+    const struct compact_metric_expr* expr = &bytecode->exprs[metric];
+    if (expr->num_insns == 0)
+    {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < expr->num_insns; i++)
+    {
+        struct metric_insn insn = bytecode->insns[expr->insns + i];
+        if (insn.op != METRIC_OP_VAR)
+        {
+            if (emit(c, insn, stack_change(insn.op)) == -1)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        const struct compact_metric_var* var = &bytecode->vars[expr->vars + insn.var];
+        if (var->kind == COMPACT_METRIC_VAR_METRIC)
+        {
+            if (c->inline_depth == METRIC_MAX_INLINE_DEPTH)
+            {
+                return -1;
+            }
+
+            c->inline_depth++;
+            int ret = link_metric(c, bytecode, var->offset);
+            c->inline_depth--;
+            if (ret == -1)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        /* Variable names are strings of the big string, just like event names */
+        struct compact_pmu_event name = { .offset = var->offset };
+        char* name_copy = strdup(get_event_name(name));
+        if (name_copy == NULL || emit_var(c, name_copy, var->kind) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void init_compiler(struct metric_compiler* c, const struct pmu_metrics_table* table,
+                          struct metric_expr* res)
+{
+    *c = (struct metric_compiler){ .res = res, .table = table };
+
+    res->insns = NULL;
+    res->num_insns = 0;
+    res->vars = NULL;
+    res->num_vars = 0;
+}
+
+int compile_metric_expr(const char* expr, struct metric_expr* res)
+{
+    struct metric_compiler c;
+    init_compiler(&c, NULL, res);
+
+    if (parse_whole_expr(&c, expr) == -1)
+    {
+        free_metric_expr(res);
+        return -1;
+    }
+    return 0;
+}
+
+int compile_metric(const struct pmu_metrics_table* table, const struct pmu_metric* metric,
+                   struct metric_expr* res)
+{
+    if (metric->metric_expr == NULL)
+    {
+        return -1;
+    }
+
+    struct metric_compiler c;
+    init_compiler(&c, table, res);
+
+    /*
+     * Find the metric in the table by its name, which points into the compressed metric,
+     * counting the metrics before it to get its index in the precompiled bytecode
+     */
+    uint32_t metric_idx = 0;
+    for (uint32_t cur_pmu = 0; cur_pmu < table->num_pmus && c.entry == NULL; cur_pmu++)
+    {
+        const struct pmu_table_entry* entry = &table->pmus[cur_pmu];
+        for (uint32_t x = 0; x < entry->num_entries; x++)
+        {
+            if (get_event_name(entry->entries[x]) == metric->metric_name)
+            {
+                c.entry = entry;
+                metric_idx += x;
+                break;
+            }
+        }
+        if (c.entry == NULL)
+        {
+            metric_idx += entry->num_entries;
+        }
+    }
+
+    const struct metric_bytecode_table* bytecode = get_metric_bytecode(table);
+    int ret;
+    if (c.entry != NULL && bytecode != NULL)
+    {
+        ret = link_metric(&c, bytecode, metric_idx);
+    }
+    else
+    {
+        ret = parse_whole_expr(&c, metric->metric_expr);
+    }
+
+    if (ret == -1)
+    {
+        free_metric_expr(res);
+        return -1;
+    }
+    return 0;
+}
+
+double eval_metric_expr(const struct metric_expr* expr, const double* values)
+{
+    double stack[METRIC_MAX_STACK];
+    size_t top = 0;
+
+    for (size_t i = 0; i < expr->num_insns; i++)
+    {
+        const struct metric_insn* insn = &expr->insns[i];
+        double lhs, rhs;
+
+        switch (insn->op)
+        {
+        case METRIC_OP_CONST:
+            stack[top++] = insn->constant;
+            continue;
+        case METRIC_OP_VAR:
+            stack[top++] = values[insn->var];
+            continue;
+        case METRIC_OP_NEG:
+            stack[top - 1] = -stack[top - 1];
+            continue;
+        case METRIC_OP_SELECT:
+        {
+            double false_val = stack[--top];
+            double cond = stack[--top];
+            if (cond == 0)
+            {
+                stack[top - 1] = false_val;
+            }
+            continue;
+        }
+        default:
+            break;
+        }
+
+        /* All other operations are binary */
+        rhs = stack[--top];
+        lhs = stack[top - 1];
+
+        switch (insn->op)
+        {
+        case METRIC_OP_ADD:
+            lhs = lhs + rhs;
+            break;
+        case METRIC_OP_SUB:
+            lhs = lhs - rhs;
+            break;
+        case METRIC_OP_MUL:
+            lhs = lhs * rhs;
+            break;
+        case METRIC_OP_DIV:
+            lhs = rhs == 0 ? NAN : lhs / rhs;
+            break;
+        case METRIC_OP_MOD:
+            lhs = (long)rhs == 0 ? NAN : (double)((long)lhs % (long)rhs);
+            break;
+        case METRIC_OP_LT:
+            lhs = lhs < rhs;
+            break;
+        case METRIC_OP_GT:
+            lhs = lhs > rhs;
+            break;
+        case METRIC_OP_AND:
+            lhs = lhs != 0 && rhs != 0;
+            break;
+        case METRIC_OP_OR:
+            lhs = lhs != 0 || rhs != 0;
+            break;
+        case METRIC_OP_XOR:
+            lhs = (lhs != 0) != (rhs != 0);
+            break;
+        case METRIC_OP_MIN:
+            lhs = lhs < rhs ? lhs : rhs;
+            break;
+        case METRIC_OP_MAX:
+            lhs = lhs > rhs ? lhs : rhs;
+            break;
+        case METRIC_OP_D_RATIO:
+            lhs = rhs == 0 ? 0 : lhs / rhs;
+            break;
+        default:
+            return NAN;
+        }
+        stack[top - 1] = lhs;
+    }
+
+    return top == 1 ? stack[0] : NAN;
+}
+
+int resolve_metric_var(const struct metric_var* var, double* value)
+{
+    if (var->kind == METRIC_VAR_CPUID)
+    {
+        struct perf_cpu cpu = { .cpu = -1 };
+        char* cpuid = get_cpuid_allow_env_override(cpu);
+        if (cpuid == NULL)
+        {
+            return -1;
+        }
+        *value = strcmp_cpuid_str(var->name, cpuid) == 0;
+        free(cpuid);
+        return 0;
+    }
+
+    if (var->kind != METRIC_VAR_LITERAL)
+    {
+        return -1;
+    }
+
+    if (strcasecmp(var->name, "#smt_on") == 0)
+    {
+        if (read_number_file("/sys/devices/system/cpu/smt/active", value) == -1)
+        {
+            *value = 0;
+        }
+        return 0;
+    }
+    if (strcasecmp(var->name, "#num_cpus") == 0)
+    {
+        *value = sysconf(_SC_NPROCESSORS_CONF);
+        return 0;
+    }
+    if (strcasecmp(var->name, "#num_cpus_online") == 0)
+    {
+        *value = sysconf(_SC_NPROCESSORS_ONLN);
+        return 0;
+    }
+    if (strcasecmp(var->name, "#core_wide") == 0 || strcasecmp(var->name, "#target_cpu") == 0)
+    {
+        *value = 1;
+        return 0;
+    }
+    if (strcasecmp(var->name, "#has_pmem") == 0)
+    {
+        *value = access("/sys/firmware/acpi/tables/NFIT", F_OK) == 0;
+        return 0;
+    }
+    return -1;
+}
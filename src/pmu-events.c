@@ -1,22 +1,29 @@
 #include <assert.h>
 #include <complex.h>
 #include <pmu-events/pmu-events.h>
+#include <pmu-events/sysfs.h>
 
 #include <pmu-events/_impl/pmu-events.h>
 
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <wchar.h>
 
+const char* const pmu_devices_base = "/sys/bus/event_source/devices";
+
 /*
- * Base path for all PMU devices in sysfs[:we
+ * The size of the stack arena gen_attr_for_event() parses event strings into
  */
-static const char* pmu_devices_base = "/sys/bus/event_source/devices";
+#define GEN_ATTR_ARENA_SIZE 1024
 
 /*
  * performs: result = base + "/" + filename
@@ -44,6 +51,7 @@ void free_pmu_instance(struct pmu_instance* instance)
     }
     free_range_list(&instance->cpus);
     free(instance->name);
+    free_pmu_formats(instance);
 }
 
 void free_pmu_class(struct pmu_class* class)
@@ -73,10 +81,16 @@ void free_pmus(struct pmus* pmus)
     free(pmus->classes);
 }
 
-/*
- * For a pmu_table_entry, get the name of the pmu
- */
-const char* get_pmu_name(struct pmu_table_entry entry);
+uint64_t hash_data(uint64_t hash, const void* data, size_t len)
+{
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+    return hash;
+}
 
 /*
  * Checks if "num" is in any of the ranges in range_list
@@ -95,21 +109,15 @@ static bool in_range_list(uint64_t num, struct range_list* range_list)
     return false;
 }
 
-/*
- * Returns the content of the file with the name "path"
- *
- * Returns the content on success, NULL otherwise
- *
- * The caller is responsible for free()-ing the result.
- */
-static char* get_file_content(const char* path)
+char* get_file_content_at(int dir_fd, const char* path)
 {
-    int fd = open(path, O_RDONLY);
+    int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
     if (fd == -1)
     {
         return NULL;
     }
 
+    /* sysfs files report a size of one page, the actual content may be shorter */
     off_t end = lseek(fd, 0, SEEK_END);
     lseek(fd, 0, SEEK_SET);
     if (end == -1)
@@ -119,15 +127,20 @@ static char* get_file_content(const char* path)
     }
 
     char* content = malloc(end + 1);
-    if (read(fd, content, end) == -1)
+    if (content == NULL)
     {
-        free(content);
         close(fd);
         return NULL;
     }
 
+    ssize_t len = read(fd, content, end);
     close(fd);
-    content[end] = '\0';
+    if (len == -1)
+    {
+        free(content);
+        return NULL;
+    }
+    content[len] = '\0';
 
     char* newline = strchr(content, '\n');
     if (newline != NULL)
@@ -138,31 +151,100 @@ static char* get_file_content(const char* path)
 }
 
 /*
- * Parses a range term of the form "5" (5 exactly)
- * or "4-7" (4 to 7, inclusively)
+ * Returns the content of the file with the name "path", see get_file_content_at()
+ */
+static char* get_file_content(const char* path)
+{
+    return get_file_content_at(AT_FDCWD, path);
+}
+
+int read_number_file(const char* path, double* value)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    int ret = fscanf(file, "%lf", value) == 1 ? 0 : -1;
+    fclose(file);
+    return ret;
+}
+
+void init_parse_arena(struct parse_arena* arena, void* buf, size_t size)
+{
+    arena->buf = buf;
+    arena->size = size;
+    arena->used = 0;
+}
+
+void reset_parse_arena(struct parse_arena* arena)
+{
+    arena->used = 0;
+}
+
+/*
+ * Allocates "size" bytes aligned to "align" (a power of two) from "arena"
  *
- * Args:
- *  - term: the term to parse
- *  - range, the range struct in which to store the result
- * Returns:
- *  - 0 on success, -1 on error
+ * Returns NULL if the arena is exhausted
  */
-int parse_range(const char* term, struct range* range)
+void* parse_arena_alloc(struct parse_arena* arena, size_t size, size_t align)
+{
+    uintptr_t cur = (uintptr_t)(arena->buf + arena->used);
+    size_t padding = (align - cur % align) % align;
+
+    if (padding > arena->size - arena->used || size > arena->size - arena->used - padding)
+    {
+        return NULL;
+    }
+
+    void* res = arena->buf + arena->used + padding;
+    arena->used += padding + size;
+    return res;
+}
+
+/*
+ * Returns the number of elements of the comma separated list "str"
+ */
+static size_t count_list_elements(const char* str)
+{
+    size_t len = 1;
+    for (const char* cur = strchr(str, ','); cur != NULL; cur = strchr(cur + 1, ','))
+    {
+        len++;
+    }
+    return len;
+}
+
+/*
+ * Returns the length of the first element of the comma separated list "str"
+ */
+static size_t list_element_len(const char* str)
+{
+    const char* next_comma = strchr(str, ',');
+    return next_comma == NULL ? strlen(str) : (size_t)(next_comma - str);
+}
+
+/*
+ * Parses the range term in the first "len" characters of "term", see parse_range()
+ */
+static int parse_range_span(const char* term, size_t len, struct range* range)
 {
     /* No empty strings please */
-    if (*term == '\0')
+    if (len == 0)
     {
         return -1;
     }
 
-    char* minus_sign = strchr(term, '-');
+    const char* term_end = term + len;
+    const char* minus_sign = memchr(term, '-', len);
+    char* endptr;
 
     /*single bit, i.e. 42*/
     if (minus_sign == NULL)
     {
-        char* endptr;
         uint64_t val = strtoull(term, &endptr, 10);
-        if (*endptr != '\0')
+        if (endptr != term_end)
         {
             return -1;
         }
@@ -172,20 +254,19 @@ int parse_range(const char* term, struct range* range)
     }
     else
     {
-        char* endptr;
         uint64_t start = strtoull(term, &endptr, 10);
-        if (*endptr != '-')
+        if (endptr != minus_sign)
         {
             return -1;
         }
 
-        if (*(minus_sign + 1) == '\0')
+        if (minus_sign + 1 == term_end)
         {
             return -1;
         }
 
         uint64_t end = strtoull((minus_sign + 1), &endptr, 10);
-        if (*endptr != '\0')
+        if (endptr != term_end)
         {
             return -1;
         }
@@ -196,6 +277,65 @@ int parse_range(const char* term, struct range* range)
     return 0;
 }
 
+/*
+ * Parses a range term of the form "5" (5 exactly)
+ * or "4-7" (4 to 7, inclusively)
+ *
+ * Args:
+ *  - term: the term to parse
+ *  - range, the range struct in which to store the result
+ * Returns:
+ *  - 0 on success, -1 on error
+ */
+int parse_range(const char* term, struct range* range)
+{
+    return parse_range_span(term, strlen(term), range);
+}
+
+/*
+ * Parses the "len" comma separated ranges of "term" into "ranges"
+ */
+static int parse_ranges(const char* term, struct range* ranges, size_t len)
+{
+    const char* cur_range = term;
+    for (size_t i = 0; i < len; i++)
+    {
+        size_t cur_len = list_element_len(cur_range);
+        if (parse_range_span(cur_range, cur_len, &ranges[i]) == -1)
+        {
+            return -1;
+        }
+        cur_range += cur_len + 1;
+    }
+    return 0;
+}
+
+/*
+ * Parses the attr member prefix of a config member definition, e.g. "config1:",
+ * into "var"
+ *
+ * Returns the rest of "term" on success, NULL if the prefix is unsupported
+ */
+static const char* parse_config_var(const char* term, enum ATTR_VAR* var)
+{
+    if (strncmp(term, "config:", strlen("config:")) == 0)
+    {
+        *var = CONFIG;
+        return term + strlen("config:");
+    }
+    else if (strncmp(term, "config1:", strlen("config1:")) == 0)
+    {
+        *var = CONFIG1;
+        return term + strlen("config1:");
+    }
+    else if (strncmp(term, "config2:", strlen("config2:")) == 0)
+    {
+        *var = CONFIG2;
+        return term + strlen("config2:");
+    }
+    return NULL;
+}
+
 /*
  * Parses a perf_event_attr config member definition.
  *
@@ -217,23 +357,8 @@ int parse_range(const char* term, struct range* range)
 
 int parse_config_def(const char* term, struct config_def* def)
 {
-    const char* start_term;
-    if (strncmp(term, "config:", strlen("config:")) == 0)
-    {
-        def->var = CONFIG;
-        start_term = term + strlen("config:");
-    }
-    else if (strncmp(term, "config1:", strlen("config1:")) == 0)
-    {
-        def->var = CONFIG1;
-        start_term = term + strlen("config1:");
-    }
-    else if (strncmp(term, "config2:", strlen("config2:")) == 0)
-    {
-        def->var = CONFIG2;
-        start_term = term + strlen("config2:");
-    }
-    else
+    const char* start_term = parse_config_var(term, &def->var);
+    if (start_term == NULL)
     {
         return -1;
     }
@@ -246,6 +371,20 @@ int parse_config_def(const char* term, struct config_def* def)
     return 0;
 }
 
+/*
+ * Like parse_config_def(), but allocates the ranges from "arena"
+ */
+int parse_config_def_arena(const char* term, struct config_def* def, struct parse_arena* arena)
+{
+    const char* start_term = parse_config_var(term, &def->var);
+    if (start_term == NULL)
+    {
+        return -1;
+    }
+
+    return parse_range_list_arena(start_term, &def->range, arena);
+}
+
 /*
  * Parses a range list, a comma separated list of ranges (as defined by parse_range)
  * e.g.: "4,15-43,12"
@@ -256,42 +395,47 @@ int parse_config_def(const char* term, struct config_def* def)
  */
 int parse_range_list(const char* term, struct range_list* list)
 {
-    char* new_term = strdup(term);
-    char* next_comma = NULL;
-    char* cur_range = new_term;
-
     list->len = 0;
     list->ranges = NULL;
-    do
+
+    size_t len = count_list_elements(term);
+    struct range* ranges = malloc(sizeof(struct range) * len);
+    if (ranges == NULL)
     {
-        list->len++;
+        return -1;
+    }
 
-        struct range* tmp = realloc(list->ranges, sizeof(struct range) * list->len);
-        if (tmp == NULL)
-        {
-            free(list->ranges);
-            free(new_term);
-            return -1;
-        }
-        list->ranges = tmp;
+    if (parse_ranges(term, ranges, len) == -1)
+    {
+        free(ranges);
+        return -1;
+    }
 
-        next_comma = strchr(cur_range, ',');
-        if (next_comma != NULL)
-        {
-            *next_comma = '\0';
-        }
+    list->len = len;
+    list->ranges = ranges;
+    return 0;
+}
 
-        if (parse_range(cur_range, &list->ranges[list->len - 1]) == -1)
-        {
-            free(list->ranges);
-            free(new_term);
-            return -1;
-        }
+/*
+ * Like parse_range_list(), but allocates the ranges from "arena".
+ *
+ * Fails if the arena is exhausted. The list must not be freed with free_range_list()
+ */
+int parse_range_list_arena(const char* term, struct range_list* list, struct parse_arena* arena)
+{
+    list->len = 0;
+    list->ranges = NULL;
 
-        cur_range = next_comma + 1;
-    } while (next_comma != NULL);
+    size_t len = count_list_elements(term);
+    struct range* ranges =
+        parse_arena_alloc(arena, sizeof(struct range) * len, _Alignof(struct range));
+    if (ranges == NULL || parse_ranges(term, ranges, len) == -1)
+    {
+        return -1;
+    }
 
-    free(new_term);
+    list->len = len;
+    list->ranges = ranges;
     return 0;
 }
 
@@ -316,20 +460,14 @@ void free_config_def(struct config_def* def)
 }
 
 /*
- * Parse assignments of the form "foo=42"
+ * Parses the assignment in the first "len" characters of "term", see parse_assignment().
  *
- * Args:
- *  - term: the term to parse
- *  - assignment: on succesful calls to parse_assignment, will contain the parse assignment
- * Returns:
- *  - 0 on success, -1 on error. Errors if "term" does not contain a term of the
- *    form "[key]=[value]"
- *  - The user of parse_assignment is responsible for freeing the resulting "assignment"
- *    on succesful calls to parse_assignment with free_assignment
+ * Stores the length of the key in "key_len", the key itself is not copied.
  */
-int parse_assignment(char* term, struct assignment* assignment)
+static int parse_assignment_span(const char* term, size_t len, size_t* key_len,
+                                 uint64_t* value)
 {
-    const char* equal_sign = strchr(term, '=');
+    const char* equal_sign = memchr(term, '=', len);
 
     if (equal_sign == NULL)
     {
@@ -341,31 +479,61 @@ int parse_assignment(char* term, struct assignment* assignment)
         return -1;
     }
 
-    if (*(equal_sign + 1) == '\0')
+    const char* term_end = term + len;
+    if (equal_sign + 1 == term_end)
     {
         return -1;
     }
 
-    uint64_t value = 0;
+    *value = 0;
 
     /* Some of the assignments we have encountered can look like:
      * foo=None
      *
      * Interpret them as zero
      */
-    if (strncmp(equal_sign + 1, "None", sizeof("None")) != 0)
+    if (term_end - (equal_sign + 1) != strlen("None") ||
+        strncmp(equal_sign + 1, "None", strlen("None")) != 0)
     {
         char* endptr;
-        value = strtoull(equal_sign + 1, &endptr, 16);
-        if (*endptr != '\0')
+        *value = strtoull(equal_sign + 1, &endptr, 16);
+        if (endptr != term_end)
         {
             return -1;
         }
     }
+    *key_len = equal_sign - term;
+
+    return 0;
+}
+
+/*
+ * Parse assignments of the form "foo=42"
+ *
+ * Args:
+ *  - term: the term to parse
+ *  - assignment: on succesful calls to parse_assignment, will contain the parse assignment
+ * Returns:
+ *  - 0 on success, -1 on error. Errors if "term" does not contain a term of the
+ *    form "[key]=[value]"
+ *  - The user of parse_assignment is responsible for freeing the resulting "assignment"
+ *    on succesful calls to parse_assignment with free_assignment
+ */
+int parse_assignment(char* term, struct assignment* assignment)
+{
+    size_t key_len;
+    uint64_t value;
+    if (parse_assignment_span(term, strlen(term), &key_len, &value) == -1)
+    {
+        return -1;
+    }
+
     assignment->value = value;
-    assignment->key = malloc(equal_sign - term + 1);
-    assignment->key[equal_sign - term] = '\0';
-    strncpy(assignment->key, term, equal_sign - term);
+    assignment->key = strndup(term, key_len);
+    if (assignment->key == NULL)
+    {
+        return -1;
+    }
 
     return 0;
 }
@@ -378,6 +546,43 @@ void free_assignment(struct assignment* asn)
     free(asn->key);
 }
 
+/*
+ * Parses the "len" comma separated assignments of "str" into "assignments",
+ * allocating the keys from "arena", or with malloc() if "arena" is NULL.
+ *
+ * On failure, the keys allocated with malloc() so far are freed.
+ */
+static int parse_assignments(const char* str, struct assignment* assignments, size_t len,
+                             struct parse_arena* arena)
+{
+    const char* cur_asn = str;
+    for (size_t i = 0; i < len; i++)
+    {
+        size_t cur_len = list_element_len(cur_asn);
+        size_t key_len;
+        char* key = NULL;
+
+        if (parse_assignment_span(cur_asn, cur_len, &key_len, &assignments[i].value) == 0)
+        {
+            key = arena != NULL ? parse_arena_alloc(arena, key_len + 1, 1) : malloc(key_len + 1);
+        }
+        if (key == NULL)
+        {
+            for (size_t x = 0; arena == NULL && x < i; x++)
+            {
+                free(assignments[x].key);
+            }
+            return -1;
+        }
+
+        memcpy(key, cur_asn, key_len);
+        key[key_len] = '\0';
+        assignments[i].key = key;
+        cur_asn += cur_len + 1;
+    }
+    return 0;
+}
+
 /*
  * Parses a list of comma separated assignments i.e.:
  *  foo=42,bar=13
@@ -393,43 +598,48 @@ void free_assignment(struct assignment* asn)
  */
 int parse_assignment_list(const char* str, struct assignment_list* list)
 {
-    char* new_str = strdup(str);
-    char* cur_range = new_str;
-    char* next_comma = new_str;
-
     list->len = 0;
     list->assignments = NULL;
 
-    while (next_comma != NULL)
+    size_t len = count_list_elements(str);
+    struct assignment* assignments = malloc(len * sizeof(struct assignment));
+    if (assignments == NULL)
     {
-        next_comma = strchr(cur_range, ',');
-        if (next_comma != NULL)
-        {
-            *next_comma = '\0';
-        }
+        return -1;
+    }
 
-        list->len++;
-        struct assignment* tmp = realloc(list->assignments, list->len * sizeof(struct assignment));
-        if (tmp == NULL)
-        {
-            free(list->assignments);
-            free(new_str);
-            return -1;
-        }
-        list->assignments = tmp;
+    if (parse_assignments(str, assignments, len, NULL) == -1)
+    {
+        free(assignments);
+        return -1;
+    }
 
-        if (parse_assignment(cur_range, &list->assignments[list->len - 1]) == -1)
-        {
-            list->len = 0;
-            free(list->assignments);
-            free(new_str);
-            return -1;
-        }
+    list->len = len;
+    list->assignments = assignments;
+    return 0;
+}
+
+/*
+ * Like parse_assignment_list(), but allocates the assignments and keys from "arena".
+ *
+ * Fails if the arena is exhausted. The list must not be freed with free_assignment_list()
+ */
+int parse_assignment_list_arena(const char* str, struct assignment_list* list,
+                                struct parse_arena* arena)
+{
+    list->len = 0;
+    list->assignments = NULL;
 
-        cur_range = next_comma + 1;
+    size_t len = count_list_elements(str);
+    struct assignment* assignments =
+        parse_arena_alloc(arena, len * sizeof(struct assignment), _Alignof(struct assignment));
+    if (assignments == NULL || parse_assignments(str, assignments, len, arena) == -1)
+    {
+        return -1;
     }
 
-    free(new_str);
+    list->len = len;
+    list->assignments = assignments;
     return 0;
 }
 
@@ -457,7 +667,8 @@ void free_assignment_list(struct assignment_list* list)
  * to_apply[bit0-7] is moved to config[bit0-7]
  * to_apply[bit8-15] is moved to config[bit32-39]
  */
-int apply_range_list_to_val(unsigned long long* config, uint64_t to_apply, struct range_list* list)
+int apply_range_list_to_val(unsigned long long* config, uint64_t to_apply,
+                            const struct range_list* list)
 {
     int range_nr = 0;
     for (; range_nr < list->len; range_nr++)
@@ -493,7 +704,8 @@ int apply_range_list_to_val(unsigned long long* config, uint64_t to_apply, struc
  * This means, that the lowest 8 bits of "event=[value]" are put into
  * attr->config[bits0-7], with the next 4 bits being put into attr->config[bits32-35]
  */
-int apply_config_def_to_attr(struct perf_event_attr* attr, uint64_t val, struct config_def* def)
+int apply_config_def_to_attr(struct perf_event_attr* attr, uint64_t val,
+                             const struct config_def* def)
 {
     switch (def->var)
     {
@@ -510,83 +722,110 @@ int apply_config_def_to_attr(struct perf_event_attr* attr, uint64_t val, struct
 }
 
 /*
- * Get a range list representing all CPUs in the system.
+ * The PMU devices are read from: the opened devices directory "fd", or "snapshot"
  */
-static struct range_list all_cpus()
+struct device_source
 {
-    struct range_list res;
-
-    res.ranges = malloc(sizeof(struct range));
-    res.len = 1;
-    res.ranges[0].start = 0;
-    res.ranges[0].end = sysconf(_SC_NPROCESSORS_ONLN) - 1;
-    return res;
-}
+    int fd;
+    const struct sysfs_snapshot* snapshot;
+};
 
 /*
- * Get [pmu_path]/cpus as a range_list
- *
- * Returns 0 on success, -1 on failure.
+ * Opens the devices directory of "sysfs", or pmu_devices_base if "sysfs" is NULL
  *
- * If get_cpus_for() succeeds, the caller is responsible for free-ing range_list with
- * free_range_list()
+ * Returns 0 on success, -1 on failure. On success, the caller is responsible for closing
+ * "source" with close_device_source()
  */
-static int get_cpus_for(const char* pmu_path, struct range_list* range_list)
+static int open_device_source(const struct pmu_sysfs* sysfs, struct device_source* source)
 {
-    char* cpus_path = concat_path(pmu_path, "cpus");
-    if (access(cpus_path, F_OK) != F_OK)
+    source->fd = -1;
+    source->snapshot = sysfs != NULL ? sysfs->snapshot : NULL;
+    if (source->snapshot != NULL)
     {
-        free(cpus_path);
-        return -1;
+        return 0;
     }
 
-    char* content = get_file_content(cpus_path);
-    free(cpus_path);
-    if (content == NULL)
-    {
-        return -1;
-    }
+    const char* root = sysfs != NULL && sysfs->root != NULL ? sysfs->root : pmu_devices_base;
+    source->fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return source->fd == -1 ? -1 : 0;
+}
 
-    if (parse_range_list(content, range_list) == -1)
+static void close_device_source(struct device_source* source)
+{
+    if (source->fd != -1)
     {
-        free(content);
-        return -1;
+        close(source->fd);
+        source->fd = -1;
     }
-    free(content);
-    return 0;
 }
 
 /*
- * Get [pmu_path]/cpumask as a range_list
- *
- * Returns 0 on success, -1 on failure.
- *
- * If get_cpumask_for() succeeds, the caller is responsible for free-ing range_list with
- * free_range_list()
+ * Get a range list representing all online CPUs of the system of "source".
  */
-static int get_cpumask_for(const char* pmu_path, struct range_list* range_list)
+static struct range_list all_cpus(const struct device_source* source)
 {
-    char* cpus_path = concat_path(pmu_path, "cpumask");
-    if (access(cpus_path, F_OK) != F_OK)
+    struct range_list res;
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (source->snapshot != NULL)
     {
-        free(cpus_path);
-        return -1;
+        const char* value = get_sysfs_snapshot_value(source->snapshot, "online_cpus");
+        num_cpus = value != NULL ? strtol(value, NULL, 10) : 1;
+    }
+    if (num_cpus < 1)
+    {
+        num_cpus = 1;
     }
 
-    char* content = get_file_content(cpus_path);
-    free(cpus_path);
-    if (content == NULL)
+    res.ranges = malloc(sizeof(struct range));
+    res.len = 1;
+    res.ranges[0].start = 0;
+    res.ranges[0].end = num_cpus - 1;
+    return res;
+}
+
+/*
+ * Returns the content of [devices directory]/[device]/[file] of "source",
+ * see get_file_content_at()
+ */
+static char* get_device_file_content(const struct device_source* source, const char* device,
+                                     const char* file)
+{
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", device, file) >= (int)sizeof(path))
     {
-        return -1;
+        return NULL;
     }
 
-    if (parse_range_list(content, range_list) == -1)
+    if (source->snapshot != NULL)
+    {
+        const char* value = get_sysfs_snapshot_value(source->snapshot, path);
+        return value == NULL ? NULL : strdup(value);
+    }
+    return get_file_content_at(source->fd, path);
+}
+
+/*
+ * Get [pmu_devices_base]/[device]/[file], i.e. the cpus or cpumask file,
+ * as a range_list
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ * If get_device_cpus() succeeds, the caller is responsible for free-ing range_list with
+ * free_range_list()
+ */
+static int get_device_cpus(const struct device_source* source, const char* device,
+                           const char* file, struct range_list* range_list)
+{
+    char* content = get_device_file_content(source, device, file);
+    if (content == NULL)
     {
-        free(content);
         return -1;
     }
+
+    int ret = parse_range_list(content, range_list);
     free(content);
-    return 0;
+    return ret;
 }
 
 /*
@@ -626,6 +865,27 @@ char* get_format_file_content(char* fmt_file, const struct pmu_instance* pmu_ins
     return content;
 }
 
+/*
+ * Reads the perf_event_attr.type of the PMU device "device" from
+ * [devices directory]/[device]/type of "source"
+ *
+ * Returns the perf_event_attr.type or -1 on failure.
+ */
+static int read_perf_type_at(const struct device_source* source, const char* device)
+{
+    char* content = get_device_file_content(source, device, "type");
+    if (content == NULL)
+    {
+        return -1;
+    }
+
+    char* endptr;
+    long res = strtol(content, &endptr, 10);
+    bool valid = *content != '\0' && *endptr == '\0';
+    free(content);
+    return valid ? res : -1;
+}
+
 /*
  * Reads the perf_event_attr.type from [path to pmu_instance]/type
  *
@@ -633,78 +893,248 @@ char* get_format_file_content(char* fmt_file, const struct pmu_instance* pmu_ins
  */
 int read_perf_type(const struct pmu_instance* pmu_instance)
 {
-    char* full_path = concat_path(pmu_devices_base, pmu_instance->name);
-    if (full_path == NULL)
+    struct device_source source;
+    if (open_device_source(NULL, &source) == -1)
+    {
+        return -1;
+    }
+
+    int type = read_perf_type_at(&source, pmu_instance->name);
+    close_device_source(&source);
+    return type;
+}
+
+static int cmp_pmu_format(const void* a, const void* b)
+{
+    const struct pmu_format *fmt_a = a, *fmt_b = b;
+
+    return strcmp(fmt_a->name, fmt_b->name);
+}
+
+/*
+ * Adds the format "name" with the definition "content" to "pmu_instance".
+ * Definitions that can not be parsed by parse_config_def() are skipped.
+ *
+ * Returns 0 on success, -1 on failure, in which case all formats of "pmu_instance" are freed
+ */
+static int add_pmu_format(struct pmu_instance* pmu_instance, const char* name,
+                          const char* content)
+{
+    struct config_def def;
+    if (parse_config_def(content, &def) == -1)
+    {
+        return 0;
+    }
+
+    size_t num_formats = pmu_instance->num_formats + 1;
+    struct pmu_format* tmp =
+        realloc(pmu_instance->formats, sizeof(struct pmu_format) * num_formats);
+    if (tmp == NULL)
     {
+        free_config_def(&def);
+        free_pmu_formats(pmu_instance);
         return -1;
     }
-    char* type_path = concat_path(full_path, "type");
-    if (type_path == NULL)
+    pmu_instance->formats = tmp;
+    char* format_name = strdup(name);
+    if (format_name == NULL)
     {
-        free(full_path);
+        free_config_def(&def);
+        free_pmu_formats(pmu_instance);
         return -1;
     }
-    free(full_path);
+    pmu_instance->formats[pmu_instance->num_formats].name = format_name;
+    pmu_instance->formats[pmu_instance->num_formats].def = def;
+    pmu_instance->num_formats++;
+    return 0;
+}
 
-    int fd = open(type_path, O_RDONLY);
-    if (fd == -1)
+/*
+ * Reads the format definitions of "pmu_instance" from the entries
+ * [device]/format/[name] of "snapshot"
+ */
+static int load_pmu_formats_from_snapshot(const struct sysfs_snapshot* snapshot,
+                                          struct pmu_instance* pmu_instance)
+{
+    char prefix[PATH_MAX];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%s/format/", pmu_instance->name);
+    if (prefix_len >= (int)sizeof(prefix))
     {
-        free(type_path);
         return -1;
     }
 
-    free(type_path);
-    off_t end = lseek(fd, 0, SEEK_END);
-    lseek(fd, 0, SEEK_SET);
-    if (end == -1)
+    size_t num_entries;
+    size_t first = find_sysfs_snapshot_entries(snapshot, prefix, &num_entries);
+    for (size_t i = first; i < first + num_entries; i++)
+    {
+        const struct sysfs_snapshot_entry* entry = &snapshot->entries[i];
+        if (add_pmu_format(pmu_instance, entry->key + prefix_len, entry->value) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Like load_pmu_formats(), with the device read from "source"
+ */
+static int load_pmu_formats_at(const struct device_source* source,
+                               struct pmu_instance* pmu_instance)
+{
+    pmu_instance->formats = NULL;
+    pmu_instance->num_formats = 0;
+    pmu_instance->type = read_perf_type_at(source, pmu_instance->name);
+
+    if (source->snapshot != NULL)
+    {
+        if (load_pmu_formats_from_snapshot(source->snapshot, pmu_instance) == -1)
+        {
+            return -1;
+        }
+        qsort(pmu_instance->formats, pmu_instance->num_formats, sizeof(struct pmu_format),
+              cmp_pmu_format);
+        return 0;
+    }
+
+    char format_path[PATH_MAX];
+    if (snprintf(format_path, sizeof(format_path), "%s/format", pmu_instance->name) >=
+        (int)sizeof(format_path))
     {
-        close(fd);
         return -1;
     }
 
-    char* content = malloc(end + 1);
-    if (read(fd, content, end) == -1)
+    int format_fd = openat(source->fd, format_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (format_fd == -1)
+    {
+        return 0;
+    }
+    DIR* dfd = fdopendir(format_fd);
+    if (dfd == NULL)
+    {
+        close(format_fd);
+        return 0;
+    }
+
+    struct dirent* dp;
+    while ((dp = readdir(dfd)) != NULL)
     {
+        if (strcmp(".", dp->d_name) == 0 || strcmp("..", dp->d_name) == 0)
+        {
+            continue;
+        }
+
+        char* content = get_file_content_at(format_fd, dp->d_name);
+        if (content == NULL)
+        {
+            continue;
+        }
+
+        int ret = add_pmu_format(pmu_instance, dp->d_name, content);
         free(content);
-        close(fd);
-        return -1;
+        if (ret == -1)
+        {
+            closedir(dfd);
+            return -1;
+        }
     }
-    content[end] = '\0';
+    closedir(dfd);
 
-    char* newline = strchr(content, '\n');
-    if (newline != NULL)
+    qsort(pmu_instance->formats, pmu_instance->num_formats, sizeof(struct pmu_format),
+          cmp_pmu_format);
+    return 0;
+}
+
+/*
+ * Reads the perf_event_attr.type and all format definitions in
+ * [path to pmu_instance]/format/ into pmu_instance.
+ *
+ * Format files that can not be parsed by parse_config_def() are skipped.
+ * If the type can not be read, pmu_instance->type is set to -1.
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ * The caller is responsible for freeing the formats with free_pmu_formats()
+ */
+int load_pmu_formats(struct pmu_instance* pmu_instance)
+{
+    struct device_source source;
+    if (open_device_source(NULL, &source) == -1)
     {
-        *newline = '\0';
+        pmu_instance->formats = NULL;
+        pmu_instance->num_formats = 0;
+        pmu_instance->type = -1;
+        return 0;
     }
 
-    char* endptr;
-    uint64_t res = strtoull(content, &endptr, 10);
+    int ret = load_pmu_formats_at(&source, pmu_instance);
+    close_device_source(&source);
+    return ret;
+}
 
-    if (*endptr != '\0')
+/*
+ * Frees the formats read by load_pmu_formats()
+ */
+void free_pmu_formats(struct pmu_instance* pmu_instance)
+{
+    for (size_t i = 0; i < pmu_instance->num_formats; i++)
     {
-        return -1;
+        free(pmu_instance->formats[i].name);
+        free_config_def(&pmu_instance->formats[i].def);
     }
-    free(content);
-    close(fd);
-    return res;
+    free(pmu_instance->formats);
+    pmu_instance->formats = NULL;
+    pmu_instance->num_formats = 0;
+}
+
+/*
+ * Returns the format definition "name" of pmu_instance, or NULL if there is none.
+ */
+const struct pmu_format* find_pmu_format(const struct pmu_instance* pmu_instance,
+                                         const char* name)
+{
+    struct pmu_format key = { .name = (char*)name };
+
+    return bsearch(&key, pmu_instance->formats, pmu_instance->num_formats,
+                   sizeof(struct pmu_format), cmp_pmu_format);
 }
 
+/*
+ * Generates the perf_event_attr for "ev" on "pmu_instance" from the type and formats
+ * cached in the pmu_instance, without accessing sysfs.
+ *
+ * Returns 0 on success, -1 on failure
+ */
 int gen_attr_for_event(const struct pmu_instance* pmu_instance, const struct pmu_event* ev,
                        struct perf_event_attr* attr)
 {
-    if ((attr->type = read_perf_type(pmu_instance)) == -1)
+    if (pmu_instance->type == -1)
     {
         return -1;
     }
+    attr->type = pmu_instance->type;
+
+    /*
+     * Event strings are short, so they are parsed into an arena on the stack.
+     * Only overly long ones fall back to the heap.
+     */
+    char arena_buf[GEN_ATTR_ARENA_SIZE];
+    struct parse_arena arena;
+    init_parse_arena(&arena, arena_buf, sizeof(arena_buf));
 
     struct assignment_list asn_list;
-    if (parse_assignment_list(ev->event, &asn_list) == -1)
+    bool on_heap = false;
+    if (parse_assignment_list_arena(ev->event, &asn_list, &arena) == -1)
     {
-        return -1;
+        if (parse_assignment_list(ev->event, &asn_list) == -1)
+        {
+            return -1;
+        }
+        on_heap = true;
     }
 
-    int asn_nr = 0;
-    for (; asn_nr < asn_list.len; asn_nr++)
+    int ret = 0;
+    for (size_t asn_nr = 0; asn_nr < asn_list.len && ret == 0; asn_nr++)
     {
         struct assignment asn = asn_list.assignments[asn_nr];
 
@@ -713,275 +1143,879 @@ int gen_attr_for_event(const struct pmu_instance* pmu_instance, const struct pmu
             continue;
         }
 
-        char* config_def_str = get_format_file_content(asn.key, pmu_instance);
-        if (config_def_str == NULL)
-        {
-            free_assignment_list(&asn_list);
-            return -1;
-        }
-
-        struct config_def conf_def;
-        if (parse_config_def(config_def_str, &conf_def) == -1)
+        const struct pmu_format* fmt = find_pmu_format(pmu_instance, asn.key);
+        if (fmt == NULL || apply_config_def_to_attr(attr, asn.value, &fmt->def) == -1)
         {
-            free_assignment_list(&asn_list);
-            free(config_def_str);
-            return -1;
+            ret = -1;
         }
+    }
 
-        free(config_def_str);
-
-        if (apply_config_def_to_attr(attr, asn.value, &conf_def) == -1)
-        {
-            free_config_def(&conf_def);
-            free_assignment_list(&asn_list);
-            free(config_def_str);
-            return -1;
-        }
-        free_config_def(&conf_def);
+    if (on_heap)
+    {
+        free_assignment_list(&asn_list);
     }
-    free_assignment_list(&asn_list);
-    return 0;
+    return ret;
 }
 
 /*
  * Searches for the perf event "ev" in the pmu_instance "pmu_instance",
  * returning the result in "pmu_ev".
  *
+ * jevents.py emits the entries of every PMU table sorted by event name, and the
+ * name is the first string of every compressed event. This allows for a binary search
+ * that compares the names in place and only decompresses the matching event.
+ *
  * On success, 0 is returned and the event is put into "pmu_ev"
  * On failure, -1 is returned.
  */
 int get_event_by_name(const struct pmu_instance* pmu_instance, const char* ev,
                       struct pmu_event* pmu_ev)
 {
-    for (size_t x = 0; x < pmu_instance->num_entries; x++)
+    size_t low = 0;
+    size_t high = pmu_instance->num_entries;
+
+    while (low < high)
     {
-        decompress_event(pmu_instance->entries[x].offset, pmu_ev);
+        size_t mid = low + (high - low) / 2;
+        int cmp = strcmp(get_event_name(pmu_instance->entries[mid]), ev);
 
-        if (strcmp(pmu_ev->name, ev) == 0)
+        if (cmp == 0)
         {
+            decompress_event(pmu_instance->entries[mid].offset, pmu_ev);
             return 0;
         }
+        else if (cmp < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
     }
 
     return -1;
 }
 
 /*
- * Return a list of all instances for the given pmu_class class.
- *
- * The PMUs given by the underlying perf/pmu-events mechanism are
- * PMU _classes_, meaning that for every class there can be one to many instances.
- *
- * Every PMU instance in a given Linux installation has a folder in
- *      "/sys/bus/event_source/devices/"
- *
- * This function returns for a given struct pmu_class, the PMU instances found
- * in the system.
- *
- * There are two mechanisms for matching the pmu_class to PMU instances:
- *
- * - The PMU class name is "default_core": This PMU class contains the PMU events tied
- *   to the cores of the processor.
- *   - One most Intel and AMD x86 systems, there is a single "cpu" PMU instance.
- *     That PMU instance is responsible for all the events in the "default_core"
- *     PMU class on all cores.
- *   - If there is no "cpu" PMU instance folder, then the PMU instance folders that
- *     contain a "cpus" file belong to the "default_core" PMU class.
- *     This "cpus" file also tells you which cores this PMU instance is responsible for.
- *
- * - The PMU class is something other, like "uncore_arb".
- *   - If thre is only one instance of the PMU class,  the sysfs PMU instance
-       folder is called just "[PMU CLASS]"
- *   - If they are n different instances of a PMU, then the instances are called
- *     "[PMU CLASS]_0" to "[PMU_CLASS]_(n-1)"
- *
- *
- * If class->num_instances is 0, then no PMU instances belonging to that PMU class could be
- * found. Sometimes, a kernel module might need to be loaded to make a PMU instance available.
- *
- * If class->num_instances is != 0, then the caller is responsible for free-ing the pmu_class
- * with free_pmu_class();
+ * Returns the index of the first of the sorted "entries" whose name does not compare less
+ * than "prefix", comparing only the first "prefix_len" characters if "prefix_only" is set
  */
-static int get_all_pmu_instances_for(struct pmu_class* class)
+static uint32_t lower_bound_event(const struct compact_pmu_event* entries, uint32_t num_entries,
+                                  const char* prefix, size_t prefix_len, bool prefix_only)
 {
-    DIR* dfd;
-    struct dirent* dp;
-    bool is_cpu = false;
+    uint32_t low = 0;
+    uint32_t high = num_entries;
 
-    class->instances = NULL;
-    class->num_instances = 0;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        int cmp = strncmp(get_event_name(entries[mid]), prefix, prefix_len);
+        if (cmp < 0 || (prefix_only && cmp == 0))
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
 
-    if ((dfd = opendir(pmu_devices_base)) == NULL)
+int init_event_iter(struct event_iter* iter, const struct pmu_instance* pmu_instance,
+                    const char* pattern, enum event_match match)
+{
+    memset(iter, 0, sizeof(*iter));
+    iter->pattern = strdup(pattern);
+    if (iter->pattern == NULL)
     {
         return -1;
     }
+    for (char* c = iter->pattern; *c != '\0'; c++)
+    {
+        *c = tolower((unsigned char)*c);
+    }
+    iter->entries = pmu_instance->entries;
+    iter->match = match;
+    iter->topic = -1;
 
-    if (strcmp(class->name, "default_core") == 0)
+    size_t prefix_len = strlen(iter->pattern);
+    if (match == EVENT_MATCH_GLOB)
     {
-        is_cpu = true;
+        prefix_len = strcspn(iter->pattern, "*?[\\");
     }
 
-    /*
-     * Iterate over "/sys/bus/event_source/devices/"
-     */
-    while ((dp = readdir(dfd)) != NULL)
+    /* All names starting with the prefix are between the two bounds */
+    iter->pos = lower_bound_event(iter->entries, pmu_instance->num_entries, iter->pattern,
+                                  prefix_len, false);
+    iter->end = lower_bound_event(iter->entries, pmu_instance->num_entries, iter->pattern,
+                                  prefix_len, true);
+    return 0;
+}
+
+void filter_event_iter(struct event_iter* iter, const struct event_filter* filter)
+{
+    iter->flags = filter->flags & filter->flags_mask;
+    iter->flags_mask = filter->flags_mask;
+    iter->topic = -1;
+    if (filter->topic == NULL)
     {
-        /*
-         * Skip . and ..
-         */
-        if (strcmp(".", dp->d_name) == 0 || strcmp("..", dp->d_name) == 0)
-        {
-            continue;
-        }
+        return;
+    }
 
-        if (is_cpu)
+    const char* topic;
+    for (uint16_t id = 0; (topic = get_event_topic(id)) != NULL; id++)
+    {
+        if (strcmp(topic, filter->topic) == 0)
         {
-            if (strcmp(dp->d_name, "cpu") == 0)
-            {
+            iter->topic = id;
+            return;
+        }
+    }
 
-                struct pmu_instance* tmp = realloc(
-                    class->instances, sizeof(struct pmu_instance) * (class->num_instances + 1));
+    /* No event has this topic */
+    iter->pos = iter->end;
+}
 
-                if (tmp == NULL)
-                {
-                    free_pmu_class(class);
-                    closedir(dfd);
+int next_event(struct event_iter* iter, struct pmu_event* pmu_ev)
+{
+    while (iter->pos < iter->end)
+    {
+        struct compact_pmu_event entry = iter->entries[iter->pos++];
+        if ((iter->topic != -1 && entry.topic != iter->topic) ||
+            (entry.flags & iter->flags_mask) != iter->flags)
+        {
+            continue;
+        }
+        if (iter->match == EVENT_MATCH_PREFIX ||
+            fnmatch(iter->pattern, get_event_name(entry), 0) == 0)
+        {
+            decompress_event(entry.offset, pmu_ev);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void free_event_iter(struct event_iter* iter)
+{
+    free(iter->pattern);
+    memset(iter, 0, sizeof(*iter));
+}
+
+ssize_t get_event_topics(const struct pmu_instance* pmu_instance, const char** topics,
+                         size_t max_topics)
+{
+    size_t num_ids = 0;
+    while (get_event_topic(num_ids) != NULL)
+    {
+        num_ids++;
+    }
+    bool* seen = calloc(num_ids, sizeof(bool));
+    if (seen == NULL)
+    {
+        return -1;
+    }
+
+    size_t num_topics = 0;
+    for (uint32_t x = 0; x < pmu_instance->num_entries; x++)
+    {
+        uint16_t id = pmu_instance->entries[x].topic;
+        if (id >= num_ids || seen[id])
+        {
+            continue;
+        }
+        seen[id] = true;
+        if (num_topics < max_topics)
+        {
+            topics[num_topics] = get_event_topic(id);
+        }
+        num_topics++;
+    }
+
+    free(seen);
+    return num_topics;
+}
+
+/*
+ * If either [pmu-instance-path]/cpus or [pmu-instance-path]/cpumask exists
+ * then it contains the list of CPUs for which this event can be perf_event_open'ed.
+ *
+ * Otherwise, the event is openable on all cores of the cpu.
+ *
+ * The caller is responsible for free-ing the result with free_range_list()
+ */
+static struct range_list get_instance_cpus(const struct device_source* source,
+                                           const char* device)
+{
+    struct range_list range_list;
+    if (get_device_cpus(source, device, "cpus", &range_list) == -1)
+    {
+        if (get_device_cpus(source, device, "cpumask", &range_list) == -1)
+        {
+            range_list = all_cpus(source);
+        }
+    }
+    return range_list;
+}
+
+/*
+ * Appends the PMU instance "name", which is responsible for the CPUs in "cpus", to "class".
+ * The type and format definitions of the instance are read from "source".
+ *
+ * Returns 0 on success, -1 on failure. On success, "cpus" is owned by the instance.
+ */
+static int add_pmu_instance(struct pmu_class* class, const struct device_source* source,
+                            const char* name, struct range_list cpus)
+{
+    struct pmu_instance* tmp =
+        realloc(class->instances, sizeof(struct pmu_instance) * (class->num_instances + 1));
+    if (tmp == NULL)
+    {
+        return -1;
+    }
+    class->instances = tmp;
+
+    struct pmu_instance* instance = &class->instances[class->num_instances];
+    instance->name = strdup(name);
+    instance->cpus = cpus;
+    instance->entries = NULL;
+    instance->num_entries = 0;
+    if (load_pmu_formats_at(source, instance) == -1)
+    {
+        free(instance->name);
+        return -1;
+    }
+
+    class->num_instances++;
+    return 0;
+}
+
+/*
+ * The devices of a PMU class name, see scan_pmu_devices()
+ */
+struct device_bucket
+{
+    /* Points into the name of the first device of the bucket, NULL for empty buckets */
+    const char* key;
+    size_t key_len;
+    /* Indices into pmu_devices.names, in directory order */
+    size_t* devices;
+    size_t num_devices;
+};
+
+/*
+ * All PMU devices of a device_source, read with a single scan of the directory
+ */
+struct pmu_devices
+{
+    /* All files of the devices are read from "source" */
+    struct device_source source;
+    char** names;
+    size_t num_names;
+    /* An open addressing hash table of device_buckets, the size is a power of two */
+    struct device_bucket* buckets;
+    size_t num_buckets;
+};
+
+/*
+ * Returns the length of "name" without an instance suffix of the form "_[0-9]+",
+ * i.e. the length of the PMU class name "name" is an instance of,
+ * e.g. 10 for "uncore_cha_12"
+ */
+static size_t device_class_len(const char* name)
+{
+    size_t len = strlen(name);
+    size_t num_digits = 0;
+    while (num_digits < len && isdigit((unsigned char)name[len - num_digits - 1]))
+    {
+        num_digits++;
+    }
+
+    if (num_digits == 0 || num_digits == len || name[len - num_digits - 1] != '_')
+    {
+        return len;
+    }
+    return len - num_digits - 1;
+}
+
+/*
+ * Returns the bucket for the first "key_len" characters of "key",
+ * which is empty if there are no devices for it
+ */
+static struct device_bucket* find_device_bucket(const struct pmu_devices* devices,
+                                                const char* key, size_t key_len)
+{
+    size_t mask = devices->num_buckets - 1;
+    size_t cur = hash_data(HASH_DATA_INIT, key, key_len) & mask;
+
+    while (devices->buckets[cur].key != NULL &&
+           (devices->buckets[cur].key_len != key_len ||
+            strncmp(devices->buckets[cur].key, key, key_len) != 0))
+    {
+        cur = (cur + 1) & mask;
+    }
+    return &devices->buckets[cur];
+}
+
+static int add_to_device_bucket(struct pmu_devices* devices, size_t device, size_t key_len)
+{
+    const char* key = devices->names[device];
+    struct device_bucket* bucket = find_device_bucket(devices, key, key_len);
+
+    size_t* tmp = realloc(bucket->devices, sizeof(size_t) * (bucket->num_devices + 1));
+    if (tmp == NULL)
+    {
+        return -1;
+    }
+    bucket->devices = tmp;
+    bucket->devices[bucket->num_devices++] = device;
+    bucket->key = key;
+    bucket->key_len = key_len;
+    return 0;
+}
+
+static void free_pmu_devices(struct pmu_devices* devices)
+{
+    for (size_t i = 0; i < devices->num_names; i++)
+    {
+        free(devices->names[i]);
+    }
+    free(devices->names);
+
+    for (size_t i = 0; i < devices->num_buckets; i++)
+    {
+        free(devices->buckets[i].devices);
+    }
+    free(devices->buckets);
+
+    close_device_source(&devices->source);
+}
+
+static int add_device_name(struct pmu_devices* devices, const char* name, size_t len)
+{
+    char** tmp = realloc(devices->names, sizeof(char*) * (devices->num_names + 1));
+    if (tmp == NULL)
+    {
+        return -1;
+    }
+    devices->names = tmp;
+    devices->names[devices->num_names] = strndup(name, len);
+    if (devices->names[devices->num_names] == NULL)
+    {
+        return -1;
+    }
+    devices->num_names++;
+    return 0;
+}
+
+/*
+ * Reads the names of the devices of the directory "fd" into "devices"
+ */
+static int read_device_names(struct pmu_devices* devices, int fd)
+{
+    int dir_fd = dup(fd);
+    if (dir_fd == -1)
+    {
+        return -1;
+    }
+    DIR* dir = fdopendir(dir_fd);
+    if (dir == NULL)
+    {
+        close(dir_fd);
+        return -1;
+    }
+
+    int ret = 0;
+    struct dirent* dp;
+    while (ret == 0 && (dp = readdir(dir)) != NULL)
+    {
+        if (strcmp(".", dp->d_name) == 0 || strcmp("..", dp->d_name) == 0)
+        {
+            continue;
+        }
+        ret = add_device_name(devices, dp->d_name, strlen(dp->d_name));
+    }
+    closedir(dir);
+    return ret;
+}
+
+/*
+ * Reads the names of the devices of "snapshot" into "devices", i.e. the first
+ * components of the keys of the device entries
+ */
+static int read_snapshot_device_names(struct pmu_devices* devices,
+                                      const struct sysfs_snapshot* snapshot)
+{
+    /* The entries are sorted, so the entries of every device are adjacent */
+    for (size_t i = 0; i < snapshot->num_entries; i++)
+    {
+        const char* key = snapshot->entries[i].key;
+        const char* slash = strchr(key, '/');
+        if (slash == NULL)
+        {
+            continue;
+        }
+
+        size_t len = slash - key;
+        const char* last = devices->num_names > 0 ? devices->names[devices->num_names - 1] : "";
+        if (strlen(last) == len && strncmp(last, key, len) == 0)
+        {
+            continue;
+        }
+        if (add_device_name(devices, key, len) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reads the names of all PMU devices of "sysfs" (NULL for pmu_devices_base) into "devices".
+ *
+ * Every device is put into the bucket of its own name and, if it has an instance
+ * suffix, into the bucket of its PMU class name (e.g. "uncore_cha_12" into
+ * "uncore_cha_12" and "uncore_cha"), so that the instances of a class can be found
+ * without scanning the directory again.
+ *
+ * Returns 0 on success, -1 on failure. On success, the caller is responsible for
+ * freeing "devices" with free_pmu_devices()
+ */
+static int scan_pmu_devices(struct pmu_devices* devices, const struct pmu_sysfs* sysfs)
+{
+    memset(devices, 0, sizeof(*devices));
+    if (open_device_source(sysfs, &devices->source) == -1)
+    {
+        return -1;
+    }
+
+    int ret = devices->source.snapshot != NULL
+                  ? read_snapshot_device_names(devices, devices->source.snapshot)
+                  : read_device_names(devices, devices->source.fd);
+    if (ret == -1)
+    {
+        free_pmu_devices(devices);
+        return -1;
+    }
+
+    /* Every device is in at most two buckets, keep the load factor at most 1/2 */
+    devices->num_buckets = 4;
+    while (devices->num_buckets < devices->num_names * 4)
+    {
+        devices->num_buckets *= 2;
+    }
+    devices->buckets = calloc(devices->num_buckets, sizeof(struct device_bucket));
+    if (devices->buckets == NULL)
+    {
+        devices->num_buckets = 0;
+        free_pmu_devices(devices);
+        return -1;
+    }
+
+    for (size_t i = 0; i < devices->num_names; i++)
+    {
+        size_t len = strlen(devices->names[i]);
+        size_t class_len = device_class_len(devices->names[i]);
+
+        if (add_to_device_bucket(devices, i, len) == -1 ||
+            (class_len != len && add_to_device_bucket(devices, i, class_len) == -1))
+        {
+            free_pmu_devices(devices);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Return a list of all instances for the given pmu_class class.
+ *
+ * The PMUs given by the underlying perf/pmu-events mechanism are
+ * PMU _classes_, meaning that for every class there can be one to many instances.
+ *
+ * Every PMU instance in a given Linux installation has a folder in
+ *      "/sys/bus/event_source/devices/"
+ *
+ * This function returns for a given struct pmu_class, the PMU instances found
+ * in the system.
+ *
+ * There are two mechanisms for matching the pmu_class to PMU instances:
+ *
+ * - The PMU class name is "default_core": This PMU class contains the PMU events tied
+ *   to the cores of the processor.
+ *   - One most Intel and AMD x86 systems, there is a single "cpu" PMU instance.
+ *     That PMU instance is responsible for all the events in the "default_core"
+ *     PMU class on all cores.
+ *   - If there is no "cpu" PMU instance folder, then the PMU instance folders that
+ *     contain a "cpus" file belong to the "default_core" PMU class.
+ *     This "cpus" file also tells you which cores this PMU instance is responsible for.
+ *
+ * - The PMU class is something other, like "uncore_arb".
+ *   - If thre is only one instance of the PMU class,  the sysfs PMU instance
+       folder is called just "[PMU CLASS]"
+ *   - If they are n different instances of a PMU, then the instances are called
+ *     "[PMU CLASS]_0" to "[PMU_CLASS]_(n-1)"
+ *
+ *   Both are in the device bucket of the class name, see scan_pmu_devices().
+ *
+ * If class->num_instances is 0, then no PMU instances belonging to that PMU class could be
+ * found. Sometimes, a kernel module might need to be loaded to make a PMU instance available.
+ *
+ * If class->num_instances is != 0, then the caller is responsible for free-ing the pmu_class
+ * with free_pmu_class();
+ */
+static int get_all_pmu_instances_for(const struct pmu_devices* devices, struct pmu_class* class)
+{
+    class->instances = NULL;
+    class->num_instances = 0;
+
+    if (strcmp(class->name, "default_core") == 0)
+    {
+        const struct device_bucket* cpu_bucket = find_device_bucket(devices, "cpu", strlen("cpu"));
+        for (size_t i = 0; i < cpu_bucket->num_devices; i++)
+        {
+            if (strcmp(devices->names[cpu_bucket->devices[i]], "cpu") == 0)
+            {
+                struct range_list cpus = all_cpus(&devices->source);
+                if (add_pmu_instance(class, &devices->source, "cpu", cpus) == -1)
+                {
+                    free_range_list(&cpus);
+                    free_pmu_class(class);
                     return -1;
                 }
-                class->instances = tmp;
-                class->num_instances++;
-                class->instances[class->num_instances - 1].name = strdup("cpu");
-                class->instances[class->num_instances - 1].cpus = all_cpus();
-
-                closedir(dfd);
                 return 0;
             }
+        }
 
-            char* full_path = concat_path(pmu_devices_base, dp->d_name);
-
+        for (size_t i = 0; i < devices->num_names; i++)
+        {
             struct range_list cpus;
-            if (get_cpus_for(full_path, &cpus) == -1)
+            if (get_device_cpus(&devices->source, devices->names[i], "cpus", &cpus) == -1)
             {
-                free(full_path);
                 continue;
             }
-            free(full_path);
 
-            struct pmu_instance* tmp =
-                realloc(class->instances, sizeof(struct pmu_instance) * (class->num_instances + 1));
-
-            if (tmp == NULL)
+            if (add_pmu_instance(class, &devices->source, devices->names[i], cpus) == -1)
             {
                 free_range_list(&cpus);
                 free_pmu_class(class);
-                closedir(dfd);
                 return -1;
             }
-            class->instances = tmp;
-            class->num_instances++;
+        }
+        return 0;
+    }
+
+    const struct device_bucket* bucket =
+        find_device_bucket(devices, class->name, strlen(class->name));
+    for (size_t i = 0; i < bucket->num_devices; i++)
+    {
+        const char* name = devices->names[bucket->devices[i]];
+        struct range_list range_list = get_instance_cpus(&devices->source, name);
 
-            class->instances[class->num_instances - 1].name = strdup(dp->d_name);
-            class->instances[class->num_instances - 1].cpus = cpus;
+        if (add_pmu_instance(class, &devices->source, name, range_list) == -1)
+        {
+            free_range_list(&range_list);
+            free_pmu_class(class);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Checks if "suffix" is a valid PMU instance suffix, this is either
+ * - the empty string
+ * - a decimal number, e.g. "imx8_ddr[0]", optionally preceded by an underscore
+ * - a hexadecimal number with more than two digits (e.g. an address),
+ *   optionally preceded by an underscore
+ *
+ * Lifted from perf_pmu__valid_suffix() in linux/tools/perf/util/pmu.c
+ */
+bool is_valid_pmu_suffix(const char* suffix)
+{
+    const char* p = suffix;
+    bool has_hex = false;
+
+    if (*p == '\0')
+    {
+        return true;
+    }
+
+    if (*p == '_')
+    {
+        p++;
+        suffix++;
+    }
+
+    /* Ensure we end in a number */
+    do
+    {
+        if (!isxdigit((unsigned char)*p))
+        {
+            return false;
+        }
+        if (!has_hex)
+        {
+            has_hex = !isdigit((unsigned char)*p);
+        }
+    } while (*(++p) != '\0');
+
+    if (has_hex)
+    {
+        return (p - suffix) > 2;
+    }
+    return true;
+}
+
+/*
+ * Checks if the sysfs PMU instance "name" is an instance of the system PMU class "class_name".
+ *
+ * This is the case if the class name is followed by a valid suffix, e.g. "imx8_ddr0" for the
+ * class "imx8_ddr". Class names can also be comma-separated lists of tokens that have to be
+ * contained in the instance name in order, e.g. "hisi_sicl2_cpa0" for "hisi_sicl,cpa".
+ *
+ * Follows pmu_uncore_alias_match() in linux/tools/perf/util/pmu.c
+ */
+bool sys_pmu_name_match(const char* class_name, const char* name)
+{
+    const char* tok = class_name;
+    const char* pos = name;
+
+    while (true)
+    {
+        const char* comma = strchr(tok, ',');
+        size_t tok_len = comma != NULL ? (size_t)(comma - tok) : strlen(tok);
+
+        /*
+         * The first token has to be a prefix of the instance name,
+         * all others can be anywhere after the previous token.
+         */
+        if (tok == class_name)
+        {
+            if (strncmp(pos, tok, tok_len) != 0)
+            {
+                return false;
+            }
         }
         else
         {
-            /*
-             * There can be multiple instances of some PMUs per system. e.g.
-             * one memory channel interface PMU instance per memory channel of the processor.
-             *
-             * These folders have a name of the form PMU_NAME(_[0-9]+)?
-             *
-             * To check if the current folder is an instance of the given PMU class,
-             * We are dealing with uncore pmus here.
-             * first check if class->name is a true prefix of dp->d_name
-             *
-             */
-            if (strncmp(dp->d_name, class->name, strlen(class->name)) != 0)
+            while (*pos != '\0' && strncmp(pos, tok, tok_len) != 0)
             {
-                continue;
+                pos++;
             }
-
-            /*
-             * Check for exact matches (e.g. dp->d_name == class->name)
-             *
-             * For example, on Intel Alderlake there is a cpu_atom PMU class and
-             * exactly one cpu_atom PMU instance.
-             *
-             */
-            if (strlen(dp->d_name) != strlen(class->name))
+            if (*pos == '\0')
             {
-                /*
-                 * Ok, class->name is shorter than dp->d_name.
-                 *
-                 * Check then, if we have a PMU instance or an unrelated PMU class
-                 * that class->name is a prefix of.
-                 *
-                 * e.g., for a PMU class "foo" we are interested in "foo_0", "foo_42", but not
-                 * "foobar_0" because that is from another "foobar" PMU class.
-                 */
-                if (strlen(dp->d_name) + 2 < strlen(class->name))
-                {
-                    continue;
-                }
+                return false;
+            }
+        }
+        pos += tok_len;
 
-                // check if the PMU class name is followed by a underscore...
-                if (*(dp->d_name + strlen(class->name)) != '_')
-                {
-                    continue;
-                }
+        if (comma == NULL)
+        {
+            return is_valid_pmu_suffix(pos);
+        }
+        tok = comma + 1;
+    }
+}
 
-                // ...and then a number.
-                char* endptr;
-                errno = 0;
-                strtoul(dp->d_name + strlen(class->name) + 1, &endptr, 10);
-                if (errno != 0)
-                {
-                    continue;
-                }
-                if (*endptr != '\0')
-                {
-                    continue;
-                }
-            }
+/*
+ * Checks if the content of the "identifier" file of a PMU instance matches the "compat"
+ * string of a system PMU event, compiled with regcomp() and REG_EXTENDED. "compat" has to
+ * match the whole identifier.
+ */
+bool identifier_match(const regex_t* compat, const char* identifier)
+{
+    regmatch_t pmatch[1];
+    return regexec(compat, identifier, 1, pmatch, 0) == 0 && pmatch[0].rm_so == 0 &&
+           (size_t)pmatch[0].rm_eo == strlen(identifier);
+}
 
-            struct pmu_instance* tmp = realloc(
-                class->instances, (sizeof(struct pmu_instance) * (class->num_instances + 1)));
+/*
+ * Return a list of all instances for the system (SoC) PMU class "class".
+ *
+ * Like for other uncore PMUs, the instance names are derived from the class name,
+ * see sys_pmu_name_match(). As the same class name can be used by different SoCs
+ * with different events, the content of [pmu-instance-path]/identifier also has to
+ * match the "compat" string of the events.
+ *
+ * If class->num_instances is != 0, then the caller is responsible for free-ing the pmu_class
+ * with free_pmu_class();
+ */
+static int get_sys_pmu_instances_for(const struct pmu_devices* devices, struct pmu_class* class,
+                                     const char* compat)
+{
+    class->instances = NULL;
+    class->num_instances = 0;
 
-            if (tmp == NULL)
+    /* Compiled once for all devices, and only if a device has a matching name */
+    regex_t compat_re;
+    bool compiled = false;
+    for (size_t i = 0; i < devices->num_names; i++)
+    {
+        const char* name = devices->names[i];
+        if (!sys_pmu_name_match(class->name, name))
+        {
+            continue;
+        }
+
+        if (!compiled)
+        {
+            if (regcomp(&compat_re, compat, REG_EXTENDED) != 0)
             {
-                free_pmu_class(class);
-                closedir(dfd);
-                return -1;
+                return 0;
             }
-            class->instances = tmp;
-            class->num_instances++;
-            class->instances[class->num_instances - 1].name = strdup(dp->d_name);
+            compiled = true;
+        }
 
-            struct range cpus;
+        char* identifier = get_device_file_content(&devices->source, name, "identifier");
+        if (identifier == NULL || !identifier_match(&compat_re, identifier))
+        {
+            free(identifier);
+            continue;
+        }
+        free(identifier);
 
-            char* full_path = concat_path(pmu_devices_base, dp->d_name);
-            struct range_list range_list;
+        struct range_list range_list = get_instance_cpus(&devices->source, name);
+        if (add_pmu_instance(class, &devices->source, name, range_list) == -1)
+        {
+            free_range_list(&range_list);
+            free_pmu_class(class);
+            regfree(&compat_re);
+            return -1;
+        }
+    }
 
-            /*
-             * If either [pmu-instance-path]/cpus or [pmu-instance-path]/cpumask exists
-             * then it contains the list of CPUs for which this event can be perf_event_open'ed.
-             *
-             * Otherwise, the event is openable on all cores of the cpu.
-             */
-            if (get_cpus_for(full_path, &range_list) == -1)
-            {
-                if (get_cpumask_for(full_path, &range_list) == -1)
-                {
-                    range_list = all_cpus();
-                }
-            }
-            free(full_path);
-            class->instances[class->num_instances - 1].cpus = range_list;
+    if (compiled)
+    {
+        regfree(&compat_re);
+    }
+    return 0;
+}
+
+/*
+ * Returns the entry for the PMU class "pmu_name" in "table", or NULL if there is none.
+ */
+static const struct pmu_table_entry* find_pmu_table_entry(const struct pmu_events_table* table,
+                                                          const char* pmu_name)
+{
+    for (uint32_t cur_pmu = 0; cur_pmu < table->num_pmus; cur_pmu++)
+    {
+        if (strcmp(get_pmu_name(table->pmus[cur_pmu]), pmu_name) == 0)
+        {
+            return &table->pmus[cur_pmu];
         }
     }
+    return NULL;
+}
 
-    closedir(dfd);
+/*
+ * Returns the map of "cpu" on the system of "sysfs", see get_sysfs_cpuid()
+ */
+static const struct pmu_events_map* map_for_sysfs_cpu(const struct pmu_sysfs* sysfs,
+                                                      struct perf_cpu cpu)
+{
+    /* map_for_cpu() caches the maps of the CPUs of this system */
+    if (sysfs == NULL || sysfs->snapshot == NULL)
+    {
+        return map_for_cpu(cpu);
+    }
+
+    char* cpuid = get_sysfs_cpuid(sysfs, cpu);
+    if (cpuid == NULL)
+    {
+        return NULL;
+    }
+    const struct pmu_events_map* map = map_for_cpuid(cpuid);
+    free(cpuid);
+    return map;
+}
+
+/*
+ * On heterogeneous systems, such as ARM big.LITTLE, there is one core PMU instance per
+ * kind of core (e.g. "armv8_cortex_a55" and "armv8_cortex_a76"), and every kind of core
+ * has its own event table.
+ *
+ * For every instance of the "default_core" PMU class, this resolves the event table
+ * of the first CPU the instance is responsible for and attaches its "default_core" events.
+ * If there is no table for that CPU, the instance keeps the events of CPU 0.
+ *
+ * (On Intel hybrid processors, the P- and E-Core events are in the same table under the
+ * "cpu_core" and "cpu_atom" PMU classes instead, which are matched by name.)
+ */
+static void attach_core_events(const struct pmu_sysfs* sysfs, struct pmu_class* class)
+{
+    for (int cur_instance = 0; cur_instance < class->num_instances; cur_instance++)
+    {
+        struct pmu_instance* instance = &class->instances[cur_instance];
+        if (instance->cpus.len == 0)
+        {
+            continue;
+        }
+
+        struct perf_cpu cpu;
+        cpu.cpu = instance->cpus.ranges[0].start;
+        const struct pmu_events_map* map = map_for_sysfs_cpu(sysfs, cpu);
+        if (map == NULL)
+        {
+            continue;
+        }
+
+        const struct pmu_table_entry* entry =
+            find_pmu_table_entry(&map->event_table, "default_core");
+        if (entry == NULL)
+        {
+            continue;
+        }
+        instance->entries = entry->entries;
+        instance->num_entries = entry->num_entries;
+    }
+}
 
+/*
+ * Sets the number of counters of "class" from the counter layout of its PMU in "table",
+ * if there is one.
+ */
+static void set_pmu_counters(struct pmu_class* class, const struct pmu_layouts_table* table)
+{
+    for (uint32_t x = 0; x < table->num_entries; x++)
+    {
+        if (strcmp(table->entries[x].pmu, class->name) == 0)
+        {
+            class->counters_num_gp = table->entries[x].counters_num_gp;
+            class->counters_num_fixed = table->entries[x].counters_num_fixed;
+            return;
+        }
+    }
+}
+
+/*
+ * Appends "class" to "pmus", attaching the events of the table entry "entry"
+ * to all of its instances.
+ *
+ * Returns 0 on success, -1 on failure. On success, "class" is owned by "pmus".
+ */
+static int add_pmu_class(struct pmus* pmus, struct pmu_class class,
+                         const struct pmu_table_entry* entry)
+{
+    struct pmu_class* tmp =
+        realloc(pmus->classes, sizeof(struct pmu_class) * (pmus->num_classes + 1));
+    if (tmp == NULL)
+    {
+        return -1;
+    }
+    pmus->classes = tmp;
+
+    for (int cur_instance = 0; cur_instance < class.num_instances; cur_instance++)
+    {
+        class.instances[cur_instance].entries = entry->entries;
+        class.instances[cur_instance].num_entries = entry->num_entries;
+    }
+
+    pmus->classes[pmus->num_classes] = class;
+    pmus->num_classes++;
     return 0;
 }
 
@@ -1006,26 +2040,42 @@ static int get_all_pmu_instances_for(struct pmu_class* class)
  * free_pmus()
  */
 int get_pmus(struct pmus* pmus)
+{
+    return get_pmus_from(NULL, pmus);
+}
+
+int get_pmus_from(const struct pmu_sysfs* sysfs, struct pmus* pmus)
 {
     pmus->num_classes = 0;
     pmus->classes = NULL;
 
+    /*
+     * The PMU classes are taken from the table of CPU 0. On heterogeneous systems,
+     * the core PMU instances get the events of the CPUs they are responsible for,
+     * see attach_core_events()
+     */
     struct perf_cpu cpu;
-    // TODO: even on heterogeneous systems (i.e. Intel Alderlake with P/E Cores)
-    // every CPU returns the same list of events. So assume (for now) that is the
-    // same for every CPU, regardless of architecture
-    //
-    // TODO: What about heterogeneous multi-cpu systems, are they even allowed?
     cpu.cpu = 0;
-    const struct pmu_events_map* map = map_for_cpu(cpu);
+    const struct pmu_events_map* map = map_for_sysfs_cpu(sysfs, cpu);
+    if (map == NULL)
+    {
+        return -1;
+    }
+
+    /* All classes are matched against a single scan of the PMU devices */
+    struct pmu_devices devices;
+    if (scan_pmu_devices(&devices, sysfs) == -1)
+    {
+        return -1;
+    }
 
     for (int cur_pmu = 0; cur_pmu < map->event_table.num_pmus; cur_pmu++)
     {
         const char* pmu_name = get_pmu_name(map->event_table.pmus[cur_pmu]);
 
-        struct pmu_class class;
-        class.name = pmu_name;
-        if (get_all_pmu_instances_for(&class) == -1)
+        struct pmu_class class = { .name = pmu_name };
+        set_pmu_counters(&class, &map->layout_table);
+        if (get_all_pmu_instances_for(&devices, &class) == -1)
         {
             continue;
         }
@@ -1035,28 +2085,68 @@ int get_pmus(struct pmus* pmus)
             continue;
         }
 
-        pmus->num_classes++;
-        struct pmu_class* tmp =
-            realloc(pmus->classes, sizeof(struct pmu_class) * pmus->num_classes);
-        if (tmp == NULL)
+        if (add_pmu_class(pmus, class, &map->event_table.pmus[cur_pmu]) == -1)
         {
             free_pmu_class(&class);
             free_pmus(pmus);
+            free_pmu_devices(&devices);
             return -1;
         }
-        pmus->classes = tmp;
-        pmus->classes[pmus->num_classes - 1] = class;
 
-        for (size_t cur_instance = 0;
-             cur_instance < pmus->classes[pmus->num_classes - 1].num_instances; cur_instance++)
+        if (strcmp(pmu_name, "default_core") == 0)
         {
-            pmus->classes[pmus->num_classes - 1].instances[cur_instance].entries =
-                map->event_table.pmus[cur_pmu].entries;
-            pmus->classes[pmus->num_classes - 1].instances[cur_instance].num_entries =
-                map->event_table.pmus[cur_pmu].num_entries;
+            attach_core_events(sysfs, &pmus->classes[pmus->num_classes - 1]);
         }
     }
 
+    /*
+     * System PMUs are not tied to the CPU, so check the tables of all SoCs.
+     */
+    const struct pmu_events_table* sys_table;
+    for (size_t cur_table = 0; (sys_table = get_sys_event_table(cur_table)) != NULL; cur_table++)
+    {
+        for (uint32_t cur_pmu = 0; cur_pmu < sys_table->num_pmus; cur_pmu++)
+        {
+            const struct pmu_table_entry* entry = &sys_table->pmus[cur_pmu];
+            if (entry->num_entries == 0)
+            {
+                continue;
+            }
+
+            /*
+             * All events of a system PMU in a table are for the same SoC,
+             * so the compat string of the first event is used for matching.
+             */
+            struct pmu_event ev;
+            decompress_event_hot(entry->entries[0].offset, &ev);
+            if (ev.compat == NULL)
+            {
+                continue;
+            }
+
+            struct pmu_class class = { .name = get_pmu_name(*entry) };
+            if (get_sys_pmu_instances_for(&devices, &class, ev.compat) == -1)
+            {
+                continue;
+            }
+
+            if (class.num_instances == 0)
+            {
+                continue;
+            }
+
+            if (add_pmu_class(pmus, class, entry) == -1)
+            {
+                free_pmu_class(&class);
+                free_pmus(pmus);
+                free_pmu_devices(&devices);
+                return -1;
+            }
+        }
+    }
+
+    free_pmu_devices(&devices);
+
     if (pmus->num_classes == 0)
     {
         return -1;
@@ -1064,3 +2154,113 @@ int get_pmus(struct pmus* pmus)
 
     return 0;
 }
+
+static int cmp_strings(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+/*
+ * Hashes the name "name" and the content "content" of a file into "hash"
+ */
+static uint64_t hash_file(uint64_t hash, const char* name, const char* content)
+{
+    hash = hash_data(hash, name, strlen(name) + 1);
+    return hash_data(hash, content, strlen(content) + 1);
+}
+
+/*
+ * Hashes the names and contents of the format files of "device" into "hash", in name order
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int hash_device_formats(const struct device_source* source, const char* device,
+                               uint64_t* hash)
+{
+    char path[PATH_MAX];
+    int path_len = snprintf(path, sizeof(path), "%s/format/", device);
+    if (path_len >= (int)sizeof(path))
+    {
+        return -1;
+    }
+
+    if (source->snapshot != NULL)
+    {
+        size_t num_entries;
+        size_t first = find_sysfs_snapshot_entries(source->snapshot, path, &num_entries);
+        for (size_t i = first; i < first + num_entries; i++)
+        {
+            const struct sysfs_snapshot_entry* entry = &source->snapshot->entries[i];
+            *hash = hash_file(*hash, entry->key + path_len, entry->value);
+        }
+        return 0;
+    }
+
+    int format_fd = openat(source->fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (format_fd == -1)
+    {
+        /* Devices without formats, e.g. "software" */
+        return errno == ENOENT ? 0 : -1;
+    }
+    char** formats;
+    ssize_t num_formats = read_sorted_dir(format_fd, &formats);
+    for (ssize_t i = 0; i < num_formats; i++)
+    {
+        char* content = get_file_content_at(format_fd, formats[i]);
+        if (content != NULL)
+        {
+            *hash = hash_file(*hash, formats[i], content);
+            free(content);
+        }
+    }
+    free_sorted_dir(formats, num_formats);
+    close(format_fd);
+    return num_formats == -1 ? -1 : 0;
+}
+
+int hash_pmu_devices(uint64_t* hash)
+{
+    return hash_pmu_devices_from(NULL, hash);
+}
+
+int hash_pmu_devices_from(const struct pmu_sysfs* sysfs, uint64_t* hash)
+{
+    struct pmu_devices devices;
+    if (scan_pmu_devices(&devices, sysfs) == -1)
+    {
+        return -1;
+    }
+
+    /* The order of readdir() is unspecified, so the names are sorted first */
+    char** names = malloc(devices.num_names * sizeof(char*));
+    if (names == NULL)
+    {
+        free_pmu_devices(&devices);
+        return -1;
+    }
+    memcpy(names, devices.names, devices.num_names * sizeof(char*));
+    qsort(names, devices.num_names, sizeof(char*), cmp_strings);
+
+    /* The same files as in snapshots, so that a snapshot hashes like the captured devices */
+    int ret = 0;
+    *hash = HASH_DATA_INIT;
+    for (size_t i = 0; i < devices.num_names && ret == 0; i++)
+    {
+        *hash = hash_data(*hash, names[i], strlen(names[i]) + 1);
+        for (size_t x = 0; x < num_sysfs_device_files; x++)
+        {
+            char* content =
+                get_device_file_content(&devices.source, names[i], sysfs_device_files[x]);
+            if (content != NULL)
+            {
+                *hash = hash_file(*hash, sysfs_device_files[x], content);
+                free(content);
+            }
+        }
+        ret = hash_device_formats(&devices.source, names[i], hash);
+    }
+
+    free(names);
+    free_pmu_devices(&devices);
+    return ret;
+}
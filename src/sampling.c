@@ -0,0 +1,188 @@
+#include <pmu-events/pmu-events.h>
+#include <pmu-events/sampling.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int get_event_period(const struct pmu_event* ev, uint64_t* period)
+{
+    /*
+     * Unlike the other terms of event strings, which parse_assignment_list() reads as hex,
+     * the period is the decimal SampleAfterValue of the event
+     */
+    for (const char* term = ev->event; term != NULL && *term != '\0';)
+    {
+        if (strncmp(term, "period=", strlen("period=")) == 0)
+        {
+            const char* value = term + strlen("period=");
+            char* end;
+            *period = strtoull(value, &end, 10);
+            return end != value && (*end == '\0' || *end == ',') && *period != 0 ? 0 : -1;
+        }
+
+        term = strchr(term, ',');
+        term = term != NULL ? term + 1 : NULL;
+    }
+    return -1;
+}
+
+int gen_sampling_attr_for_event(const struct pmu_instance* pmu_instance,
+                                const struct pmu_event* ev, uint64_t period,
+                                struct perf_event_attr* attr)
+{
+    if (period == 0 && get_event_period(ev, &period) == -1)
+    {
+        return -1;
+    }
+    if (gen_attr_for_event(pmu_instance, ev, attr) == -1)
+    {
+        return -1;
+    }
+
+    attr->size = sizeof(*attr);
+    attr->sample_period = period;
+    attr->freq = 0;
+    attr->sample_type = SAMPLER_SAMPLE_TYPE;
+    return 0;
+}
+
+int open_sampler(struct sampler* sampler, const struct perf_event_attr* attr, pid_t pid, int cpu,
+                 size_t num_pages)
+{
+    memset(sampler, 0, sizeof(*sampler));
+    if (num_pages == 0 || (num_pages & (num_pages - 1)) != 0)
+    {
+        return -1;
+    }
+
+    struct perf_event_attr sampling_attr = *attr;
+    sampling_attr.size = sizeof(sampling_attr);
+    sampling_attr.sample_type = SAMPLER_SAMPLE_TYPE;
+    sampling_attr.read_format = 0;
+    sampling_attr.disabled = 1;
+    /* Only PERF_RECORD_SAMPLE and PERF_RECORD_LOST */
+    sampling_attr.sample_id_all = 0;
+    sampling_attr.mmap = 0;
+    sampling_attr.comm = 0;
+    sampling_attr.task = 0;
+
+    sampler->fd = syscall(SYS_perf_event_open, &sampling_attr, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+    if (sampler->fd == -1)
+    {
+        return -1;
+    }
+
+    /* The first page holds the perf_event_mmap_page, the others are the ring buffer */
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    sampler->mmap_len = (num_pages + 1) * page_size;
+    void* base = mmap(NULL, sampler->mmap_len, PROT_READ | PROT_WRITE, MAP_SHARED, sampler->fd, 0);
+    if (base == MAP_FAILED)
+    {
+        close(sampler->fd);
+        memset(sampler, 0, sizeof(*sampler));
+        return -1;
+    }
+    sampler->meta = base;
+    sampler->data = (const uint8_t*)base + page_size;
+    sampler->data_size = num_pages * page_size;
+    return 0;
+}
+
+void close_sampler(struct sampler* sampler)
+{
+    if (sampler->meta != NULL)
+    {
+        munmap(sampler->meta, sampler->mmap_len);
+        close(sampler->fd);
+    }
+    memset(sampler, 0, sizeof(*sampler));
+}
+
+int sampler_enable(const struct sampler* sampler)
+{
+    return ioctl(sampler->fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+int sampler_disable(const struct sampler* sampler)
+{
+    return ioctl(sampler->fd, PERF_EVENT_IOC_DISABLE, 0);
+}
+
+/*
+ * Copies "len" bytes at the position "pos" of the ring buffer of "sampler" to "dest",
+ * taking into account that they may wrap around the end of the buffer
+ */
+static void read_ring(const struct sampler* sampler, uint64_t pos, void* dest, size_t len)
+{
+    size_t offset = pos & (sampler->data_size - 1);
+    size_t first = sampler->data_size - offset < len ? sampler->data_size - offset : len;
+    memcpy(dest, sampler->data + offset, first);
+    memcpy((uint8_t*)dest + first, sampler->data, len - first);
+}
+
+/* The fields of SAMPLER_SAMPLE_TYPE in the record, every one padded to 8 bytes */
+_Static_assert(sizeof(struct sample_record) == 5 * sizeof(uint64_t) &&
+                   offsetof(struct sample_record, time) == 2 * sizeof(uint64_t) &&
+                   offsetof(struct sample_record, period) == 4 * sizeof(uint64_t),
+               "struct sample_record has to be laid out like a PERF_RECORD_SAMPLE");
+
+size_t sampler_consume(struct sampler* sampler, sample_callback callback, void* arg)
+{
+    /*
+     * data_head is written by the kernel; reading it with acquire semantics makes the records
+     * before it visible. Storing data_tail with release semantics tells the kernel it may
+     * overwrite the records only after they have been read.
+     */
+    uint64_t head = __atomic_load_n(&sampler->meta->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = sampler->meta->data_tail;
+
+    size_t num_samples = 0;
+    while (tail < head)
+    {
+        struct perf_event_header header;
+        read_ring(sampler, tail, &header, sizeof(header));
+        if (header.size < sizeof(header) || header.size > head - tail)
+        {
+            /* A corrupt record, drop everything up to the head */
+            tail = head;
+            break;
+        }
+
+        if (header.type == PERF_RECORD_SAMPLE &&
+            header.size >= sizeof(header) + sizeof(struct sample_record))
+        {
+            /* The sample is passed in place, unless it wraps around the end of the buffer */
+            size_t offset = (tail + sizeof(header)) & (sampler->data_size - 1);
+            struct sample_record wrapped;
+            const struct sample_record* sample =
+                (const struct sample_record*)(sampler->data + offset);
+            if (offset + sizeof(struct sample_record) > sampler->data_size)
+            {
+                read_ring(sampler, tail + sizeof(header), &wrapped, sizeof(wrapped));
+                sample = &wrapped;
+            }
+            callback(sample, arg);
+            num_samples++;
+        }
+        else if (header.type == PERF_RECORD_LOST &&
+                 header.size >= sizeof(header) + 2 * sizeof(uint64_t))
+        {
+            /* struct { header; u64 id; u64 lost; } */
+            uint64_t lost[2];
+            read_ring(sampler, tail + sizeof(header), lost, sizeof(lost));
+            sampler->num_lost += lost[1];
+        }
+
+        tail += header.size;
+    }
+
+    __atomic_store_n(&sampler->meta->data_tail, tail, __ATOMIC_RELEASE);
+    return num_samples;
+}
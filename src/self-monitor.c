@@ -0,0 +1,266 @@
+#include <pmu-events/pmu-events.h>
+#include <pmu-events/self-monitor.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * The user page protocol of perf_event_mmap_page: the kernel increments "lock" around
+ * every update of the page, so the reads between two equal values of it are consistent.
+ */
+#define compiler_barrier() __asm__ volatile("" ::: "memory")
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_USER_READ 1
+
+static uint64_t read_pmc(uint32_t counter)
+{
+    uint32_t low, high;
+    __asm__ volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+    return low | (uint64_t)high << 32;
+}
+
+static uint64_t read_timestamp(void)
+{
+    uint32_t low, high;
+    __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+    return low | (uint64_t)high << 32;
+}
+#elif defined(__aarch64__)
+#define HAVE_USER_READ 1
+
+/*
+ * Counter 31 is the cycle counter, the others are read through the event counter
+ * selected by PMSELR_EL0
+ */
+static uint64_t read_pmc(uint32_t counter)
+{
+    uint64_t value;
+    if (counter == 31)
+    {
+        __asm__ volatile("mrs %0, pmccntr_el0" : "=r"(value));
+    }
+    else
+    {
+        __asm__ volatile("msr pmselr_el0, %1\n\t"
+                         "isb\n\t"
+                         "mrs %0, pmxevcntr_el0"
+                         : "=r"(value)
+                         : "r"((uint64_t)counter));
+    }
+    return value;
+}
+
+static uint64_t read_timestamp(void)
+{
+    uint64_t value;
+    __asm__ volatile("isb\n\t"
+                     "mrs %0, cntvct_el0"
+                     : "=r"(value));
+    return value;
+}
+#else
+#define HAVE_USER_READ 0
+#endif
+
+void init_self_monitor(struct self_monitor* monitor)
+{
+    memset(monitor, 0, sizeof(*monitor));
+}
+
+void free_self_monitor(struct self_monitor* monitor)
+{
+    for (size_t i = 0; i < monitor->num_events; i++)
+    {
+        munmap(monitor->events[i].page, sysconf(_SC_PAGESIZE));
+        close(monitor->events[i].fd);
+        free(monitor->events[i].name);
+    }
+    free(monitor->events);
+    free(monitor->start);
+    init_self_monitor(monitor);
+}
+
+int self_monitor_add_attr(struct self_monitor* monitor, const struct perf_event_attr* attr,
+                          const char* name)
+{
+    struct self_monitor_event* events =
+        realloc(monitor->events, (monitor->num_events + 1) * sizeof(*events));
+    if (events == NULL)
+    {
+        return -1;
+    }
+    monitor->events = events;
+    struct event_count* start =
+        realloc(monitor->start, (monitor->num_events + 1) * sizeof(*start));
+    if (start == NULL)
+    {
+        return -1;
+    }
+    monitor->start = start;
+
+    struct perf_event_attr monitor_attr = *attr;
+    monitor_attr.size = sizeof(monitor_attr);
+    monitor_attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    monitor_attr.disabled = 0;
+
+    struct self_monitor_event* ev = &monitor->events[monitor->num_events];
+    ev->fd = syscall(SYS_perf_event_open, &monitor_attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (ev->fd == -1)
+    {
+        return -1;
+    }
+    /* Only the user page, without a ring buffer */
+    ev->page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, ev->fd, 0);
+    ev->name = strdup(name);
+    if (ev->page == MAP_FAILED || ev->name == NULL)
+    {
+        if (ev->page != MAP_FAILED)
+        {
+            munmap(ev->page, sysconf(_SC_PAGESIZE));
+        }
+        free(ev->name);
+        close(ev->fd);
+        return -1;
+    }
+    return monitor->num_events++;
+}
+
+int self_monitor_add_event(struct self_monitor* monitor, const struct pmu_instance* pmu_instance,
+                           const char* name)
+{
+    struct pmu_event ev;
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    if (get_event_by_name(pmu_instance, name, &ev) == -1 ||
+        gen_attr_for_event(pmu_instance, &ev, &attr) == -1)
+    {
+        return -1;
+    }
+
+    const struct pmu_format* rdpmc = find_pmu_format(pmu_instance, "rdpmc");
+    if (rdpmc != NULL && apply_config_def_to_attr(&attr, 1, &rdpmc->def) == -1)
+    {
+        return -1;
+    }
+    return self_monitor_add_attr(monitor, &attr, name);
+}
+
+bool self_monitor_user_read(const struct self_monitor* monitor, size_t i)
+{
+    const volatile struct perf_event_mmap_page* page = monitor->events[i].page;
+    return HAVE_USER_READ && page->cap_user_rdpmc && page->cap_user_time && page->index != 0;
+}
+
+/*
+ * Reads the event "ev" through its user page, see the comment of perf_event_mmap_page
+ * in <linux/perf_event.h>
+ *
+ * Returns 0 on success, -1 if the counter can not be read from user space right now,
+ * e.g. because it is not scheduled on a counter
+ */
+static int read_user_page(const struct self_monitor_event* ev, struct event_count* count)
+{
+#if HAVE_USER_READ
+    const volatile struct perf_event_mmap_page* page = ev->page;
+    uint32_t seq;
+    do
+    {
+        seq = page->lock;
+        compiler_barrier();
+
+        uint32_t index = page->index;
+        uint16_t width = page->pmc_width;
+        if (!page->cap_user_rdpmc || !page->cap_user_time || index == 0 || width == 0)
+        {
+            return -1;
+        }
+
+        uint64_t enabled = page->time_enabled;
+        uint64_t running = page->time_running;
+        uint64_t cycles = read_timestamp();
+        uint16_t time_shift = page->time_shift;
+        uint32_t time_mult = page->time_mult;
+        uint64_t time_offset = page->time_offset;
+        if (page->cap_user_time_short)
+        {
+            /* The counter behind the times is narrower than the timestamp, e.g. on arm64 */
+            uint64_t time_cycles = page->time_cycles;
+            cycles = time_cycles + ((cycles - time_cycles) & page->time_mask);
+        }
+
+        int64_t value = page->offset;
+        int64_t pmc = read_pmc(index - 1);
+        /* Sign extend the counter from its width */
+        pmc = (int64_t)((uint64_t)pmc << (64 - width)) >> (64 - width);
+        value += pmc;
+
+        /* The time since the times of the page were updated */
+        uint64_t quot = cycles >> time_shift;
+        uint64_t rem = cycles & ((UINT64_C(1) << time_shift) - 1);
+        uint64_t delta = time_offset + quot * time_mult + ((rem * time_mult) >> time_shift);
+
+        count->value = value;
+        count->time_enabled = enabled + delta;
+        count->time_running = running + delta;
+        compiler_barrier();
+    } while (page->lock != seq);
+    return 0;
+#else
+    (void)ev;
+    (void)count;
+    return -1;
+#endif
+}
+
+int self_monitor_read(const struct self_monitor* monitor, size_t i, struct event_count* count)
+{
+    const struct self_monitor_event* ev = &monitor->events[i];
+    if (read_user_page(ev, count) == 0)
+    {
+        return 0;
+    }
+
+    /* value, time_enabled, time_running */
+    uint64_t buf[3];
+    if (read(ev->fd, buf, sizeof(buf)) != sizeof(buf))
+    {
+        return -1;
+    }
+    count->value = buf[0];
+    count->time_enabled = buf[1];
+    count->time_running = buf[2];
+    return 0;
+}
+
+int self_monitor_begin(struct self_monitor* monitor)
+{
+    for (size_t i = 0; i < monitor->num_events; i++)
+    {
+        if (self_monitor_read(monitor, i, &monitor->start[i]) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int self_monitor_end(const struct self_monitor* monitor, struct event_delta* deltas)
+{
+    /* In reverse, so that the events read first at the beginning are read last at the end */
+    for (size_t i = monitor->num_events; i-- > 0;)
+    {
+        struct event_count count;
+        if (self_monitor_read(monitor, i, &count) == -1)
+        {
+            return -1;
+        }
+        compute_event_delta(&monitor->start[i], &count, &deltas[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,423 @@
+#include <pmu-events/pmu-events.h>
+#include <pmu-events/sysfs.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+/*
+ * A snapshot file is a text file starting with SNAPSHOT_HEADER, followed by one
+ * "[key] [value]" line per entry, e.g.
+ *
+ *   pmu-events-sysfs-snapshot 1
+ *   cpuid.0 GenuineIntel-6-55-4
+ *   online_cpus 8
+ *   uname.release 6.8.0
+ *   cpu/format/umask config:8-15
+ *   cpu/type 4
+ *
+ * The keys of the device entries are the paths of the files relative to the devices
+ * directory. Values are single lines, like the files of the devices.
+ */
+#define SNAPSHOT_HEADER "pmu-events-sysfs-snapshot 1"
+
+const char* const sysfs_device_files[] = { "type", "cpus", "cpumask", "identifier" };
+const size_t num_sysfs_device_files = sizeof(sysfs_device_files) / sizeof(sysfs_device_files[0]);
+
+static int cmp_strings(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+void free_sorted_dir(char** names, ssize_t num_names)
+{
+    for (ssize_t i = 0; i < num_names; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+}
+
+ssize_t read_sorted_dir(int dir_fd, char*** names)
+{
+    *names = NULL;
+    int fd = dup(dir_fd);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    DIR* dir = fdopendir(fd);
+    if (dir == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+
+    size_t num_names = 0;
+    struct dirent* dp;
+    while ((dp = readdir(dir)) != NULL)
+    {
+        if (strcmp(".", dp->d_name) == 0 || strcmp("..", dp->d_name) == 0)
+        {
+            continue;
+        }
+
+        char** tmp = realloc(*names, sizeof(char*) * (num_names + 1));
+        if (tmp != NULL)
+        {
+            *names = tmp;
+            tmp[num_names] = strdup(dp->d_name);
+        }
+        if (tmp == NULL || tmp[num_names] == NULL)
+        {
+            free_sorted_dir(*names, num_names);
+            *names = NULL;
+            closedir(dir);
+            return -1;
+        }
+        num_names++;
+    }
+    closedir(dir);
+
+    qsort(*names, num_names, sizeof(char*), cmp_strings);
+    return num_names;
+}
+
+/*
+ * Writes the line for "key" with the content of the file "path" relative to "dir_fd",
+ * if there is such a file
+ */
+static void write_file_entry(FILE* file, int dir_fd, const char* path, const char* key)
+{
+    char* content = get_file_content_at(dir_fd, path);
+    if (content != NULL)
+    {
+        fprintf(file, "%s %s\n", key, content);
+        free(content);
+    }
+}
+
+/*
+ * Writes the CPU identifier of "cpu", unless it was already written according to "written"
+ */
+static void write_cpuid_entry(FILE* file, int cpu, bool* written, size_t num_written)
+{
+    if (cpu < 0 || (size_t)cpu >= num_written || written[cpu])
+    {
+        return;
+    }
+    written[cpu] = true;
+
+    struct perf_cpu perf_cpu = { .cpu = cpu };
+    char* cpuid = get_cpuid_allow_env_override(perf_cpu);
+    if (cpuid != NULL)
+    {
+        fprintf(file, "cpuid.%d %s\n", cpu, cpuid);
+        free(cpuid);
+    }
+}
+
+/*
+ * Writes the entries of all devices in "devices_fd" and of this system to "file"
+ */
+static int write_snapshot_entries(FILE* file, int devices_fd)
+{
+    long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (num_cpus < 1)
+    {
+        num_cpus = 1;
+    }
+    bool* cpuid_written = calloc(num_cpus, sizeof(bool));
+    if (cpuid_written == NULL)
+    {
+        return -1;
+    }
+
+    fprintf(file, "%s\n", SNAPSHOT_HEADER);
+    struct utsname uts;
+    if (uname(&uts) == 0)
+    {
+        fprintf(file, "uname.release %s\n", uts.release);
+        fprintf(file, "uname.version %s\n", uts.version);
+        fprintf(file, "uname.machine %s\n", uts.machine);
+    }
+    fprintf(file, "online_cpus %ld\n", sysconf(_SC_NPROCESSORS_ONLN));
+    write_cpuid_entry(file, 0, cpuid_written, num_cpus);
+
+    char** devices;
+    ssize_t num_devices = read_sorted_dir(devices_fd, &devices);
+    if (num_devices == -1)
+    {
+        free(cpuid_written);
+        return -1;
+    }
+
+    int ret = 0;
+    char path[PATH_MAX];
+    for (ssize_t i = 0; i < num_devices && ret == 0; i++)
+    {
+        for (size_t x = 0; x < num_sysfs_device_files; x++)
+        {
+            snprintf(path, sizeof(path), "%s/%s", devices[i], sysfs_device_files[x]);
+            write_file_entry(file, devices_fd, path, path);
+        }
+
+        /* Heterogeneous systems have a core PMU per kind of core, see attach_core_events() */
+        snprintf(path, sizeof(path), "%s/cpus", devices[i]);
+        char* cpus = get_file_content_at(devices_fd, path);
+        if (cpus != NULL)
+        {
+            write_cpuid_entry(file, atoi(cpus), cpuid_written, num_cpus);
+            free(cpus);
+        }
+
+        snprintf(path, sizeof(path), "%s/format", devices[i]);
+        int format_fd = openat(devices_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (format_fd == -1)
+        {
+            continue;
+        }
+        char** formats;
+        ssize_t num_formats = read_sorted_dir(format_fd, &formats);
+        for (ssize_t x = 0; x < num_formats; x++)
+        {
+            snprintf(path, sizeof(path), "%s/format/%s", devices[i], formats[x]);
+            write_file_entry(file, format_fd, formats[x], path);
+        }
+        free_sorted_dir(formats, num_formats);
+        close(format_fd);
+        ret = num_formats == -1 ? -1 : 0;
+    }
+
+    free_sorted_dir(devices, num_devices);
+    free(cpuid_written);
+    return ret;
+}
+
+int write_sysfs_snapshot(const char* root, const char* path)
+{
+    int devices_fd =
+        open(root != NULL ? root : pmu_devices_base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (devices_fd == -1)
+    {
+        return -1;
+    }
+
+    /* Write to a temporary file and rename it, so that readers never see a partial file */
+    size_t tmp_path_len = strlen(path) + 32;
+    char* tmp_path = malloc(tmp_path_len);
+    if (tmp_path == NULL)
+    {
+        close(devices_fd);
+        return -1;
+    }
+    snprintf(tmp_path, tmp_path_len, "%s.%ld.tmp", path, (long)getpid());
+
+    int ret = -1;
+    FILE* file = fopen(tmp_path, "w");
+    if (file != NULL)
+    {
+        ret = write_snapshot_entries(file, devices_fd);
+        if (ferror(file))
+        {
+            ret = -1;
+        }
+        if (fclose(file) != 0)
+        {
+            ret = -1;
+        }
+        if (ret == 0 && rename(tmp_path, path) == -1)
+        {
+            ret = -1;
+        }
+        if (ret == -1)
+        {
+            unlink(tmp_path);
+        }
+    }
+
+    free(tmp_path);
+    close(devices_fd);
+    return ret;
+}
+
+static int cmp_entries(const void* a, const void* b)
+{
+    const struct sysfs_snapshot_entry *lhs = a, *rhs = b;
+    return strcmp(lhs->key, rhs->key);
+}
+
+/*
+ * Splits the lines of snapshot->data into snapshot->entries
+ */
+static int parse_snapshot(struct sysfs_snapshot* snapshot)
+{
+    char* line = snapshot->data;
+    char* next = strchr(line, '\n');
+    if (next == NULL || (size_t)(next - line) != strlen(SNAPSHOT_HEADER) ||
+        strncmp(line, SNAPSHOT_HEADER, strlen(SNAPSHOT_HEADER)) != 0)
+    {
+        return -1;
+    }
+
+    size_t num_lines = 0;
+    for (const char* cur = next + 1; (cur = strchr(cur, '\n')) != NULL; cur++)
+    {
+        num_lines++;
+    }
+    snapshot->entries = malloc((num_lines + 1) * sizeof(struct sysfs_snapshot_entry));
+    if (snapshot->entries == NULL)
+    {
+        return -1;
+    }
+
+    for (line = next + 1; *line != '\0'; line = next + 1)
+    {
+        next = strchr(line, '\n');
+        if (next == NULL)
+        {
+            /* The last line is not terminated */
+            next = line + strlen(line) - 1;
+        }
+        else
+        {
+            *next = '\0';
+        }
+        if (*line == '\0')
+        {
+            continue;
+        }
+
+        char* space = strchr(line, ' ');
+        if (space == NULL || space == line)
+        {
+            return -1;
+        }
+        *space = '\0';
+
+        struct sysfs_snapshot_entry* entry = &snapshot->entries[snapshot->num_entries++];
+        entry->key = line;
+        entry->value = space + 1;
+    }
+
+    qsort(snapshot->entries, snapshot->num_entries, sizeof(struct sysfs_snapshot_entry),
+          cmp_entries);
+    return 0;
+}
+
+int open_sysfs_snapshot(const char* path, struct sysfs_snapshot* snapshot)
+{
+    memset(snapshot, 0, sizeof(*snapshot));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    snapshot->data = malloc(st.st_size + 1);
+    if (snapshot->data == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+
+    size_t len = 0;
+    while (len < (size_t)st.st_size)
+    {
+        ssize_t ret = read(fd, snapshot->data + len, st.st_size - len);
+        if (ret <= 0)
+        {
+            break;
+        }
+        len += ret;
+    }
+    close(fd);
+    snapshot->data[len] = '\0';
+
+    if (len != (size_t)st.st_size || parse_snapshot(snapshot) == -1)
+    {
+        close_sysfs_snapshot(snapshot);
+        return -1;
+    }
+    return 0;
+}
+
+void close_sysfs_snapshot(struct sysfs_snapshot* snapshot)
+{
+    free(snapshot->entries);
+    free(snapshot->data);
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+size_t find_sysfs_snapshot_entries(const struct sysfs_snapshot* snapshot, const char* prefix,
+                                   size_t* num_entries)
+{
+    size_t prefix_len = strlen(prefix);
+    size_t low = 0;
+    size_t high = snapshot->num_entries;
+
+    /* The first entry not less than the prefix */
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (strcmp(snapshot->entries[mid].key, prefix) < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    size_t end = low;
+    while (end < snapshot->num_entries &&
+           strncmp(snapshot->entries[end].key, prefix, prefix_len) == 0)
+    {
+        end++;
+    }
+    *num_entries = end - low;
+    return low;
+}
+
+const char* get_sysfs_snapshot_value(const struct sysfs_snapshot* snapshot, const char* key)
+{
+    struct sysfs_snapshot_entry entry = { .key = key };
+    const struct sysfs_snapshot_entry* found =
+        bsearch(&entry, snapshot->entries, snapshot->num_entries,
+                sizeof(struct sysfs_snapshot_entry), cmp_entries);
+    return found != NULL ? found->value : NULL;
+}
+
+char* get_sysfs_cpuid(const struct pmu_sysfs* sysfs, struct perf_cpu cpu)
+{
+    if (sysfs == NULL || sysfs->snapshot == NULL)
+    {
+        return get_cpuid_allow_env_override(cpu);
+    }
+
+    char key[32];
+    snprintf(key, sizeof(key), "cpuid.%d", cpu.cpu);
+    const char* cpuid = get_sysfs_snapshot_value(sysfs->snapshot, key);
+    if (cpuid == NULL)
+    {
+        cpuid = get_sysfs_snapshot_value(sysfs->snapshot, "cpuid.0");
+    }
+    return cpuid != NULL ? strdup(cpuid) : NULL;
+}
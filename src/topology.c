@@ -0,0 +1,233 @@
+#include <pmu-events/topology.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CPU_TOPOLOGY_BASE "/sys/devices/system/cpu"
+
+/*
+ * Reads the integer in the file "path" relative to "dir_fd" into "value"
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int read_int_at(int dir_fd, const char* path, int* value)
+{
+    char* content = get_file_content_at(dir_fd, path);
+    if (content == NULL)
+    {
+        return -1;
+    }
+
+    char* end;
+    long num = strtol(content, &end, 10);
+    int ret = end == content ? -1 : 0;
+    *value = num;
+    free(content);
+    return ret;
+}
+
+/*
+ * Returns the number of the NUMA node of the CPU directory "cpu_dir", e.g. 1 for a
+ * "node1" link in it, or 0 if there is none (systems without NUMA)
+ */
+static int read_cpu_node(int dir_fd, const char* cpu_dir)
+{
+    int fd = openat(dir_fd, cpu_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return 0;
+    }
+    DIR* dir = fdopendir(fd);
+    if (dir == NULL)
+    {
+        close(fd);
+        return 0;
+    }
+
+    int node = 0;
+    struct dirent* dp;
+    while ((dp = readdir(dir)) != NULL)
+    {
+        char* end;
+        if (strncmp(dp->d_name, "node", strlen("node")) == 0)
+        {
+            long num = strtol(dp->d_name + strlen("node"), &end, 10);
+            if (end != dp->d_name + strlen("node") && *end == '\0')
+            {
+                node = num;
+                break;
+            }
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/*
+ * Returns the dense id of "key" in "keys", appending it if it is not in there yet
+ */
+static int dense_id(long* keys, int* num_keys, long key)
+{
+    for (int i = 0; i < *num_keys; i++)
+    {
+        if (keys[i] == key)
+        {
+            return i;
+        }
+    }
+    keys[*num_keys] = key;
+    return (*num_keys)++;
+}
+
+int get_cpu_topology_from(const char* root, struct cpu_topology* topology)
+{
+    memset(topology, 0, sizeof(*topology));
+
+    int dir_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+    {
+        return -1;
+    }
+
+    struct range_list online;
+    char* content = get_file_content_at(dir_fd, "online");
+    if (content == NULL || parse_range_list(content, &online) == -1 || online.len == 0)
+    {
+        free(content);
+        close(dir_fd);
+        return -1;
+    }
+    free(content);
+
+    int num_cpus = online.ranges[online.len - 1].end + 1;
+    topology->num_cpus = num_cpus;
+    topology->core = malloc(num_cpus * sizeof(int));
+    topology->package = malloc(num_cpus * sizeof(int));
+    topology->node = malloc(num_cpus * sizeof(int));
+    long* packages = malloc(num_cpus * sizeof(long));
+    long* cores = malloc(num_cpus * sizeof(long));
+    long* nodes = malloc(num_cpus * sizeof(long));
+
+    int ret = -1;
+    if (topology->core == NULL || topology->package == NULL || topology->node == NULL ||
+        packages == NULL || cores == NULL || nodes == NULL)
+    {
+        goto out;
+    }
+    for (int cpu = 0; cpu < num_cpus; cpu++)
+    {
+        topology->core[cpu] = topology->package[cpu] = topology->node[cpu] = -1;
+    }
+
+    for (size_t i = 0; i < online.len; i++)
+    {
+        for (uint64_t cpu = online.ranges[i].start; cpu <= online.ranges[i].end; cpu++)
+        {
+            char path[64];
+            int package_id, core_id;
+            snprintf(path, sizeof(path), "cpu%lu/topology/physical_package_id", cpu);
+            if (read_int_at(dir_fd, path, &package_id) == -1)
+            {
+                goto out;
+            }
+            snprintf(path, sizeof(path), "cpu%lu/topology/core_id", cpu);
+            if (read_int_at(dir_fd, path, &core_id) == -1)
+            {
+                goto out;
+            }
+            snprintf(path, sizeof(path), "cpu%lu", cpu);
+            int node_id = read_cpu_node(dir_fd, path);
+
+            int package = dense_id(packages, &topology->num_packages, package_id);
+            topology->package[cpu] = package;
+            /* The core ids of sysfs are only unique within a package */
+            topology->core[cpu] =
+                dense_id(cores, &topology->num_cores, (long)package << 32 | (unsigned)core_id);
+            topology->node[cpu] = dense_id(nodes, &topology->num_nodes, node_id);
+        }
+    }
+    ret = 0;
+
+out:
+    if (ret == -1)
+    {
+        free_cpu_topology(topology);
+    }
+    free(packages);
+    free(cores);
+    free(nodes);
+    free_range_list(&online);
+    close(dir_fd);
+    return ret;
+}
+
+int get_cpu_topology(struct cpu_topology* topology)
+{
+    return get_cpu_topology_from(CPU_TOPOLOGY_BASE, topology);
+}
+
+void free_cpu_topology(struct cpu_topology* topology)
+{
+    free(topology->core);
+    free(topology->package);
+    free(topology->node);
+    memset(topology, 0, sizeof(*topology));
+}
+
+int get_aggr_id(const struct cpu_topology* topology, int cpu, enum aggr_level level)
+{
+    if (cpu < 0 || cpu >= topology->num_cpus || topology->core[cpu] == -1)
+    {
+        return -1;
+    }
+
+    switch (level)
+    {
+    case AGGR_CPU:
+        return cpu;
+    case AGGR_CORE:
+        return topology->core[cpu];
+    case AGGR_PACKAGE:
+        return topology->package[cpu];
+    case AGGR_NODE:
+        return topology->node[cpu];
+    default:
+        return 0;
+    }
+}
+
+int get_num_aggr_ids(const struct cpu_topology* topology, enum aggr_level level)
+{
+    switch (level)
+    {
+    case AGGR_CPU:
+        return topology->num_cpus;
+    case AGGR_CORE:
+        return topology->num_cores;
+    case AGGR_PACKAGE:
+        return topology->num_packages;
+    case AGGR_NODE:
+        return topology->num_nodes;
+    default:
+        return 1;
+    }
+}
+
+enum aggr_level get_metric_aggr_level(const struct pmu_metric* metric)
+{
+    switch (metric->aggr_mode)
+    {
+    case PerChip:
+        return AGGR_PACKAGE;
+    case PerCore:
+        return AGGR_CORE;
+    default:
+        return AGGR_SYSTEM;
+    }
+}
@@ -1,9 +1,36 @@
 #include <pmu-events/_impl/pmu-events.h>
+#include <pmu-events/attr-cache.h>
+#include <pmu-events/event-parser.h>
+#include <pmu-events/event-set.h>
+#include <pmu-events/metric.h>
 #include <pmu-events/pmu-events.h>
+#include <pmu-events/sampling.h>
+#include <pmu-events/self-monitor.h>
+#include <pmu-events/sysfs.h>
+#include <pmu-events/topology.h>
 
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * A CPU identifier with a known event table, to test the tables without
+ * depending on the CPU the tests run on.
+ */
+#ifdef __x86_64__
+#define TEST_CPUID "GenuineIntel-6-55-4"
+#elif __aarch64__
+#define TEST_CPUID "0x00000000410fd0c0"
+#endif
 
 /*
  * catch2 for poor people
@@ -18,6 +45,113 @@
         return -1;                                                                                 \
     }
 
+#define MAP_THREADS 4
+#define MAP_CPUS 64
+
+/*
+ * Resolves the maps of the CPUs -1 to MAP_CPUS - 2 into "arg"
+ */
+static void* resolve_maps(void* arg)
+{
+    const struct pmu_events_map** maps = arg;
+    for (int i = 0; i < MAP_CPUS; i++)
+    {
+        struct perf_cpu cpu = { .cpu = i - 1 };
+        maps[i] = map_for_cpu(cpu);
+    }
+    return NULL;
+}
+
+/*
+ * Counts the samples of sampler_consume() in "arg", checking that they are from this thread
+ */
+static void count_sample(const struct sample_record* sample, void* arg)
+{
+    size_t* num_samples = arg;
+    if (sample->tid == (uint32_t)syscall(SYS_gettid) && sample->period == 100000)
+    {
+        (*num_samples)++;
+    }
+}
+
+/*
+ * Creates the file "path" in the directory "dir" with "content", creating the
+ * directories of "path" as needed
+ */
+static int write_test_file(const char* dir, const char* path, const char* content)
+{
+    char full_path[256];
+    snprintf(full_path, sizeof(full_path), "%s/%s", dir, path);
+    for (char* slash = strchr(full_path + strlen(dir) + 1, '/'); slash != NULL;
+         slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        mkdir(full_path, 0700);
+        *slash = '/';
+    }
+
+    FILE* file = fopen(full_path, "w");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    fprintf(file, "%s\n", content);
+    return fclose(file);
+}
+
+/*
+ * Sets up "instance" as a PMU instance of the perf type "type" with the single format
+ * "event", defined by "def" and stored in "format", which the caller frees with
+ * free_config_def(&format->def)
+ *
+ * Returns 0 on success, -1 if "def" is malformed
+ */
+static int make_test_instance(int type, const char* def, struct pmu_format* format,
+                              struct pmu_instance* instance)
+{
+    memset(instance, 0, sizeof(*instance));
+    format->name = "event";
+    if (parse_config_def(def, &format->def) == -1)
+    {
+        return -1;
+    }
+    instance->type = type;
+    instance->formats = format;
+    instance->num_formats = 1;
+    return 0;
+}
+
+/*
+ * identifier_match() with "compat" compiled like for the SoC tables, false if it does not
+ * compile
+ */
+static bool test_identifier_match(const char* compat, const char* identifier)
+{
+    regex_t re;
+    if (regcomp(&re, compat, REG_EXTENDED) != 0)
+    {
+        return false;
+    }
+    bool match = identifier_match(&re, identifier);
+    regfree(&re);
+    return match;
+}
+
+static const struct pmu_instance* find_test_instance(const struct pmus* pmus, const char* name)
+{
+    for (size_t i = 0; i < pmus->num_classes; i++)
+    {
+        for (int x = 0; x < pmus->classes[i].num_instances; x++)
+        {
+            if (strcmp(pmus->classes[i].instances[x].name, name) == 0)
+            {
+                return &pmus->classes[i].instances[x];
+            }
+        }
+    }
+    return NULL;
+}
+
 int main(void)
 {
     char* test_name;
@@ -87,6 +221,43 @@ int main(void)
         REQUIRE(parse_config_def("config3:1,7-9", &def) == -1);
     }
 
+    TEST_CASE("The arena parsers match the heap parsers");
+    {
+        char buf[256];
+        struct parse_arena arena;
+        init_parse_arena(&arena, buf, sizeof(buf));
+
+        struct range_list list;
+        REQUIRE(parse_range_list_arena("1,7-9", &list, &arena) == 0);
+        REQUIRE(list.len == 2 && (char*)list.ranges >= buf && (char*)list.ranges < buf + 256);
+        REQUIRE(list.ranges[0].start == 1 && list.ranges[0].end == 1);
+        REQUIRE(list.ranges[1].start == 7 && list.ranges[1].end == 9);
+        REQUIRE(parse_range_list_arena("1,,7-9", &list, &arena) == -1);
+
+        struct config_def def;
+        REQUIRE(parse_config_def_arena("config1:0-7,32-35", &def, &arena) == 0);
+        REQUIRE(def.var == CONFIG1 && def.range.len == 2 && def.range.ranges[1].end == 35);
+
+        struct assignment_list asn_list;
+        REQUIRE(parse_assignment_list_arena("event=0x3c,umask=None,cmask=2", &asn_list, &arena) ==
+                0);
+        REQUIRE(asn_list.len == 3);
+        REQUIRE(strcmp(asn_list.assignments[0].key, "event") == 0);
+        REQUIRE(asn_list.assignments[0].value == 0x3c);
+        REQUIRE(strcmp(asn_list.assignments[1].key, "umask") == 0);
+        REQUIRE(asn_list.assignments[1].value == 0);
+        REQUIRE(strcmp(asn_list.assignments[2].key, "cmask") == 0);
+        REQUIRE(asn_list.assignments[2].value == 2);
+        REQUIRE(parse_assignment_list_arena("event=0x3c,=1", &asn_list, &arena) == -1);
+        REQUIRE(parse_assignment_list_arena("event=0x3c,umask=", &asn_list, &arena) == -1);
+
+        /* An exhausted arena makes the parsers fail */
+        reset_parse_arena(&arena);
+        arena.size = 16;
+        REQUIRE(parse_range_list_arena("1,7-9", &list, &arena) == -1);
+        REQUIRE(parse_assignment_list_arena("event=0x3c", &asn_list, &arena) == -1);
+    }
+
     TEST_CASE("apply_range_list_to_val works");
     {
         struct range_list list;
@@ -134,6 +305,1411 @@ int main(void)
         free_config_def(&def);
     }
 
+    TEST_CASE("gen_attr_for_event uses the cached formats");
+    {
+        struct pmu_format formats[2];
+        formats[0].name = "event";
+        REQUIRE(parse_config_def("config:0-7", &formats[0].def) != -1);
+        formats[1].name = "umask";
+        REQUIRE(parse_config_def("config:8-15", &formats[1].def) != -1);
+
+        struct pmu_instance instance = { 0 };
+        instance.type = 4;
+        instance.formats = formats;
+        instance.num_formats = 2;
+
+        REQUIRE(find_pmu_format(&instance, "umask") == &formats[1]);
+        REQUIRE(find_pmu_format(&instance, "cmask") == NULL);
+
+        struct pmu_event ev = { 0 };
+        ev.event = "event=0x3c,umask=0x1,period=2000003";
+
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        REQUIRE(gen_attr_for_event(&instance, &ev, &attr) == 0);
+        REQUIRE(attr.type == 4);
+        REQUIRE(attr.config == 0x13c);
+
+        ev.event = "event=0x3c,cmask=0x1";
+        REQUIRE(gen_attr_for_event(&instance, &ev, &attr) == -1);
+
+        instance.type = -1;
+        ev.event = "event=0x3c";
+        REQUIRE(gen_attr_for_event(&instance, &ev, &attr) == -1);
+
+        free_config_def(&formats[0].def);
+        free_config_def(&formats[1].def);
+    }
+
+    TEST_CASE("get_event_by_name finds every event of a table");
+    {
+        setenv("PERF_CPUID", TEST_CPUID, 1);
+        struct perf_cpu cpu = { .cpu = -1 };
+        const struct pmu_events_map* map = map_for_cpu(cpu);
+        unsetenv("PERF_CPUID");
+        REQUIRE(map != NULL);
+
+        for (uint32_t cur_pmu = 0; cur_pmu < map->event_table.num_pmus; cur_pmu++)
+        {
+            struct pmu_instance instance = { 0 };
+            instance.entries = map->event_table.pmus[cur_pmu].entries;
+            instance.num_entries = map->event_table.pmus[cur_pmu].num_entries;
+
+            for (uint32_t x = 0; x < instance.num_entries; x++)
+            {
+                struct pmu_event expected, found;
+                decompress_event(instance.entries[x].offset, &expected);
+                REQUIRE(get_event_by_name(&instance, expected.name, &found) == 0);
+                REQUIRE(found.name == expected.name);
+                REQUIRE(found.event == expected.event);
+            }
+
+            struct pmu_event ev;
+            REQUIRE(get_event_by_name(&instance, "", &ev) == -1);
+            REQUIRE(get_event_by_name(&instance, "not.an.event", &ev) == -1);
+        }
+    }
+
+    TEST_CASE("event_iter finds the same events as matching every name");
+    {
+        static const struct
+        {
+            const char* pattern;
+            enum event_match match;
+        } patterns[] = {
+            { "*", EVENT_MATCH_GLOB },
+            { "", EVENT_MATCH_PREFIX },
+            { "UNC_CHA_TOR_INSERTS.*", EVENT_MATCH_GLOB },
+            { "unc_cha_tor_inserts.ia_*", EVENT_MATCH_GLOB },
+            { "inst_retired.any", EVENT_MATCH_GLOB },
+            { "?nst_retired.*", EVENT_MATCH_GLOB },
+            { "*.any", EVENT_MATCH_GLOB },
+            { "l1d_cache*", EVENT_MATCH_GLOB },
+            { "unc_cha_", EVENT_MATCH_PREFIX },
+            { "l1d_cache", EVENT_MATCH_PREFIX },
+            { "not.an.event*", EVENT_MATCH_GLOB },
+        };
+
+        setenv("PERF_CPUID", TEST_CPUID, 1);
+        struct perf_cpu cpu = { .cpu = -1 };
+        const struct pmu_events_map* map = map_for_cpu(cpu);
+        unsetenv("PERF_CPUID");
+        REQUIRE(map != NULL);
+
+        size_t num_found = 0;
+        for (uint32_t cur_pmu = 0; cur_pmu < map->event_table.num_pmus; cur_pmu++)
+        {
+            struct pmu_instance instance = { 0 };
+            instance.entries = map->event_table.pmus[cur_pmu].entries;
+            instance.num_entries = map->event_table.pmus[cur_pmu].num_entries;
+
+            for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++)
+            {
+                char pattern[64];
+                size_t len = strlen(patterns[i].pattern);
+                for (size_t c = 0; c <= len; c++)
+                {
+                    pattern[c] = tolower((unsigned char)patterns[i].pattern[c]);
+                }
+
+                struct event_iter iter;
+                REQUIRE(init_event_iter(&iter, &instance, patterns[i].pattern,
+                                        patterns[i].match) == 0);
+                for (uint32_t x = 0; x < instance.num_entries; x++)
+                {
+                    const char* name = get_event_name(instance.entries[x]);
+                    bool matches = patterns[i].match == EVENT_MATCH_PREFIX
+                                       ? strncmp(name, pattern, len) == 0
+                                       : fnmatch(pattern, name, 0) == 0;
+                    if (!matches)
+                    {
+                        continue;
+                    }
+
+                    struct pmu_event ev;
+                    REQUIRE(next_event(&iter, &ev) == 0);
+                    REQUIRE(ev.name == name);
+                    num_found++;
+                }
+                struct pmu_event ev;
+                REQUIRE(next_event(&iter, &ev) == -1);
+                free_event_iter(&iter);
+            }
+        }
+        REQUIRE(num_found > 0);
+    }
+
+    TEST_CASE("filter_event_iter finds the events with the decompressed topics and flags");
+    {
+        setenv("PERF_CPUID", TEST_CPUID, 1);
+        struct perf_cpu cpu = { .cpu = -1 };
+        const struct pmu_events_map* map = map_for_cpu(cpu);
+        unsetenv("PERF_CPUID");
+        REQUIRE(map != NULL);
+
+        size_t num_found = 0;
+        for (uint32_t cur_pmu = 0; cur_pmu < map->event_table.num_pmus; cur_pmu++)
+        {
+            struct pmu_instance instance = { 0 };
+            instance.entries = map->event_table.pmus[cur_pmu].entries;
+            instance.num_entries = map->event_table.pmus[cur_pmu].num_entries;
+
+            const char* topics[64];
+            ssize_t num_topics = get_event_topics(&instance, topics, 64);
+            REQUIRE(num_topics > 0 && num_topics <= 64);
+
+            for (ssize_t i = 0; i < num_topics; i++)
+            {
+                /* The events of the topic which are not deprecated, but counted per package */
+                struct event_filter filter = { .topic = topics[i] };
+                filter.flags = EVENT_FLAG_PERPKG;
+                filter.flags_mask = EVENT_FLAG_DEPRECATED | EVENT_FLAG_PERPKG;
+
+                struct event_iter iter;
+                REQUIRE(init_event_iter(&iter, &instance, "", EVENT_MATCH_PREFIX) == 0);
+                filter_event_iter(&iter, &filter);
+                for (uint32_t x = 0; x < instance.num_entries; x++)
+                {
+                    struct pmu_event expected;
+                    decompress_event(instance.entries[x].offset, &expected);
+                    if (strcmp(expected.topic, topics[i]) != 0 || expected.deprecated ||
+                        !expected.perpkg)
+                    {
+                        continue;
+                    }
+
+                    struct pmu_event ev;
+                    REQUIRE(next_event(&iter, &ev) == 0);
+                    REQUIRE(ev.name == expected.name);
+                    num_found++;
+                }
+                struct pmu_event ev;
+                REQUIRE(next_event(&iter, &ev) == -1);
+                free_event_iter(&iter);
+            }
+
+            struct event_filter filter = { .topic = "not a topic" };
+            struct event_iter iter;
+            REQUIRE(init_event_iter(&iter, &instance, "", EVENT_MATCH_PREFIX) == 0);
+            filter_event_iter(&iter, &filter);
+            struct pmu_event ev;
+            REQUIRE(next_event(&iter, &ev) == -1);
+            free_event_iter(&iter);
+        }
+#ifdef __x86_64__
+        REQUIRE(num_found > 0);
+#endif
+    }
+
+    TEST_CASE("decompress_event_hot matches decompress_event without the cold fields");
+    {
+        setenv("PERF_CPUID", TEST_CPUID, 1);
+        struct perf_cpu cpu = { .cpu = -1 };
+        const struct pmu_events_map* map = map_for_cpu(cpu);
+        unsetenv("PERF_CPUID");
+        REQUIRE(map != NULL);
+
+        size_t num_described = 0;
+        for (uint32_t cur_pmu = 0; cur_pmu < map->event_table.num_pmus; cur_pmu++)
+        {
+            const struct pmu_table_entry* entry = &map->event_table.pmus[cur_pmu];
+            for (uint32_t x = 0; x < entry->num_entries; x++)
+            {
+                struct pmu_event full, hot;
+                decompress_event(entry->entries[x].offset, &full);
+                decompress_event_hot(entry->entries[x].offset, &hot);
+                REQUIRE(hot.name == full.name && hot.event == full.event);
+                REQUIRE(hot.unit == full.unit && hot.perpkg == full.perpkg);
+                REQUIRE(hot.compat == full.compat && hot.counters == full.counters);
+                REQUIRE(hot.desc == NULL || hot.desc == full.desc);
+                REQUIRE(hot.long_desc == NULL || hot.long_desc == full.long_desc);
+                if (full.desc != NULL && full.topic != NULL)
+                {
+                    num_described++;
+                }
+            }
+        }
+        REQUIRE(num_described > 0);
+    }
+
+    TEST_CASE("inflate_raw decodes stored and fixed Huffman blocks");
+    {
+        static const unsigned char stored[] = { 0x01, 0x03, 0x00, 0xfc, 0xff, 'a', 'b', 'c' };
+        static const unsigned char fixed[] = { 0x2b, 0xc8, 0x2d, 0xd5, 0x4d, 0x2d, 0x4b,
+                                               0xcd, 0x2b, 0x29, 0x56, 0x28, 0xc0, 0xc6,
+                                               0xe4, 0x2a, 0xa0, 0x58, 0x01, 0x00 };
+        const char* expected = "pmu-events pmu-events pmu-events\n"
+                               "pmu-events pmu-events pmu-events\n"
+                               "pmu-events pmu-events pmu-events\n";
+        char buf[128];
+
+        REQUIRE(inflate_raw(buf, 3, stored, sizeof(stored)) == 0);
+        REQUIRE(memcmp(buf, "abc", 3) == 0);
+        REQUIRE(inflate_raw(buf, strlen(expected), fixed, sizeof(fixed)) == 0);
+        REQUIRE(memcmp(buf, expected, strlen(expected)) == 0);
+
+        /* The output has to have exactly the expected length */
+        REQUIRE(inflate_raw(buf, strlen(expected) - 1, fixed, sizeof(fixed)) == -1);
+        REQUIRE(inflate_raw(buf, sizeof(buf), fixed, sizeof(fixed)) == -1);
+        REQUIRE(inflate_raw(buf, strlen(expected), fixed, sizeof(fixed) - 2) == -1);
+        REQUIRE(inflate_raw(buf, 3, stored, sizeof(stored) - 1) == -1);
+    }
+
+    TEST_CASE("map_for_cpu agrees across concurrent callers");
+    {
+        static const struct pmu_events_map* maps[MAP_THREADS][MAP_CPUS];
+        pthread_t threads[MAP_THREADS];
+        for (int i = 0; i < MAP_THREADS; i++)
+        {
+            REQUIRE(pthread_create(&threads[i], NULL, resolve_maps, maps[i]) == 0);
+        }
+        for (int i = 0; i < MAP_THREADS; i++)
+        {
+            REQUIRE(pthread_join(threads[i], NULL) == 0);
+        }
+
+        for (int i = 0; i < MAP_CPUS; i++)
+        {
+            for (int x = 1; x < MAP_THREADS; x++)
+            {
+                REQUIRE(maps[x][i] == maps[0][i]);
+            }
+        }
+
+        /* The override bypasses the shared table */
+        setenv("PERF_CPUID", TEST_CPUID, 1);
+        struct perf_cpu cpu = { .cpu = 0 };
+        const struct pmu_events_map* map = map_for_cpu(cpu);
+        unsetenv("PERF_CPUID");
+        REQUIRE(map != NULL);
+        REQUIRE(map_for_cpu(cpu) == maps[0][1]);
+    }
+
+    TEST_CASE("compile_metric_expr respects precedence and functions");
+    {
+        struct metric_expr expr;
+        REQUIRE(compile_metric_expr("1 + 2 * 3 - 8 / 4", &expr) != -1);
+        REQUIRE(expr.num_vars == 0);
+        REQUIRE(eval_metric_expr(&expr, NULL) == 5);
+        free_metric_expr(&expr);
+
+        REQUIRE(compile_metric_expr("-(1 + 2) * 1e2 + min(3, 4) + max(3, 4) + 7 % 4", &expr) != -1);
+        REQUIRE(eval_metric_expr(&expr, NULL) == -300 + 3 + 4 + 3);
+        free_metric_expr(&expr);
+
+        REQUIRE(compile_metric_expr("d_ratio(1, 0) + (1 > 0 & 2 < 1 | 1 ^ 0)", &expr) != -1);
+        REQUIRE(eval_metric_expr(&expr, NULL) == 1);
+        free_metric_expr(&expr);
+
+        REQUIRE(compile_metric_expr("1 / 0", &expr) != -1);
+        REQUIRE(isnan(eval_metric_expr(&expr, NULL)));
+        free_metric_expr(&expr);
+    }
+
+    TEST_CASE("compile_metric_expr collects variables");
+    {
+        struct metric_expr expr;
+        REQUIRE(compile_metric_expr("(INST_RETIRED.ANY / cpu@CYCLES\\,edge\\=1@ if #SMT_on else "
+                                    "source_count(INST_RETIRED.ANY)) + INST_RETIRED.ANY * 0",
+                                    &expr) != -1);
+        REQUIRE(expr.num_vars == 4);
+        REQUIRE(strcmp(expr.vars[0].name, "INST_RETIRED.ANY") == 0);
+        REQUIRE(expr.vars[0].kind == METRIC_VAR_EVENT);
+        REQUIRE(strcmp(expr.vars[1].name, "cpu/CYCLES,edge=1/") == 0);
+        REQUIRE(expr.vars[1].kind == METRIC_VAR_EVENT);
+        REQUIRE(strcmp(expr.vars[2].name, "#SMT_on") == 0);
+        REQUIRE(expr.vars[2].kind == METRIC_VAR_LITERAL);
+        REQUIRE(strcmp(expr.vars[3].name, "INST_RETIRED.ANY") == 0);
+        REQUIRE(expr.vars[3].kind == METRIC_VAR_SOURCE_COUNT);
+
+        double smt_on[] = { 10, 5, 1, 4 };
+        REQUIRE(eval_metric_expr(&expr, smt_on) == 2);
+        double smt_off[] = { 10, 5, 0, 4 };
+        REQUIRE(eval_metric_expr(&expr, smt_off) == 4);
+
+        double core_wide;
+        struct metric_var var = { .name = "#core_wide", .kind = METRIC_VAR_LITERAL };
+        REQUIRE(resolve_metric_var(&var, &core_wide) == 0);
+        REQUIRE(core_wide == 1);
+        REQUIRE(resolve_metric_var(&expr.vars[0], &core_wide) == -1);
+
+        free_metric_expr(&expr);
+    }
+
+    TEST_CASE("compile_metric_expr fails for garbage");
+    {
+        struct metric_expr expr;
+        REQUIRE(compile_metric_expr("", &expr) == -1);
+        REQUIRE(compile_metric_expr("1 +", &expr) == -1);
+        REQUIRE(compile_metric_expr("(1 + 2", &expr) == -1);
+        REQUIRE(compile_metric_expr("1 if 2", &expr) == -1);
+        REQUIRE(compile_metric_expr("min(1)", &expr) == -1);
+        REQUIRE(compile_metric_expr("1 $ 2", &expr) == -1);
+    }
+
+    TEST_CASE("compile_metric compiles every metric of a table");
+    {
+        setenv("PERF_CPUID", TEST_CPUID, 1);
+        struct perf_cpu cpu = { .cpu = -1 };
+        const struct pmu_events_map* map = map_for_cpu(cpu);
+        unsetenv("PERF_CPUID");
+        REQUIRE(map != NULL);
+        REQUIRE(map->metric_table.num_pmus != 0);
+
+        for (uint32_t cur_pmu = 0; cur_pmu < map->metric_table.num_pmus; cur_pmu++)
+        {
+            const struct pmu_table_entry* entry = &map->metric_table.pmus[cur_pmu];
+            for (uint32_t x = 0; x < entry->num_entries; x++)
+            {
+                struct pmu_metric pm;
+                decompress_metric(entry->entries[x].offset, &pm);
+
+                struct pmu_metric found;
+                REQUIRE(get_metric_by_name(&map->metric_table, pm.metric_name, &found) == 0);
+
+                struct metric_expr expr;
+                REQUIRE(compile_metric(&map->metric_table, &pm, &expr) == 0);
+                for (size_t var = 0; var < expr.num_vars; var++)
+                {
+                    struct pmu_metric referenced;
+                    REQUIRE(get_metric_by_name(&map->metric_table, expr.vars[var].name,
+                                               &referenced) == -1);
+                }
+                free_metric_expr(&expr);
+            }
+        }
+    }
+
+    TEST_CASE("compile_metric matches compile_metric_expr for metrics without references");
+    {
+        setenv("PERF_CPUID", TEST_CPUID, 1);
+        struct perf_cpu cpu = { .cpu = -1 };
+        const struct pmu_events_map* map = map_for_cpu(cpu);
+        unsetenv("PERF_CPUID");
+        REQUIRE(map != NULL);
+
+        for (uint32_t cur_pmu = 0; cur_pmu < map->metric_table.num_pmus; cur_pmu++)
+        {
+            const struct pmu_table_entry* entry = &map->metric_table.pmus[cur_pmu];
+            for (uint32_t x = 0; x < entry->num_entries; x++)
+            {
+                struct pmu_metric pm;
+                decompress_metric(entry->entries[x].offset, &pm);
+
+                struct metric_expr parsed;
+                REQUIRE(compile_metric_expr(pm.metric_expr, &parsed) == 0);
+                bool has_references = false;
+                for (size_t var = 0; var < parsed.num_vars; var++)
+                {
+                    struct pmu_metric referenced;
+                    has_references |= get_metric_by_name(&map->metric_table, parsed.vars[var].name,
+                                                         &referenced) == 0;
+                }
+
+                struct metric_expr compiled;
+                REQUIRE(compile_metric(&map->metric_table, &pm, &compiled) == 0);
+                if (!has_references)
+                {
+                    REQUIRE(compiled.num_insns == parsed.num_insns);
+                    for (size_t insn = 0; insn < parsed.num_insns; insn++)
+                    {
+                        REQUIRE(compiled.insns[insn].op == parsed.insns[insn].op);
+                        if (parsed.insns[insn].op == METRIC_OP_CONST)
+                        {
+                            REQUIRE(compiled.insns[insn].constant == parsed.insns[insn].constant);
+                        }
+                        if (parsed.insns[insn].op == METRIC_OP_VAR)
+                        {
+                            REQUIRE(compiled.insns[insn].var == parsed.insns[insn].var);
+                        }
+                    }
+                    REQUIRE(compiled.num_vars == parsed.num_vars);
+                    for (size_t var = 0; var < parsed.num_vars; var++)
+                    {
+                        REQUIRE(compiled.vars[var].kind == parsed.vars[var].kind);
+                        REQUIRE(strcmp(compiled.vars[var].name, parsed.vars[var].name) == 0);
+                    }
+                }
+                free_metric_expr(&parsed);
+                free_metric_expr(&compiled);
+            }
+        }
+    }
+
+    TEST_CASE("event_set reads groups of events");
+    {
+        REQUIRE(should_group_events(MetricGroupEvents));
+        REQUIRE(!should_group_events(MetricNoGroupEvents));
+
+        struct perf_event_attr attrs[2];
+        memset(attrs, 0, sizeof(attrs));
+        attrs[0].type = PERF_TYPE_SOFTWARE;
+        attrs[0].config = PERF_COUNT_SW_CPU_CLOCK;
+        attrs[1].type = PERF_TYPE_SOFTWARE;
+        attrs[1].config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+
+        struct event_set set;
+        init_event_set(&set);
+        REQUIRE(event_set_add_attrs(&set, attrs, 2, 0, MetricGroupEvents) == 0);
+        REQUIRE(event_set_add_attrs(&set, attrs, 2, 0, MetricNoGroupEvents) == 2);
+        REQUIRE(set.num_events == 4);
+        REQUIRE(set.num_groups == 3);
+        REQUIRE(set.groups[0].num_events == 2);
+
+        struct event_count counts[4];
+        REQUIRE(event_set_enable(&set) == 0);
+        usleep(10000);
+        REQUIRE(event_set_disable(&set) == 0);
+        REQUIRE(event_set_read(&set, counts) == 0);
+        REQUIRE(counts[0].value != 0 && counts[2].value != 0);
+        REQUIRE(counts[0].time_enabled == counts[1].time_enabled);
+        free_event_set(&set);
+        REQUIRE(set.num_events == 0);
+    }
+
+    TEST_CASE("compute_event_delta scales multiplexed and wrapped counts");
+    {
+        struct event_count prev = { .value = 100, .time_enabled = 1000, .time_running = 1000 };
+        struct event_count cur = { .value = 200, .time_enabled = 2000, .time_running = 1500 };
+        struct event_delta delta;
+
+        compute_event_delta(&prev, &cur, &delta);
+        REQUIRE(delta.raw == 100);
+        REQUIRE(delta.time_enabled == 1000 && delta.time_running == 500);
+        REQUIRE(fabs(delta.ratio - 0.5) < 1e-9);
+        REQUIRE(fabs(delta.value - 200) < 1e-9);
+
+        /* Not multiplexed */
+        cur.time_running = 2000;
+        compute_event_delta(&prev, &cur, &delta);
+        REQUIRE(delta.ratio == 1 && delta.value == 100);
+
+        /* Not scheduled at all */
+        cur.time_running = 1000;
+        compute_event_delta(&prev, &cur, &delta);
+        REQUIRE(delta.ratio == 0 && delta.value == 0);
+
+        /* A wrapped counter */
+        prev.value = UINT64_MAX - 9;
+        cur.value = 10;
+        cur.time_running = 2000;
+        compute_event_delta(&prev, &cur, &delta);
+        REQUIRE(delta.raw == 20 && delta.value == 20);
+    }
+
+    TEST_CASE("event_reader reads the changes of the counts");
+    {
+        struct perf_event_attr attrs[2];
+        memset(attrs, 0, sizeof(attrs));
+        attrs[0].type = PERF_TYPE_SOFTWARE;
+        attrs[0].config = PERF_COUNT_SW_CPU_CLOCK;
+        attrs[1].type = PERF_TYPE_SOFTWARE;
+        attrs[1].config = PERF_COUNT_SW_TASK_CLOCK;
+
+        struct event_set set;
+        init_event_set(&set);
+        REQUIRE(event_set_add_attrs(&set, attrs, 2, 0, MetricGroupEvents) == 0);
+
+        struct event_reader reader;
+        REQUIRE(init_event_reader(&reader, &set) == 0);
+        REQUIRE(event_set_enable(&set) == 0);
+        usleep(10000);
+        REQUIRE(event_reader_read(&reader) == 0);
+        REQUIRE(reader.deltas[0].raw != 0 && reader.deltas[0].ratio > 0);
+        REQUIRE(reader.deltas[0].raw == reader.counts[0].value);
+
+        usleep(10000);
+        REQUIRE(event_reader_read(&reader) == 0);
+        REQUIRE(reader.deltas[0].raw == reader.counts[0].value - reader.prev[0].value);
+        REQUIRE(reader.deltas[0].time_enabled ==
+                reader.counts[0].time_enabled - reader.prev[0].time_enabled);
+        REQUIRE(event_set_disable(&set) == 0);
+
+        /* The buffers do not fit a set with more events */
+        REQUIRE(event_set_add_attrs(&set, attrs, 1, 0, MetricNoGroupEvents) == 2);
+        REQUIRE(event_reader_read(&reader) == -1);
+
+        free_event_reader(&reader);
+        free_event_set(&set);
+    }
+
+    TEST_CASE("get_cpu_topology_from maps the CPUs to dense cores, packages and nodes");
+    {
+        char root[] = "/tmp/pmu-events-topology-XXXXXX";
+        REQUIRE(mkdtemp(root) != NULL);
+
+        /* 2 packages with 2 cores with 2 threads, CPU 3 is offline */
+        REQUIRE(write_test_file(root, "online", "0-2,4-7") == 0);
+        for (int cpu = 0; cpu < 8; cpu++)
+        {
+            char path[64], value[16];
+            snprintf(path, sizeof(path), "cpu%d/topology/physical_package_id", cpu);
+            snprintf(value, sizeof(value), "%d", cpu / 4);
+            REQUIRE(write_test_file(root, path, value) == 0);
+            snprintf(path, sizeof(path), "cpu%d/topology/core_id", cpu);
+            snprintf(value, sizeof(value), "%d", cpu % 4 / 2);
+            REQUIRE(write_test_file(root, path, value) == 0);
+            snprintf(path, sizeof(path), "cpu%d/node%d/cpulist", cpu, cpu / 4);
+            REQUIRE(write_test_file(root, path, "") == 0);
+        }
+
+        struct cpu_topology topology;
+        REQUIRE(get_cpu_topology_from(root, &topology) == 0);
+        REQUIRE(topology.num_cpus == 8);
+        REQUIRE(topology.num_packages == 2 && topology.num_nodes == 2);
+        REQUIRE(topology.num_cores == 4);
+        REQUIRE(get_aggr_id(&topology, 3, AGGR_CORE) == -1);
+        REQUIRE(get_aggr_id(&topology, 8, AGGR_PACKAGE) == -1);
+        REQUIRE(get_aggr_id(&topology, 0, AGGR_CORE) == get_aggr_id(&topology, 1, AGGR_CORE));
+        REQUIRE(get_aggr_id(&topology, 1, AGGR_CORE) != get_aggr_id(&topology, 2, AGGR_CORE));
+        REQUIRE(get_aggr_id(&topology, 0, AGGR_CORE) != get_aggr_id(&topology, 4, AGGR_CORE));
+        REQUIRE(get_aggr_id(&topology, 2, AGGR_PACKAGE) == 0);
+        REQUIRE(get_aggr_id(&topology, 7, AGGR_PACKAGE) == 1);
+        REQUIRE(get_aggr_id(&topology, 7, AGGR_NODE) == 1);
+        REQUIRE(get_aggr_id(&topology, 7, AGGR_SYSTEM) == 0);
+        REQUIRE(get_num_aggr_ids(&topology, AGGR_SYSTEM) == 1);
+
+        /* Per package sums of an event opened on CPUs 0, 2, 5 and 7 */
+        struct event_delta deltas[8] = { 0 };
+        for (int i = 0; i < 4; i++)
+        {
+            deltas[i * 2 + 1].value = 10 * (i + 1);
+        }
+        struct event_set set = { .cpus = (int[]){ 0, 0, 2, 2, 5, 5, 7, 7 }, .num_events = 8 };
+        double sums[2];
+        REQUIRE(aggregate_event_deltas(&set, deltas, 1, 2, 4, &topology, AGGR_PACKAGE, sums) ==
+                0);
+        REQUIRE(sums[0] == 30 && sums[1] == 70);
+        set.cpus[3] = 3;
+        REQUIRE(aggregate_event_deltas(&set, deltas, 1, 2, 4, &topology, AGGR_PACKAGE, sums) ==
+                -1);
+
+        struct pmu_metric metric = { .aggr_mode = PerChip };
+        REQUIRE(get_metric_aggr_level(&metric) == AGGR_PACKAGE);
+        metric.aggr_mode = PerCore;
+        REQUIRE(get_metric_aggr_level(&metric) == AGGR_CORE);
+        metric.aggr_mode = 0;
+        REQUIRE(get_metric_aggr_level(&metric) == AGGR_SYSTEM);
+
+        free_cpu_topology(&topology);
+        REQUIRE(write_test_file(root, "online", "") == 0);
+        REQUIRE(get_cpu_topology_from(root, &topology) == -1);
+
+        char cmd[64];
+        snprintf(cmd, sizeof(cmd), "rm -r %s", root);
+        REQUIRE(system(cmd) == 0);
+    }
+
+    TEST_CASE("event_set_add_events_topology opens perpkg events once per package");
+    {
+        struct cpu_topology topology;
+        REQUIRE(get_cpu_topology(&topology) == 0);
+
+        struct pmu_format format;
+        struct pmu_instance instance;
+        REQUIRE(make_test_instance(PERF_TYPE_SOFTWARE, "config:0-63", &format, &instance) == 0);
+        instance.name = "software";
+
+        /* CPU 0 twice, like an instance listing all CPUs of a package */
+        struct range ranges[] = { { .start = 0, .end = 0 }, { .start = 0, .end = 0 } };
+        instance.cpus.len = 2;
+        instance.cpus.ranges = ranges;
+
+        struct pmu_event ev = { .name = "cpu-clock", .event = "event=0", .perpkg = true };
+        struct event_set set;
+        init_event_set(&set);
+        size_t num_cpus;
+        REQUIRE(event_set_add_events_topology(&set, &instance, &ev, 1, MetricGroupEvents,
+                                              &topology, &num_cpus) == 0);
+        REQUIRE(num_cpus == 1 && set.num_events == 1 && set.cpus[0] == 0);
+
+        ev.perpkg = false;
+        REQUIRE(event_set_add_events_topology(&set, &instance, &ev, 1, MetricGroupEvents,
+                                              &topology, &num_cpus) == 1);
+        REQUIRE(num_cpus == 2 && set.num_events == 3);
+
+        /* Mixed lists would count the perpkg events on every CPU */
+        struct pmu_event mixed[2] = { ev, ev };
+        mixed[1].perpkg = true;
+        errno = 0;
+        REQUIRE(event_set_add_events_topology(&set, &instance, mixed, 2, MetricGroupEvents,
+                                              &topology, &num_cpus) == -1);
+        REQUIRE(errno == EINVAL && set.num_events == 3);
+        REQUIRE(event_set_add_events(&set, &instance, mixed, 2, MetricGroupEvents) == 3);
+
+        free_event_set(&set);
+        free_config_def(&format.def);
+        free_cpu_topology(&topology);
+    }
+
+    TEST_CASE("event_set_add_events_on_cpus opens the events with a pool of threads");
+    {
+        struct cpu_topology topology;
+        REQUIRE(get_cpu_topology(&topology) == 0);
+
+        struct pmu_format format;
+        struct pmu_instance instance;
+        REQUIRE(make_test_instance(PERF_TYPE_SOFTWARE, "config:0-63", &format, &instance) == 0);
+        instance.name = "software";
+
+        struct pmu_event evs[2] = { { .name = "cpu-clock", .event = "event=0" },
+                                    { .name = "task-clock", .event = "event=1" } };
+        int cpus[16] = { 0 };
+        int errors[16];
+        struct event_open_pool pool = { .num_threads = 4, .topology = &topology };
+
+        struct event_set set;
+        init_event_set(&set);
+        REQUIRE(event_set_add_attrs(&set, &(struct perf_event_attr){ .type = PERF_TYPE_SOFTWARE },
+                                    1, 0, MetricGroupEvents) == 0);
+        REQUIRE(event_set_add_events_on_cpus(&set, &instance, evs, 2, MetricGroupEvents, cpus, 16,
+                                             &pool, errors) == 1);
+        REQUIRE(set.num_events == 33 && set.num_groups == 17);
+        for (size_t n = 0; n < 16; n++)
+        {
+            REQUIRE(errors[n] == 0);
+            REQUIRE(set.cpus[1 + n * 2] == 0 && set.cpus[2 + n * 2] == 0);
+            REQUIRE(set.groups[1 + n].first == 1 + n * 2 && set.groups[1 + n].num_events == 2);
+        }
+
+        struct event_count counts[33];
+        REQUIRE(event_set_enable(&set) == 0);
+        REQUIRE(event_set_read(&set, counts) == 0);
+        REQUIRE(event_set_disable(&set) == 0);
+
+        /* A CPU which does not exist fails on its own, and no events are added */
+        cpus[5] = 1 << 20;
+        REQUIRE(event_set_add_events_on_cpus(&set, &instance, evs, 2, MetricNoGroupEvents, cpus,
+                                             16, &pool, errors) == -1);
+        REQUIRE(errors[5] != 0 && errors[4] == 0 && errors[6] == 0);
+        REQUIRE(set.num_events == 33 && set.num_groups == 17);
+
+        /* Without a pool, in the calling thread */
+        cpus[5] = 0;
+        REQUIRE(event_set_add_events_on_cpus(&set, &instance, evs, 2, MetricNoGroupEvents, cpus,
+                                             2, NULL, errors) == 33);
+        REQUIRE(set.num_events == 37 && set.num_groups == 21);
+
+        free_event_set(&set);
+        free_config_def(&format.def);
+        free_cpu_topology(&topology);
+    }
+
+    TEST_CASE("gen_sampling_attr_for_event uses the period of the event");
+    {
+        struct pmu_format format;
+        struct pmu_instance instance;
+        REQUIRE(make_test_instance(PERF_TYPE_RAW, "config:0-7", &format, &instance) == 0);
+
+        struct pmu_event ev = { .name = "cycles", .event = "event=0x3c,period=2000003" };
+        uint64_t period;
+        REQUIRE(get_event_period(&ev, &period) == 0 && period == 2000003);
+
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        REQUIRE(gen_sampling_attr_for_event(&instance, &ev, 0, &attr) == 0);
+        REQUIRE(attr.config == 0x3c && attr.sample_period == 2000003);
+        REQUIRE(attr.sample_type == SAMPLER_SAMPLE_TYPE);
+        REQUIRE(gen_sampling_attr_for_event(&instance, &ev, 1000, &attr) == 0);
+        REQUIRE(attr.sample_period == 1000);
+
+        /* The period is decimal, also with leading zeros */
+        ev.event = "period=0100,event=0x3c";
+        REQUIRE(get_event_period(&ev, &period) == 0 && period == 100);
+
+        /* Events without a period need one from the caller */
+        ev.event = "event=0x3c";
+        REQUIRE(get_event_period(&ev, &period) == -1);
+        REQUIRE(gen_sampling_attr_for_event(&instance, &ev, 0, &attr) == -1);
+        free_config_def(&format.def);
+
+        /* All periods of a table */
+        setenv("PERF_CPUID", TEST_CPUID, 1);
+        struct perf_cpu cpu = { .cpu = -1 };
+        const struct pmu_events_map* map = map_for_cpu(cpu);
+        unsetenv("PERF_CPUID");
+        REQUIRE(map != NULL);
+        size_t num_periods = 0;
+        for (uint32_t cur_pmu = 0; cur_pmu < map->event_table.num_pmus; cur_pmu++)
+        {
+            const struct pmu_table_entry* entry = &map->event_table.pmus[cur_pmu];
+            for (uint32_t x = 0; x < entry->num_entries; x++)
+            {
+                decompress_event_hot(entry->entries[x].offset, &ev);
+                if (ev.event != NULL && strstr(ev.event, "period=") != NULL)
+                {
+                    REQUIRE(get_event_period(&ev, &period) == 0);
+                    num_periods++;
+                }
+            }
+        }
+#ifdef __x86_64__
+        REQUIRE(num_periods > 0);
+#endif
+    }
+
+    TEST_CASE("sampler_consume decodes the samples of the ring buffer");
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_SOFTWARE;
+        attr.config = PERF_COUNT_SW_TASK_CLOCK;
+        attr.sample_period = 100000;
+
+        /* A ring buffer of one page, so that it wraps around */
+        struct sampler sampler;
+        REQUIRE(open_sampler(&sampler, &attr, 0, -1, 3) == -1);
+        REQUIRE(open_sampler(&sampler, &attr, 0, -1, 1) == 0);
+        REQUIRE(sampler_enable(&sampler) == 0);
+
+        size_t num_samples = 0;
+        size_t num_consumed = 0;
+        for (int i = 0; i < 100; i++)
+        {
+            /* Spin for 1ms of task clock */
+            struct timespec start, now;
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+            do
+            {
+                clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+            } while ((now.tv_sec - start.tv_sec) * 1000000000 + now.tv_nsec - start.tv_nsec <
+                     1000000);
+            num_consumed += sampler_consume(&sampler, count_sample, &num_samples);
+        }
+        REQUIRE(sampler_disable(&sampler) == 0);
+        num_consumed += sampler_consume(&sampler, count_sample, &num_samples);
+
+        /* 100ms of task clock with a sample every 100us */
+        REQUIRE(num_samples == num_consumed);
+        REQUIRE(num_samples + sampler.num_lost > 500);
+        REQUIRE(sampler.meta->data_tail == sampler.meta->data_head);
+        REQUIRE(sampler.meta->data_tail > sampler.data_size);
+        close_sampler(&sampler);
+    }
+
+    TEST_CASE("self_monitor measures regions of the calling thread");
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_SOFTWARE;
+        attr.config = PERF_COUNT_SW_TASK_CLOCK;
+
+        struct self_monitor monitor;
+        init_self_monitor(&monitor);
+        REQUIRE(self_monitor_add_attr(&monitor, &attr, "task-clock") == 0);
+        REQUIRE(strcmp(monitor.events[0].name, "task-clock") == 0);
+        /* Software events have no hardware counter to read from user space */
+        REQUIRE(!self_monitor_user_read(&monitor, 0));
+
+        /* Events which may be read with rdpmc, if this system has a core PMU */
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        attr.exclude_kernel = 1;
+        int instructions = self_monitor_add_attr(&monitor, &attr, "instructions");
+
+        /* Unknown events are not added */
+        struct pmu_format format;
+        struct pmu_instance instance;
+        REQUIRE(make_test_instance(PERF_TYPE_RAW, "config:0-7", &format, &instance) == 0);
+        size_t num_events = monitor.num_events;
+        REQUIRE(self_monitor_add_event(&monitor, &instance, "not.an.event") == -1);
+        REQUIRE(monitor.num_events == num_events);
+        free_config_def(&format.def);
+
+        struct event_delta deltas[2];
+        REQUIRE(self_monitor_begin(&monitor) == 0);
+        struct timespec start, now;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+        do
+        {
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+        } while ((now.tv_sec - start.tv_sec) * 1000000000 + now.tv_nsec - start.tv_nsec <
+                 1000000);
+        REQUIRE(self_monitor_end(&monitor, deltas) == 0);
+        REQUIRE(deltas[0].raw >= 1000000 && deltas[0].ratio > 0);
+
+        if (instructions != -1)
+        {
+            REQUIRE(deltas[instructions].raw > 0);
+
+            /* The user space read agrees with read() */
+            struct event_count count;
+            uint64_t buf[3];
+            REQUIRE(self_monitor_read(&monitor, instructions, &count) == 0);
+            REQUIRE(read(monitor.events[instructions].fd, buf, sizeof(buf)) == sizeof(buf));
+            REQUIRE(buf[0] >= count.value && buf[1] >= count.time_enabled);
+        }
+        free_self_monitor(&monitor);
+        REQUIRE(monitor.num_events == 0 && monitor.events == NULL);
+    }
+
+    TEST_CASE("schedule_event_groups packs events into the counters");
+    {
+        struct pmu_class pmu_class = { .name = "default_core" };
+        pmu_class.counters_num_gp = 4;
+        pmu_class.counters_num_fixed = 3;
+
+        struct pmu_event evs[6] = { 0 };
+        evs[0].counters = "0,1,2,3";
+        evs[1].counters = "0,1,2,3";
+        evs[2].counters = "2,3";
+        evs[3].counters = "Fixed counter 1";
+        evs[4].counters = "2,3";
+        evs[5].counters = NULL;
+
+        size_t groups[6];
+        REQUIRE(schedule_event_groups(&pmu_class, evs, 6, groups) == 2);
+        /* Only two events fit on the counters 2 and 3 of a group */
+        REQUIRE(groups[2] == groups[4]);
+        REQUIRE(groups[0] != groups[2] || groups[1] != groups[2] || groups[5] != groups[2]);
+
+        REQUIRE(schedule_event_groups(&pmu_class, evs, 5, groups) == 1);
+
+        evs[0].counters = "0";
+        evs[1].counters = "0";
+        REQUIRE(schedule_event_groups(&pmu_class, evs, 2, groups) == 2);
+        REQUIRE(groups[0] != groups[1]);
+
+        evs[0].counters = "7";
+        REQUIRE(schedule_event_groups(&pmu_class, evs, 1, groups) == -1);
+
+        pmu_class.counters_num_gp = 0;
+        pmu_class.counters_num_fixed = 0;
+        evs[0].counters = NULL;
+        REQUIRE(schedule_event_groups(&pmu_class, evs, 1, groups) == -1);
+    }
+
+#ifdef __x86_64__
+    TEST_CASE("Event tables contain the counter layouts");
+    {
+        setenv("PERF_CPUID", TEST_CPUID, 1);
+        struct perf_cpu cpu = { .cpu = -1 };
+        const struct pmu_events_map* map = map_for_cpu(cpu);
+        unsetenv("PERF_CPUID");
+        REQUIRE(map != NULL);
+
+        const struct pmu_layout* core_layout = NULL;
+        for (uint32_t x = 0; x < map->layout_table.num_entries; x++)
+        {
+            if (strcmp(map->layout_table.entries[x].pmu, "default_core") == 0)
+            {
+                core_layout = &map->layout_table.entries[x];
+            }
+        }
+        REQUIRE(core_layout != NULL);
+        REQUIRE(core_layout->counters_num_gp == 4 && core_layout->counters_num_fixed == 3);
+
+        struct pmu_instance instance = { 0 };
+        instance.entries = map->event_table.pmus[0].entries;
+        instance.num_entries = map->event_table.pmus[0].num_entries;
+        struct pmu_event ev;
+        REQUIRE(get_event_by_name(&instance, "inst_retired.any", &ev) == 0);
+        REQUIRE(strcmp(ev.counters, "Fixed counter 0") == 0);
+    }
+#endif
+
+    TEST_CASE("attr_cache round-trips the generated attrs");
+    {
+        setenv("PERF_CPUID", TEST_CPUID, 1);
+        struct perf_cpu cpu = { .cpu = -1 };
+        const struct pmu_events_map* map = map_for_cpu(cpu);
+        REQUIRE(map != NULL);
+
+        struct pmu_format formats[2];
+        formats[0].name = "event";
+        REQUIRE(parse_config_def("config:0-7", &formats[0].def) != -1);
+        formats[1].name = "umask";
+        REQUIRE(parse_config_def("config:8-15", &formats[1].def) != -1);
+
+        struct range cpus = { .start = 0, .end = 3 };
+        struct pmu_instance instance = { 0 };
+        instance.name = "cpu";
+        instance.type = 4;
+        instance.formats = formats;
+        instance.num_formats = 2;
+        instance.cpus.len = 1;
+        instance.cpus.ranges = &cpus;
+        instance.entries = map->event_table.pmus[0].entries;
+        instance.num_entries = map->event_table.pmus[0].num_entries;
+
+        struct pmu_class pmu_class = { .name = "default_core" };
+        pmu_class.instances = &instance;
+        pmu_class.num_instances = 1;
+        struct pmus pmus = { .num_classes = 1, .classes = &pmu_class };
+
+        char path[] = "/tmp/pmu-events-attr-cache-XXXXXX";
+        int fd = mkstemp(path);
+        REQUIRE(fd != -1);
+        close(fd);
+        REQUIRE(write_attr_cache(&pmus, path) == 0);
+
+        struct attr_cache cache;
+        REQUIRE(open_attr_cache(path, &cache) == 0);
+
+        size_t num_ranges = 0;
+        const struct range* ranges = attr_cache_get_cpus(&cache, "cpu", &num_ranges);
+        REQUIRE(ranges != NULL && num_ranges == 1);
+        REQUIRE(ranges[0].start == 0 && ranges[0].end == 3);
+        REQUIRE(attr_cache_get_cpus(&cache, "uncore_cha_0", &num_ranges) == NULL);
+
+        size_t num_cached = 0;
+        for (uint32_t x = 0; x < instance.num_entries; x++)
+        {
+            struct pmu_event ev;
+            decompress_event(instance.entries[x].offset, &ev);
+
+            struct perf_event_attr expected;
+            memset(&expected, 0, sizeof(expected));
+            expected.size = sizeof(expected);
+            const struct perf_event_attr* attr = attr_cache_get(&cache, "cpu", ev.name);
+            if (gen_attr_for_event(&instance, &ev, &expected) == -1)
+            {
+                REQUIRE(attr == NULL);
+                continue;
+            }
+            REQUIRE(attr != NULL);
+            REQUIRE(memcmp(attr, &expected, sizeof(expected)) == 0);
+            num_cached++;
+        }
+        REQUIRE(num_cached > 0);
+        REQUIRE(attr_cache_get(&cache, "cpu", "not.an.event") == NULL);
+        REQUIRE(attr_cache_get(&cache, "uncore_cha_0", "inst_retired.any") == NULL);
+        close_attr_cache(&cache);
+
+        /* A cache written for another CPU must not be used */
+        setenv("PERF_CPUID", "GenuineIntel-6-00-0", 1);
+        REQUIRE(open_attr_cache(path, &cache) == -1);
+        setenv("PERF_CPUID", TEST_CPUID, 1);
+
+        /* Neither must a truncated one */
+        REQUIRE(truncate(path, 64) == 0);
+        REQUIRE(open_attr_cache(path, &cache) == -1);
+        unsetenv("PERF_CPUID");
+
+        unlink(path);
+        free_config_def(&formats[0].def);
+        free_config_def(&formats[1].def);
+    }
+
+#ifdef __x86_64__
+    TEST_CASE("map_for_cpu matches the mapfile patterns like strcmp_cpuid_str");
+    {
+        static const struct
+        {
+            const char* vendor;
+            int family;
+        } cpus[] = { { "GenuineIntel", 6 },
+                     { "AuthenticAMD", 23 },
+                     { "AuthenticAMD", 25 },
+                     { "AuthenticAMD", 26 } };
+        static const char* steppings[] = { "", "-0", "-4", "-5", "-F" };
+
+        for (size_t i = 0; i < sizeof(cpus) / sizeof(cpus[0]); i++)
+        {
+            for (int model = 0; model < 256; model++)
+            {
+                for (size_t x = 0; x < sizeof(steppings) / sizeof(steppings[0]); x++)
+                {
+                    char cpuid[64];
+                    snprintf(cpuid, sizeof(cpuid), "%s-%d-%X%s", cpus[i].vendor, cpus[i].family,
+                             model, steppings[x]);
+
+                    const struct pmu_events_map* expected = NULL;
+                    for (const struct pmu_events_map* map = pmu_events_map; map->arch; map++)
+                    {
+                        if (strcmp_cpuid_str(map->cpuid, cpuid) == 0)
+                        {
+                            expected = map;
+                            break;
+                        }
+                    }
+
+                    setenv("PERF_CPUID", cpuid, 1);
+                    struct perf_cpu cpu = { .cpu = -1 };
+                    const struct pmu_events_map* map = map_for_cpu(cpu);
+                    unsetenv("PERF_CPUID");
+                    REQUIRE(map == expected);
+                }
+            }
+        }
+    }
+#endif
+
+    TEST_CASE("get_pmus_from replays a sysfs snapshot like the captured directory");
+    {
+        static const char* const files[][2] = {
+            { "cpu/type", "4" },
+            { "cpu/format/event", "config:0-7" },
+            { "cpu/format/umask", "config:8-15" },
+            { "uncore_imc_0/type", "12" },
+            { "uncore_imc_0/cpumask", "0" },
+            { "uncore_imc_0/format/event", "config:0-7" },
+            { "uncore_imc_1/type", "13" },
+            { "uncore_imc_1/cpumask", "0" },
+            { "uncore_imc_1/format/event", "config:0-7" },
+            { "software/type", "1" },
+        };
+
+        char root[] = "/tmp/pmu-events-sysfs-XXXXXX";
+        REQUIRE(mkdtemp(root) != NULL);
+        for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+        {
+            REQUIRE(write_test_file(root, files[i][0], files[i][1]) == 0);
+        }
+
+        setenv("PERF_CPUID", TEST_CPUID, 1);
+        struct pmu_sysfs dir_sysfs = { .root = root };
+        struct pmus dir_pmus;
+        REQUIRE(get_pmus_from(&dir_sysfs, &dir_pmus) == 0);
+        const struct pmu_instance* cpu = find_test_instance(&dir_pmus, "cpu");
+        REQUIRE(cpu != NULL && cpu->type == 4 && cpu->num_formats == 2);
+#ifdef __x86_64__
+        REQUIRE(find_test_instance(&dir_pmus, "uncore_imc_1") != NULL);
+#endif
+
+        char path[] = "/tmp/pmu-events-snapshot-XXXXXX";
+        int fd = mkstemp(path);
+        REQUIRE(fd != -1);
+        close(fd);
+        REQUIRE(write_sysfs_snapshot(root, path) == 0);
+        unsetenv("PERF_CPUID");
+
+        /* The snapshot carries the CPU identifier, PERF_CPUID is not needed anymore */
+        struct sysfs_snapshot snapshot;
+        REQUIRE(open_sysfs_snapshot(path, &snapshot) == 0);
+        const char* cpuid = get_sysfs_snapshot_value(&snapshot, "cpuid.0");
+        REQUIRE(cpuid != NULL && strcmp(cpuid, TEST_CPUID) == 0);
+        const char* format = get_sysfs_snapshot_value(&snapshot, "cpu/format/umask");
+        REQUIRE(format != NULL && strcmp(format, "config:8-15") == 0);
+        REQUIRE(get_sysfs_snapshot_value(&snapshot, "cpu/cpumask") == NULL);
+
+        struct pmu_sysfs snapshot_sysfs = { .snapshot = &snapshot };
+        struct pmus snapshot_pmus;
+        REQUIRE(get_pmus_from(&snapshot_sysfs, &snapshot_pmus) == 0);
+        REQUIRE(snapshot_pmus.num_classes == dir_pmus.num_classes);
+        for (size_t i = 0; i < dir_pmus.num_classes; i++)
+        {
+            for (int x = 0; x < dir_pmus.classes[i].num_instances; x++)
+            {
+                const struct pmu_instance* expected = &dir_pmus.classes[i].instances[x];
+                const struct pmu_instance* instance =
+                    find_test_instance(&snapshot_pmus, expected->name);
+                REQUIRE(instance != NULL);
+                REQUIRE(instance->type == expected->type);
+                REQUIRE(instance->num_entries == expected->num_entries);
+                REQUIRE(instance->num_formats == expected->num_formats);
+            }
+        }
+        setenv("PERF_CPUID", TEST_CPUID, 1);
+        uint64_t snapshot_hash, dir_hash;
+        REQUIRE(hash_pmu_devices_from(&snapshot_sysfs, &snapshot_hash) == 0);
+        REQUIRE(hash_pmu_devices_from(&dir_sysfs, &dir_hash) == 0);
+        REQUIRE(snapshot_hash == dir_hash);
+
+        /* CPU hotplug and other formats change the hash, missing devices fail it */
+        REQUIRE(write_test_file(root, "uncore_imc_0/cpumask", "1") == 0);
+        REQUIRE(hash_pmu_devices_from(&dir_sysfs, &snapshot_hash) == 0);
+        REQUIRE(snapshot_hash != dir_hash);
+        REQUIRE(write_test_file(root, "uncore_imc_0/cpumask", "0") == 0);
+        REQUIRE(write_test_file(root, "cpu/format/umask", "config:8-16") == 0);
+        REQUIRE(hash_pmu_devices_from(&dir_sysfs, &snapshot_hash) == 0);
+        REQUIRE(snapshot_hash != dir_hash);
+        REQUIRE(write_test_file(root, "cpu/format/umask", "config:8-15") == 0);
+        REQUIRE(hash_pmu_devices_from(&dir_sysfs, &snapshot_hash) == 0);
+        REQUIRE(snapshot_hash == dir_hash);
+        struct pmu_sysfs missing_sysfs = { .root = "/nonexistent" };
+        REQUIRE(hash_pmu_devices_from(&missing_sysfs, &snapshot_hash) == -1);
+        unsetenv("PERF_CPUID");
+        free_pmus(&snapshot_pmus);
+        free_pmus(&dir_pmus);
+        close_sysfs_snapshot(&snapshot);
+        unlink(path);
+
+        /* Files without the header or with lines without values are rejected */
+        char bad_path[64];
+        snprintf(bad_path, sizeof(bad_path), "%s/bad", root);
+        REQUIRE(write_test_file(root, "bad", "cpu/type 4") == 0);
+        REQUIRE(open_sysfs_snapshot(bad_path, &snapshot) == -1);
+        REQUIRE(write_test_file(root, "bad", "pmu-events-sysfs-snapshot 1\ncpu/type") == 0);
+        REQUIRE(open_sysfs_snapshot(bad_path, &snapshot) == -1);
+
+        char cmd[64];
+        snprintf(cmd, sizeof(cmd), "rm -r %s", root);
+        REQUIRE(system(cmd) == 0);
+    }
+
+    TEST_CASE("get_pmus_from attaches the core events of every kind of core");
+    {
+        /* Two kinds of cores with their own core PMU, and one of an unknown model */
+#ifdef __aarch64__
+        static const char* const cpuids[] = { "0x00000000410fd050", "0x00000000410fd0b0",
+                                              "0x00000000410fffff" };
+#else
+        static const char* const cpuids[] = { "GenuineIntel-6-55-4", "GenuineIntel-6-6A-6",
+                                              "GenuineIntel-6-FF-0" };
+#endif
+        static const char* const names[] = { "armv8_cortex_a55", "armv8_cortex_a76",
+                                             "armv8_unknown" };
+
+        char root[] = "/tmp/pmu-events-sysfs-XXXXXX";
+        REQUIRE(mkdtemp(root) != NULL);
+        char content[1024];
+        int len = snprintf(content, sizeof(content), "pmu-events-sysfs-snapshot 1\nonline_cpus 3");
+        for (int i = 0; i < 3; i++)
+        {
+            len += snprintf(content + len, sizeof(content) - len,
+                            "\ncpuid.%d %s\n%s/type %d\n%s/cpus %d\n%s/format/event config:0-15",
+                            i, cpuids[i], names[i], 8 + i, names[i], i, names[i]);
+        }
+        REQUIRE(write_test_file(root, "snapshot", content) == 0);
+
+        char path[64];
+        snprintf(path, sizeof(path), "%s/snapshot", root);
+        struct sysfs_snapshot snapshot;
+        REQUIRE(open_sysfs_snapshot(path, &snapshot) == 0);
+        struct pmu_sysfs sysfs = { .snapshot = &snapshot };
+        struct pmus pmus;
+        REQUIRE(get_pmus_from(&sysfs, &pmus) == 0);
+
+        /* The instance of CPU 0 and the one of the unknown model get the table of CPU 0 */
+        const struct pmu_events_map* maps[] = { map_for_cpuid(cpuids[0]),
+                                                map_for_cpuid(cpuids[1]),
+                                                map_for_cpuid(cpuids[0]) };
+        REQUIRE(maps[0] != NULL && maps[1] != NULL && maps[0] != maps[1]);
+        REQUIRE(map_for_cpuid(cpuids[2]) == NULL);
+        for (int i = 0; i < 3; i++)
+        {
+            const struct pmu_instance* instance = find_test_instance(&pmus, names[i]);
+            REQUIRE(instance != NULL);
+            const struct pmu_table_entry* entry = NULL;
+            for (uint32_t x = 0; x < maps[i]->event_table.num_pmus; x++)
+            {
+                if (strcmp(get_pmu_name(maps[i]->event_table.pmus[x]), "default_core") == 0)
+                {
+                    entry = &maps[i]->event_table.pmus[x];
+                }
+            }
+            REQUIRE(entry != NULL);
+            REQUIRE(instance->entries == entry->entries);
+            REQUIRE(instance->num_entries == entry->num_entries);
+        }
+        free_pmus(&pmus);
+        close_sysfs_snapshot(&snapshot);
+
+        char cmd[64];
+        snprintf(cmd, sizeof(cmd), "rm -r %s", root);
+        REQUIRE(system(cmd) == 0);
+    }
+
+    TEST_CASE("parse_event resolves the PMU, the terms and the modifiers of perf event strings");
+    {
+        static const char* const files[][2] = {
+            { "cpu/type", "4" },
+            { "cpu/format/event", "config:0-7" },
+            { "cpu/format/umask", "config:8-15" },
+            { "cpu/format/edge", "config:18" },
+            { "cpu/format/cmask", "config:24-31" },
+            { "uncore_imc_0/type", "12" },
+            { "uncore_imc_0/cpumask", "0" },
+            { "uncore_imc_0/format/event", "config:0-7" },
+            { "uncore_imc_0/format/umask", "config:8-15" },
+            { "uncore_imc_1/type", "13" },
+            { "uncore_imc_1/cpumask", "0" },
+            { "uncore_imc_1/format/event", "config:0-7" },
+            { "uncore_imc_1/format/umask", "config:8-15" },
+        };
+
+        char root[] = "/tmp/pmu-events-sysfs-XXXXXX";
+        REQUIRE(mkdtemp(root) != NULL);
+        for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+        {
+            REQUIRE(write_test_file(root, files[i][0], files[i][1]) == 0);
+        }
+        setenv("PERF_CPUID", TEST_CPUID, 1);
+        struct pmu_sysfs sysfs = { .root = root };
+        struct pmus pmus;
+        REQUIRE(get_pmus_from(&sysfs, &pmus) == 0);
+        unsetenv("PERF_CPUID");
+        const struct pmu_instance* cpu = find_test_instance(&pmus, "cpu");
+        REQUIRE(cpu != NULL);
+
+        struct parsed_event ev;
+        REQUIRE(parse_event(&pmus, "cpu/event=0x3c,umask=0x1/u", &ev) == 0);
+        REQUIRE(ev.pmu_instance == cpu && ev.attr.type == 4 && ev.attr.config == 0x13c);
+        REQUIRE(ev.attr.size == sizeof(ev.attr));
+        REQUIRE(!ev.attr.exclude_user && ev.attr.exclude_kernel && ev.attr.exclude_hv);
+        REQUIRE(parse_event(&pmus, "cpu/event=0x3c,edge,cmask=10/", &ev) == 0);
+        REQUIRE(ev.attr.config == (0x3c | 1 << 18 | 10 << 24));
+        REQUIRE(!ev.attr.exclude_user && !ev.attr.exclude_kernel);
+        REQUIRE(parse_event(&pmus, "cpu/config=0x1234,period=100000,name=x/pp", &ev) == 0);
+        REQUIRE(ev.attr.config == 0x1234 && ev.attr.sample_period == 100000);
+        REQUIRE(ev.attr.precise_ip == 2);
+        /* Leading zeros are decimal, not octal */
+        REQUIRE(parse_event(&pmus, "cpu/event=0x3c,umask=010/", &ev) == 0);
+        REQUIRE(ev.attr.config == (0x3c | 10 << 8));
+        REQUIRE(parse_event(&pmus, "cpu/event=0x3c,umask=0x0x1/", &ev) == -1);
+        REQUIRE(parse_event(&pmus, "cpu/event=0x3c,umask=-1/", &ev) == -1);
+        REQUIRE(parse_event(&pmus, "cpu/event=0x3c,umask=0xa/", &ev) == 0);
+        REQUIRE(ev.attr.config == (0x3c | 0xa << 8));
+
+        /* Generic events */
+        REQUIRE(parse_event(&pmus, "cycles:kG", &ev) == 0);
+        REQUIRE(ev.pmu_instance == NULL && ev.attr.type == PERF_TYPE_HARDWARE);
+        REQUIRE(ev.attr.config == PERF_COUNT_HW_CPU_CYCLES);
+        REQUIRE(ev.attr.exclude_user && !ev.attr.exclude_kernel);
+        REQUIRE(!ev.attr.exclude_guest && ev.attr.exclude_host);
+        REQUIRE(parse_event(&pmus, "Task-Clock:S", &ev) == 0);
+        REQUIRE(ev.attr.type == PERF_TYPE_SOFTWARE && ev.attr.config == PERF_COUNT_SW_TASK_CLOCK);
+        REQUIRE(ev.attr.sample_type == PERF_SAMPLE_READ);
+
+        static const char* const malformed[] = {
+            "cpu/event=0x3c", "cpu/event=0x3c/x", "cpu/event=zz/",     "cpu/foo=1/",
+            "cpu/event=1,,/", "nope/event=1/",    "cpu/not.an.event/", "cycles:pppp",
+            "not.an.event",   "",
+        };
+        for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++)
+        {
+            REQUIRE(parse_event(&pmus, malformed[i], &ev) == -1);
+        }
+
+#ifdef __x86_64__
+        /* Events of the tables, with and without a PMU */
+        struct pmu_event table_ev;
+        struct perf_event_attr expected;
+        memset(&expected, 0, sizeof(expected));
+        REQUIRE(get_event_by_name(cpu, "inst_retired.any", &table_ev) == 0);
+        REQUIRE(gen_attr_for_event(cpu, &table_ev, &expected) == 0);
+        REQUIRE(parse_event(&pmus, "INST_RETIRED.ANY:k", &ev) == 0);
+        REQUIRE(ev.pmu_instance == cpu && ev.attr.config == expected.config);
+        REQUIRE(ev.attr.exclude_user && !ev.attr.exclude_kernel);
+
+        const struct pmu_instance* imc = find_test_instance(&pmus, "uncore_imc_0");
+        REQUIRE(imc != NULL);
+        memset(&expected, 0, sizeof(expected));
+        REQUIRE(get_event_by_name(imc, "unc_m_cas_count.rd", &table_ev) == 0);
+        REQUIRE(gen_attr_for_event(imc, &table_ev, &expected) == 0);
+        REQUIRE(parse_event(&pmus, "uncore_imc/unc_m_cas_count.rd/", &ev) == 0);
+        REQUIRE(ev.pmu_instance == imc && strcmp(ev.pmu_class->name, "uncore_imc") == 0);
+        REQUIRE(ev.attr.type == 12 && ev.attr.config == expected.config);
+        /* Terms after the name override the fields of the event */
+        REQUIRE(parse_event(&pmus, "uncore_imc_1/unc_m_cas_count.rd,umask=0x1/", &ev) == 0);
+        REQUIRE(ev.attr.type == 13 && ev.attr.config == ((expected.config & ~0xff00) | 0x100));
+#endif
+
+        /* Repeated strings come from the cache */
+        struct event_parser parser;
+        init_event_parser(&parser, &pmus);
+        for (int i = 0; i < 100; i++)
+        {
+            char str[64];
+            snprintf(str, sizeof(str), "cpu/event=%d,umask=0x%x/k", i % 40, i % 40);
+            struct parsed_event expected_ev;
+            REQUIRE(parse_event(&pmus, str, &expected_ev) == 0);
+            REQUIRE(event_parser_parse(&parser, str, &ev) == 0);
+            REQUIRE(memcmp(&ev.attr, &expected_ev.attr, sizeof(ev.attr)) == 0);
+            REQUIRE(ev.pmu_instance == cpu);
+        }
+        REQUIRE(parser.num_entries == 40 && parser.num_buckets >= 80);
+        REQUIRE(event_parser_parse(&parser, "cpu/foo=1/", &ev) == -1);
+        REQUIRE(parser.num_entries == 40);
+        free_event_parser(&parser);
+
+        free_pmus(&pmus);
+        char cmd[64];
+        snprintf(cmd, sizeof(cmd), "rm -r %s", root);
+        REQUIRE(system(cmd) == 0);
+    }
+
+    TEST_CASE("sys_pmu_name_match follows the instance naming rules of perf");
+    {
+        REQUIRE(is_valid_pmu_suffix(""));
+        REQUIRE(is_valid_pmu_suffix("0") && is_valid_pmu_suffix("_12"));
+        REQUIRE(is_valid_pmu_suffix("_1f0") && is_valid_pmu_suffix("deadbeef"));
+        /* Hex suffixes need more than two digits, so that e.g. "_ab" is not a suffix */
+        REQUIRE(!is_valid_pmu_suffix("_1f") && !is_valid_pmu_suffix("ab"));
+        REQUIRE(!is_valid_pmu_suffix("_") && !is_valid_pmu_suffix("_x1"));
+
+        REQUIRE(sys_pmu_name_match("imx8_ddr", "imx8_ddr0"));
+        REQUIRE(sys_pmu_name_match("imx8_ddr", "imx8_ddr"));
+        REQUIRE(sys_pmu_name_match("imx8_ddr", "imx8_ddr_3c000"));
+        REQUIRE(!sys_pmu_name_match("imx8_ddr", "imx8_ddr_ab"));
+        REQUIRE(!sys_pmu_name_match("imx8_ddr", "imx8_ddrx0"));
+        REQUIRE(!sys_pmu_name_match("imx8_ddr", "imx9_ddr0"));
+        /* Comma separated tokens have to appear in order */
+        REQUIRE(sys_pmu_name_match("hisi_sicl,cpa", "hisi_sicl2_cpa0"));
+        REQUIRE(!sys_pmu_name_match("hisi_sicl,cpa", "hisi_sicl2_ddrc0"));
+        REQUIRE(!sys_pmu_name_match("hisi_sicl,cpa", "hisi_cpa0_sicl2"));
+        REQUIRE(!sys_pmu_name_match("hisi_sicl,cpa", "hisi_sicl2_cpa0x"));
+
+        /* Compat strings are regular expressions matching the whole identifier */
+        REQUIRE(test_identifier_match("(434|436|43c|43a).*", "43601"));
+        REQUIRE(!test_identifier_match("(434|436|43c|43a).*", "0436"));
+        REQUIRE(test_identifier_match("0x01", "0x01"));
+        REQUIRE(!test_identifier_match("0x01", "0x012") && !test_identifier_match("0x01", "x0x01"));
+        REQUIRE(!test_identifier_match("(", "("));
+    }
+
+    TEST_CASE("get_pmus_from matches the system PMUs of the SoC tables");
+    {
+        static const char* const files[][2] = {
+            { "cpu/type", "4" },
+            { "cpu/format/event", "config:0-7" },
+            /* The test SoC tables of every build */
+            { "uncore_sys_cmn_pmu_0/type", "20" },
+            { "uncore_sys_cmn_pmu_0/identifier", "43601" },
+            { "uncore_sys_cmn_pmu_1/type", "21" },
+            { "uncore_sys_cmn_pmu_1/identifier", "999" },
+            { "uncore_sys_ccn_pmu_4/type", "22" },
+            { "uncore_sys_ccn_pmu_4/identifier", "0x01" },
+            { "uncore_sys_ccn_pmu_ab/type", "23" },
+            { "uncore_sys_ccn_pmu_ab/identifier", "0x01" },
+#ifdef __aarch64__
+            { "imx8_ddr0/type", "24" },
+            { "imx8_ddr0/identifier", "i.MX8MM" },
+            { "hisi_sicl2_cpa0/type", "25" },
+            { "hisi_sicl2_cpa0/identifier", "0x00000030" },
+#endif
+        };
+
+        char root[] = "/tmp/pmu-events-sysfs-XXXXXX";
+        REQUIRE(mkdtemp(root) != NULL);
+        for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+        {
+            REQUIRE(write_test_file(root, files[i][0], files[i][1]) == 0);
+        }
+        setenv("PERF_CPUID", TEST_CPUID, 1);
+        struct pmu_sysfs sysfs = { .root = root };
+        struct pmus pmus;
+        REQUIRE(get_pmus_from(&sysfs, &pmus) == 0);
+        unsetenv("PERF_CPUID");
+
+        /* Only the instances with a matching name and identifier */
+        const struct pmu_instance* cmn = find_test_instance(&pmus, "uncore_sys_cmn_pmu_0");
+        REQUIRE(cmn != NULL && cmn->type == 20);
+        REQUIRE(find_test_instance(&pmus, "uncore_sys_cmn_pmu_1") == NULL);
+        const struct pmu_instance* ccn = find_test_instance(&pmus, "uncore_sys_ccn_pmu_4");
+        REQUIRE(ccn != NULL && ccn->type == 22);
+        REQUIRE(find_test_instance(&pmus, "uncore_sys_ccn_pmu_ab") == NULL);
+        struct pmu_event ev;
+        REQUIRE(get_event_by_name(cmn, "sys_cmn_pmu.hnf_cache_miss", &ev) == 0);
+        REQUIRE(get_event_by_name(ccn, "sys_ccn_pmu.read_cycles", &ev) == 0);
+
+#ifdef __aarch64__
+        const struct pmu_instance* ddr = find_test_instance(&pmus, "imx8_ddr0");
+        REQUIRE(ddr != NULL && ddr->type == 24);
+        REQUIRE(get_event_by_name(ddr, "imx8mm_ddr.cycles", &ev) == 0);
+        const struct pmu_instance* cpa = find_test_instance(&pmus, "hisi_sicl2_cpa0");
+        REQUIRE(cpa != NULL && cpa->type == 25);
+        REQUIRE(get_event_by_name(cpa, "cpa_cycles", &ev) == 0);
+#endif
+
+        free_pmus(&pmus);
+        char cmd[64];
+        snprintf(cmd, sizeof(cmd), "rm -r %s", root);
+        REQUIRE(system(cmd) == 0);
+    }
+
     TEST_CASE("get_format_file_content works")
     {
         struct pmus pmus;
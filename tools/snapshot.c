@@ -0,0 +1,126 @@
+#include <pmu-events/attr-cache.h>
+#include <pmu-events/pmu-events.h>
+#include <pmu-events/sysfs.h>
+
+#include <stdio.h>
+#include <string.h>
+
+void print_help()
+{
+    fprintf(stderr, "./pmu-events-snapshot COMMAND [ARGS]\n");
+    fprintf(stderr, "./pmu-events-snapshot capture SNAPSHOT [DEVICES_DIR]\n");
+    fprintf(stderr, "./pmu-events-snapshot list SNAPSHOT\n");
+    fprintf(stderr, "./pmu-events-snapshot attr-cache SNAPSHOT CACHE\n");
+}
+
+/*
+ * Captures the PMU devices of this system, or those in "root", into "path"
+ */
+int capture(const char* path, const char* root)
+{
+    if (write_sysfs_snapshot(root, path) == -1)
+    {
+        perror("Could not write the snapshot");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Lists the PMU classes and instances of the system captured in "path"
+ */
+int list(const char* path)
+{
+    struct sysfs_snapshot snapshot;
+    if (open_sysfs_snapshot(path, &snapshot) == -1)
+    {
+        fprintf(stderr, "Could not read the snapshot %s\n", path);
+        return -1;
+    }
+
+    struct pmu_sysfs sysfs = { .snapshot = &snapshot };
+    struct pmus pmus;
+    if (get_pmus_from(&sysfs, &pmus) == -1)
+    {
+        fprintf(stderr, "Could not get the PMUs of the snapshot\n");
+        close_sysfs_snapshot(&snapshot);
+        return -1;
+    }
+
+    const char* cpuid = get_sysfs_snapshot_value(&snapshot, "cpuid.0");
+    printf("CPUID: %s\n", cpuid != NULL ? cpuid : "unknown");
+    for (size_t i = 0; i < pmus.num_classes; i++)
+    {
+        printf("%s\n", pmus.classes[i].name);
+        for (int x = 0; x < pmus.classes[i].num_instances; x++)
+        {
+            const struct pmu_instance* instance = &pmus.classes[i].instances[x];
+            printf("  %s: type %d, %u events, %zu formats\n", instance->name, instance->type,
+                   instance->num_entries, instance->num_formats);
+        }
+    }
+
+    free_pmus(&pmus);
+    close_sysfs_snapshot(&snapshot);
+    return 0;
+}
+
+/*
+ * Writes the attr cache of the system captured in "path" to "cache_path"
+ */
+int attr_cache(const char* path, const char* cache_path)
+{
+    struct sysfs_snapshot snapshot;
+    if (open_sysfs_snapshot(path, &snapshot) == -1)
+    {
+        fprintf(stderr, "Could not read the snapshot %s\n", path);
+        return -1;
+    }
+
+    int ret = -1;
+    struct pmu_sysfs sysfs = { .snapshot = &snapshot };
+    struct pmus pmus;
+    if (get_pmus_from(&sysfs, &pmus) == 0)
+    {
+        ret = write_attr_cache_for(&pmus, &sysfs, cache_path);
+        free_pmus(&pmus);
+    }
+    if (ret == -1)
+    {
+        fprintf(stderr, "Could not write the attr cache %s\n", cache_path);
+    }
+
+    close_sysfs_snapshot(&snapshot);
+    return ret;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "%s needs arguments: \n", argv[0]);
+        print_help();
+        return -1;
+    }
+
+    if (strcmp(argv[1], "capture") == 0)
+    {
+        return capture(argv[2], argc > 3 ? argv[3] : NULL);
+    }
+    else if (strcmp(argv[1], "list") == 0)
+    {
+        return list(argv[2]);
+    }
+    else if (strcmp(argv[1], "attr-cache") == 0)
+    {
+        if (argc < 4)
+        {
+            fprintf(stderr, "\"attr-cache\" command needs a snapshot and a cache file!\n");
+            return -1;
+        }
+        return attr_cache(argv[2], argv[3]);
+    }
+
+    fprintf(stderr, "Unknown command: %s\n", argv[1]);
+    return -1;
+}